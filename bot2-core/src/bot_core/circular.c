@@ -53,10 +53,13 @@ void bot_circular_clear(BotCircular* circular) {
 }
 
 int bot_circular_push_head(BotCircular* circular, const void* data) {
-  circular->head--;
-  if (circular->head < 0) {
-    circular->head = circular->capacity - 1;
+  // compute the new head before storing it so that the head index is always
+  // valid, even when observed mid-update
+  int head = circular->head - 1;
+  if (head < 0) {
+    head = circular->capacity - 1;
   }
+  circular->head = head;
 
   if (circular->len < circular->capacity) {
     circular->len++;
@@ -97,4 +100,25 @@ int bot_circular_pop_head(BotCircular* circular, void* data) {
   return 0;
 }
 
+int bot_circular_set_capacity(BotCircular* circular, int capacity) {
+  void* array = calloc(capacity, circular->element_size);
+  if (!array) {
+    return -1;
+  }
+
+  // copy the elements nearest the head, so that the head ends up at index 0
+  int len = circular->len < capacity ? circular->len : capacity;
+  for (int i = 0; i < len; i++) {
+    memcpy((char*)array + i * circular->element_size,
+           bot_circular_peek_nth(circular, i), circular->element_size);
+  }
+
+  free(circular->array);
+  circular->array = array;
+  circular->capacity = capacity;
+  circular->head = 0;
+  circular->len = len;
+  return 0;
+}
+
 int bot_circular_size(BotCircular* circular) { return circular->len; }
@@ -35,10 +35,10 @@ extern "C" {
  * acts like a GQueue in the sense that you can push on one end and pop
  * from the other.  It acts like a GArray in the sense that its contents
  * are statically allocated rather than pointers to user-allocated buffers.
- * For this reason, its size is fixed and allocated when the BotCircular
- * is created (TODO(ashuang): set_size function).  If a new element is pushed
- * when the BotCircular is already full, the last element on the tail is
- * automatically overwritten.
+ * For this reason, its capacity is allocated when the BotCircular is created,
+ * and only changes when bot_circular_set_capacity() is called.  If a new
+ * element is pushed when the BotCircular is already full, the last element on
+ * the tail is automatically overwritten.
  *
  * Linking: `pkg-config --libs bot2-core`
  *
@@ -59,6 +59,17 @@ int bot_circular_push_head(BotCircular* circular, const void* data);
 int bot_circular_pop_tail(BotCircular* circular, void* data);
 int bot_circular_pop_head(BotCircular* circular, void* data);
 
+/**
+ * bot_circular_set_capacity:
+ *
+ * Reallocates the BotCircular to hold @capacity elements.  If the new
+ * capacity is smaller than the number of valid elements, the elements
+ * closest to the tail are discarded.
+ *
+ * Returns: 0 on success, -1 if the new array could not be allocated.
+ */
+int bot_circular_set_capacity(BotCircular* circular, int capacity);
+
 /**
  * bot_circular_size:
  * Returns: the number of valid elements.
@@ -111,10 +111,41 @@ int bot_ctrans_path_latest_timestamp(const BotCTransPath* path,
  */
 int bot_ctrans_path_have_trans(const BotCTransPath* path);
 
-typedef struct _BotCTransFrame {
+typedef struct _BotCTransFrame BotCTransFrame;
+
+struct _BotCTransPath {
+  BotCTransFrame* frame_from;
+  int nlinks;
+  BotCTransLink** links;
+  int* invert;
+
+  // Memoized result of bot_ctrans_path_to_trans_latest, valid while the link
+  // versions match memo_versions.  Cached paths are shared by concurrent
+  // queries, so the memo is guarded by its own sequence counter.
+  volatile gint memo_seq;
+  gint* memo_versions;
+  BotTrans memo_trans;
+};
+
+struct _BotCTransFrame {
   char* id;
+  int index;
   GPtrArray* links;
-} BotCTransFrame;
+
+  // Cached paths from this frame, indexed by the index of the target frame.
+  GPtrArray* paths;
+
+  // Spanning forest of the frame graph.  Paths between frames in the same
+  // tree are found by walking up to their lowest common ancestor.
+  BotCTransFrame* parent;
+  BotCTransLink* parent_link;
+  int depth;
+
+  // Only meaningful on a root frame.  Set when a link that closes a cycle was
+  // added to the tree, in which case paths within the tree are found by a
+  // shortest path search over all links instead.
+  int overconstrained;
+};
 
 typedef struct {
   int64_t utime;
@@ -122,26 +153,66 @@ typedef struct {
 } TimestampedTrans;
 
 struct _BotCTransLink {
+  BotCTrans* ctrans;
   BotCTransFrame* frame_from;
   BotCTransFrame* frame_to;
   char* id;
   int history_maxlen;
 
+  // When nonzero, the history is resized as updates arrive so that it spans
+  // at least this many microseconds, using at most history_maxlen entries.
+  int64_t history_window;
+
   BotTrans static_trans;
   BotCircular* trans_history;
+
+  // Sequence counter guarding trans_history.  Odd while an update is in
+  // progress, so that readers can copy out of the history without a lock and
+  // retry if it changed underneath them.  Since it increases with every
+  // update, its (even) value also serves as the version of the link.
+  volatile gint seq;
 };
 
 // ============ frame ==========
 
 const char* bot_ctrans_frame_get_id(const BotCTransFrame* frame);
 
-static BotCTransFrame* _frame_new(const char* id) {
+static BotCTransFrame* _frame_new(const char* id, int index) {
   BotCTransFrame* frame = g_slice_new(BotCTransFrame);
   frame->id = strdup(id);
+  frame->index = index;
   frame->links = g_ptr_array_new();
+  frame->paths = g_ptr_array_new();
+  frame->parent = NULL;
+  frame->parent_link = NULL;
+  frame->depth = 0;
+  frame->overconstrained = 0;
+  return frame;
+}
+
+static BotCTransFrame* _frame_get_root(BotCTransFrame* frame) {
+  while (frame->parent) {
+    frame = frame->parent;
+  }
   return frame;
 }
 
+// Reverses the parent pointers between frame and the root of its tree, so
+// that frame becomes the root.
+static void _frame_make_root(BotCTransFrame* frame) {
+  BotCTransFrame* prev = NULL;
+  BotCTransLink* prev_link = NULL;
+  while (frame) {
+    BotCTransFrame* next = frame->parent;
+    BotCTransLink* next_link = frame->parent_link;
+    frame->parent = prev;
+    frame->parent_link = prev_link;
+    prev = frame;
+    prev_link = next_link;
+    frame = next;
+  }
+}
+
 static void _frame_add_link(BotCTransFrame* frame, BotCTransLink* link) {
   assert(frame == link->frame_from || frame == link->frame_to);
   for (int i = 0, n = bot_g_ptr_array_size(frame->links); i < n; i++) {
@@ -162,9 +233,38 @@ static inline void _frame_remove_link(BotCTransFrame* frame,
   assert(FALSE);
 }
 
+static void _frame_clear_paths(BotCTransFrame* frame) {
+  for (int i = 0, n = bot_g_ptr_array_size(frame->paths); i < n; i++) {
+    BotCTransPath* path = g_ptr_array_index(frame->paths, i);
+    if (path) {
+      bot_ctrans_path_destroy(path);
+    }
+  }
+  g_ptr_array_set_size(frame->paths, 0);
+}
+
+static inline BotCTransPath* _frame_get_path(const BotCTransFrame* frame,
+                                             const BotCTransFrame* to_frame) {
+  if (to_frame->index >= frame->paths->len) {
+    return NULL;
+  }
+  return g_ptr_array_index(frame->paths, to_frame->index);
+}
+
+static void _frame_set_path(BotCTransFrame* frame,
+                            const BotCTransFrame* to_frame,
+                            BotCTransPath* path) {
+  if (to_frame->index >= frame->paths->len) {
+    g_ptr_array_set_size(frame->paths, to_frame->index + 1);
+  }
+  g_ptr_array_index(frame->paths, to_frame->index) = path;
+}
+
 static void _frame_destroy(BotCTransFrame* frame) {
+  _frame_clear_paths(frame);
   free(frame->id);
   g_ptr_array_free(frame->links, TRUE);
+  g_ptr_array_free(frame->paths, TRUE);
   g_slice_free(BotCTransFrame, frame);
 }
 
@@ -194,16 +294,19 @@ static inline void _make_link_id2(const char* frame_a_id,
   }
 }
 
-static BotCTransLink* _link_new(BotCTransFrame* frame_from,
+static BotCTransLink* _link_new(BotCTrans* ctrans, BotCTransFrame* frame_from,
                                 BotCTransFrame* frame_to, int history_maxlen) {
   BotCTransLink* link = g_slice_new(BotCTransLink);
+  link->ctrans = ctrans;
   link->frame_from = frame_from;
   link->frame_to = frame_to;
   link->id = _make_link_id(frame_from->id, frame_to->id);
   link->history_maxlen = history_maxlen;
+  link->history_window = 0;
 
   link->trans_history =
       bot_circular_new(history_maxlen, sizeof(TimestampedTrans));
+  link->seq = 0;
   return link;
 }
 
@@ -213,6 +316,19 @@ static void _link_destroy(BotCTransLink* link) {
   g_slice_free(BotCTransLink, link);
 }
 
+static inline gint _link_read_begin(const BotCTransLink* link) {
+  gint seq;
+  while ((seq = g_atomic_int_get(&link->seq)) & 1) {
+    // an update is in progress, let the writer finish it
+    g_thread_yield();
+  }
+  return seq;
+}
+
+static inline gboolean _link_read_retry(const BotCTransLink* link, gint seq) {
+  return g_atomic_int_get(&link->seq) != seq;
+}
+
 const char* bot_ctrans_link_get_from_frame(BotCTransLink* link) {
   return link->frame_from->id;
 }
@@ -221,12 +337,20 @@ const char* bot_ctrans_link_get_to_frame(BotCTransLink* link) {
   return link->frame_to->id;
 }
 
+static void _link_resize_history(BotCTransLink* link, int64_t utime);
+
 void bot_ctrans_link_update(BotCTransLink* link, const BotTrans* transformation,
                             int64_t utime) {
   TimestampedTrans ttrans;
   ttrans.utime = utime;
   memcpy(&ttrans.trans, transformation, sizeof(BotTrans));
 
+  if (link->history_window) {
+    _link_resize_history(link, utime);
+  }
+
+  g_atomic_int_inc(&link->seq);
+
   // if we've gone back in time, then clear the transformation history
   TimestampedTrans* last_ttrans = bot_circular_peek_nth(link->trans_history, 0);
   if (utime < last_ttrans->utime) {
@@ -236,100 +360,373 @@ void bot_ctrans_link_update(BotCTransLink* link, const BotTrans* transformation,
   }
 
   bot_circular_push_head(link->trans_history, &ttrans);
+
+  g_atomic_int_inc(&link->seq);
 }
 
 static gboolean _link_have_trans(const BotCTransLink* link) {
-  return !bot_circular_is_empty(link->trans_history);
+  gint seq;
+  gboolean have_trans;
+  do {
+    seq = _link_read_begin(link);
+    have_trans = !bot_circular_is_empty(link->trans_history);
+  } while (_link_read_retry(link, seq));
+  return have_trans;
 }
 
 static gboolean _link_get_trans_latest(const BotCTransLink* link,
                                        BotTrans* trans) {
-  if (bot_circular_is_empty(link->trans_history)) {
-    return FALSE;
-  }
-  TimestampedTrans* latest = bot_circular_peek_nth(link->trans_history, 0);
-  memcpy(trans, &latest->trans, sizeof(BotTrans));
+  gint seq;
+  do {
+    seq = _link_read_begin(link);
+    BotCircular history = *link->trans_history;
+    if (bot_circular_is_empty(&history)) {
+      if (_link_read_retry(link, seq)) {
+        continue;
+      }
+      return FALSE;
+    }
+    TimestampedTrans* latest = bot_circular_peek_nth(&history, 0);
+    memcpy(trans, &latest->trans, sizeof(BotTrans));
+  } while (_link_read_retry(link, seq));
   return TRUE;
 }
 
+// The history is ordered from newest (index 0) to oldest, with strictly
+// decreasing timestamps since bot_ctrans_link_update discards the history when
+// time goes backwards.  Returns the index of the newest entry whose timestamp
+// is not later than utime, or the history length if every entry is later.
+static int _link_history_search(const BotCircular* history, int64_t utime) {
+  int lo = 0;
+  int hi = history->len;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    const TimestampedTrans* ttrans = bot_circular_peek_nth(history, mid);
+    if (ttrans->utime <= utime) {
+      hi = mid;
+    } else {
+      lo = mid + 1;
+    }
+  }
+  return lo;
+}
+
 static gboolean _link_get_trans_interp(const BotCTransLink* link, int64_t utime,
                                        BotTrans* result) {
-  if (bot_circular_is_empty(link->trans_history)) {
-    return FALSE;
-  }
-  TimestampedTrans* t1 = NULL;
-  TimestampedTrans* t2 = NULL;
-  int i = 0;
-  while (i < link->trans_history->len) {
-    t2 = t1;
-    t1 = bot_circular_peek_nth(link->trans_history, i);
-    if (t1->utime <= utime) {
-      break;
+  TimestampedTrans t1;
+  TimestampedTrans t2;
+  gboolean interpolate;
+  gint seq;
+  do {
+    seq = _link_read_begin(link);
+    BotCircular history = *link->trans_history;
+    if (bot_circular_is_empty(&history)) {
+      if (_link_read_retry(link, seq)) {
+        continue;
+      }
+      return FALSE;
     }
-    i++;
-  }
-  if (i == link->trans_history->len) {
-    t2 = NULL;
-  }
+    int i = _link_history_search(&history, utime);
+    interpolate = i > 0 && i < history.len;
+    if (i == history.len) {
+      // older than anything we have, use the oldest transformation
+      i--;
+    }
+    memcpy(&t1, bot_circular_peek_nth(&history, i), sizeof(TimestampedTrans));
+    if (interpolate) {
+      memcpy(&t2, bot_circular_peek_nth(&history, i - 1),
+             sizeof(TimestampedTrans));
+    }
+  } while (_link_read_retry(link, seq));
 
-  if (!t2) {
-    memcpy(result, &t1->trans, sizeof(BotTrans));
-  } else {
-    assert(t1->utime < t2->utime);
-    double weight_2 = (double)((utime - t1->utime)) / (t2->utime - t1->utime);
-    bot_trans_interpolate(result, &t1->trans, &t2->trans, weight_2);
+  if (!interpolate) {
+    memcpy(result, &t1.trans, sizeof(BotTrans));
+    return TRUE;
   }
+  assert(t1.utime < t2.utime);
+  double weight_2 = (double)((utime - t1.utime)) / (t2.utime - t1.utime);
+  bot_trans_interpolate(result, &t1.trans, &t2.trans, weight_2);
   return TRUE;
 }
 
 int bot_ctrans_link_get_n_trans(const BotCTransLink* link) {
-  return bot_circular_size(link->trans_history);
+  return g_atomic_int_get(&link->trans_history->len);
 }
 
-int bot_ctrans_link_get_nth_trans(BotCTransLink* link, int index,
-                                  BotTrans* transformation, int64_t* utime) {
-  if (index >= bot_circular_size(link->trans_history) || index < 0) {
-    return 0;
-  }
-  const TimestampedTrans* ttrans =
-      bot_circular_peek_nth(link->trans_history, index);
+static int _link_get_nth_trans(const BotCTransLink* link, int index,
+                               BotTrans* transformation, int64_t* utime) {
+  TimestampedTrans ttrans;
+  gint seq;
+  do {
+    seq = _link_read_begin(link);
+    BotCircular history = *link->trans_history;
+    if (index >= history.len || index < 0) {
+      if (_link_read_retry(link, seq)) {
+        continue;
+      }
+      return 0;
+    }
+    memcpy(&ttrans, bot_circular_peek_nth(&history, index),
+           sizeof(TimestampedTrans));
+  } while (_link_read_retry(link, seq));
+
   if (transformation) {
-    memcpy(transformation, &ttrans->trans, sizeof(BotTrans));
+    memcpy(transformation, &ttrans.trans, sizeof(BotTrans));
   }
   if (utime) {
-    *utime = ttrans->utime;
+    *utime = ttrans.utime;
   }
   return 1;
 }
 
+void bot_ctrans_link_set_history_window(BotCTransLink* link,
+                                        int64_t window_usec,
+                                        int history_maxlen) {
+  if (history_maxlen < 1) {
+    g_warning("%s: invalid history_maxlen (%d), coercing to 1\n", __FUNCTION__,
+              history_maxlen);
+    history_maxlen = 1;
+  }
+  link->history_window = window_usec > 0 ? window_usec : 0;
+  link->history_maxlen = history_maxlen;
+}
+
 // ========== ctrans ============
 
 struct _BotCTrans {
+  // Guards the graph structure (frames, links), the path cache, and the
+  // allocation of link histories.  Queries take it shared, adding frames or
+  // links and resizing link histories take it exclusively.  The contents of
+  // link histories are guarded by their own sequence counters instead, so
+  // link updates only wait on queries when a history is resized.
+  GRWLock lock;
+
+  // Held by a writer while it waits for and holds the exclusive lock.  GRWLock
+  // prefers readers, so new readers queue up here instead while a writer is
+  // pending, otherwise a steady stream of queries could starve the writer.
+  GMutex writer_mutex;
+  volatile gint writers_pending;
+
   GHashTable* frames;
+  GPtrArray* frames_by_index;
 
   GHashTable* links;
-
-  GHashTable* path_cache;
 };
 
 BotCTrans* bot_ctrans_new(void) {
   BotCTrans* ctrans = g_slice_new(BotCTrans);
   ctrans->frames = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
                                          (GDestroyNotify)_frame_destroy);
+  ctrans->frames_by_index = g_ptr_array_new();
   ctrans->links = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
                                         (GDestroyNotify)_link_destroy);
-  ctrans->path_cache = g_hash_table_new_full(
-      g_str_hash, g_str_equal, free, (GDestroyNotify)bot_ctrans_path_destroy);
+  g_rw_lock_init(&ctrans->lock);
+  g_mutex_init(&ctrans->writer_mutex);
+  ctrans->writers_pending = 0;
   return ctrans;
 }
 
 void bot_ctrans_destroy(BotCTrans* ctrans) {
   g_hash_table_destroy(ctrans->frames);
+  g_ptr_array_free(ctrans->frames_by_index, TRUE);
   g_hash_table_destroy(ctrans->links);
-  g_hash_table_destroy(ctrans->path_cache);
+  g_rw_lock_clear(&ctrans->lock);
+  g_mutex_clear(&ctrans->writer_mutex);
   g_slice_free(BotCTrans, ctrans);
 }
 
+static inline void _reader_lock(BotCTrans* ctrans) {
+  if (g_atomic_int_get(&ctrans->writers_pending)) {
+    g_mutex_lock(&ctrans->writer_mutex);
+    g_mutex_unlock(&ctrans->writer_mutex);
+  }
+  g_rw_lock_reader_lock(&ctrans->lock);
+}
+
+static inline void _reader_unlock(BotCTrans* ctrans) {
+  g_rw_lock_reader_unlock(&ctrans->lock);
+}
+
+static inline void _writer_lock(BotCTrans* ctrans) {
+  g_mutex_lock(&ctrans->writer_mutex);
+  g_atomic_int_inc(&ctrans->writers_pending);
+  g_rw_lock_writer_lock(&ctrans->lock);
+}
+
+static inline void _writer_unlock(BotCTrans* ctrans) {
+  g_rw_lock_writer_unlock(&ctrans->lock);
+  g_atomic_int_add(&ctrans->writers_pending, -1);
+  g_mutex_unlock(&ctrans->writer_mutex);
+}
+
+// Smallest capacity that a windowed link history is shrunk to.
+#define MIN_WINDOWED_HISTORY_LEN 16
+
+// Called before a new transformation at utime is added to a link with a
+// history window.  Grows the history when the oldest entry would be dropped
+// while still inside the window, and shrinks it when the window only needs a
+// small fraction of it.
+static void _link_resize_history(BotCTransLink* link, int64_t utime) {
+  BotCircular* history = link->trans_history;
+  if (bot_circular_is_empty(history)) {
+    return;
+  }
+  const TimestampedTrans* newest = bot_circular_peek_nth(history, 0);
+  if (utime < newest->utime) {
+    // the history is about to be discarded anyway
+    return;
+  }
+
+  int capacity = history->capacity;
+  int new_capacity = capacity;
+  int64_t window_start = utime - link->history_window;
+  if (bot_circular_is_full(history)) {
+    const TimestampedTrans* oldest =
+        bot_circular_peek_nth(history, history->len - 1);
+    if (oldest->utime > window_start && capacity < link->history_maxlen) {
+      new_capacity = MIN(capacity * 2, link->history_maxlen);
+    }
+  }
+  if (new_capacity == capacity) {
+    // Entries up to and including the first one at or before the start of
+    // the window are needed for interpolation, plus the one being added.
+    int index = _link_history_search(history, window_start);
+    if (index < history->len) {
+      int needed = index + 2;
+      if (4 * needed < capacity && capacity > MIN_WINDOWED_HISTORY_LEN) {
+        new_capacity = MAX(capacity / 2, MIN_WINDOWED_HISTORY_LEN);
+      }
+    }
+  }
+  if (new_capacity > link->history_maxlen) {
+    new_capacity = link->history_maxlen;
+  }
+  if (new_capacity == capacity) {
+    return;
+  }
+
+  // Readers copy out of the history array without a lock, but always while
+  // holding the reader lock, so waiting for the writer lock ensures that
+  // nobody is still reading the old array.
+  _writer_lock(link->ctrans);
+  if (0 != bot_circular_set_capacity(history, new_capacity)) {
+    g_warning("%s: could not resize history of %s to %d\n", __FUNCTION__,
+              link->id, new_capacity);
+  }
+  _writer_unlock(link->ctrans);
+}
+
+void bot_ctrans_link_set_history_maxlen(BotCTransLink* link,
+                                        int history_maxlen) {
+  if (history_maxlen < 1) {
+    g_warning("%s: invalid history_maxlen (%d), coercing to 1\n", __FUNCTION__,
+              history_maxlen);
+    history_maxlen = 1;
+  }
+  link->history_window = 0;
+  link->history_maxlen = history_maxlen;
+  if (history_maxlen == link->trans_history->capacity) {
+    return;
+  }
+  _writer_lock(link->ctrans);
+  if (0 != bot_circular_set_capacity(link->trans_history, history_maxlen)) {
+    g_warning("%s: could not resize history of %s to %d\n", __FUNCTION__,
+              link->id, history_maxlen);
+  }
+  _writer_unlock(link->ctrans);
+}
+
+int bot_ctrans_link_get_nth_trans(BotCTransLink* link, int index,
+                                  BotTrans* transformation, int64_t* utime) {
+  _reader_lock(link->ctrans);
+  int status = _link_get_nth_trans(link, index, transformation, utime);
+  _reader_unlock(link->ctrans);
+  return status;
+}
+
+void bot_ctrans_link_get_stats(BotCTransLink* link,
+                               BotCTransLinkStats* stats) {
+  _reader_lock(link->ctrans);
+  gint seq;
+  do {
+    seq = _link_read_begin(link);
+    BotCircular history = *link->trans_history;
+    stats->num_trans = history.len;
+    stats->capacity = history.capacity;
+    stats->memory_bytes =
+        sizeof(BotCircular) + (size_t)history.capacity * history.element_size;
+    stats->oldest_utime = 0;
+    stats->newest_utime = 0;
+    if (!bot_circular_is_empty(&history)) {
+      const TimestampedTrans* newest = bot_circular_peek_nth(&history, 0);
+      const TimestampedTrans* oldest =
+          bot_circular_peek_nth(&history, history.len - 1);
+      stats->newest_utime = newest->utime;
+      stats->oldest_utime = oldest->utime;
+    }
+  } while (_link_read_retry(link, seq));
+  _reader_unlock(link->ctrans);
+}
+
+// Recomputes the depth of every frame after the forest has been rearranged.
+static void _update_frame_depths(BotCTrans* ctrans) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, ctrans->frames);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    BotCTransFrame* frame = value;
+    int depth = 0;
+    for (BotCTransFrame* f = frame->parent; f; f = f->parent) {
+      depth++;
+    }
+    frame->depth = depth;
+  }
+}
+
+// Adds link to the spanning forest.  Returns FALSE if the two frames are
+// already in the same tree, i.e., the link closes a cycle.
+static gboolean _forest_add_link(BotCTrans* ctrans, BotCTransLink* link) {
+  BotCTransFrame* from_frame = link->frame_from;
+  BotCTransFrame* to_frame = link->frame_to;
+  BotCTransFrame* from_root = _frame_get_root(from_frame);
+  BotCTransFrame* to_root = _frame_get_root(to_frame);
+  if (from_root == to_root) {
+    from_root->overconstrained = 1;
+    return FALSE;
+  }
+  int overconstrained =
+      from_root->overconstrained || to_root->overconstrained;
+  from_root->overconstrained = 0;
+  to_root->overconstrained = 0;
+
+  // Usually from_frame is a new frame being attached relative_to an existing
+  // one, and is already the root of its (single frame) tree.
+  BotCTransFrame* child = from_frame;
+  BotCTransFrame* parent = to_frame;
+  if (from_frame != from_root && to_frame == to_root) {
+    child = to_frame;
+    parent = from_frame;
+  } else if (from_frame != from_root) {
+    _frame_make_root(from_frame);
+  }
+  child->parent = parent;
+  child->parent_link = link;
+  _frame_get_root(parent)->overconstrained = overconstrained;
+  _update_frame_depths(ctrans);
+  return TRUE;
+}
+
+// Drops the cached paths from every frame in the tree with the given root.
+static void _clear_tree_paths(BotCTrans* ctrans, BotCTransFrame* root) {
+  for (int i = 0, n = bot_g_ptr_array_size(ctrans->frames_by_index); i < n;
+       i++) {
+    BotCTransFrame* frame = g_ptr_array_index(ctrans->frames_by_index, i);
+    if (_frame_get_root(frame) == root) {
+      _frame_clear_paths(frame);
+    }
+  }
+}
+
 static BotCTransFrame* bot_ctrans_get_frame(BotCTrans* ctrans,
                                             const char* frame_id) {
   return (BotCTransFrame*)g_hash_table_lookup(ctrans->frames, frame_id);
@@ -346,14 +743,19 @@ static inline BotCTransFrame* _get_frame_or_warn(BotCTrans* ctrans,
 
 int bot_ctrans_add_frame(BotCTrans* ctrans, const char* id) {
   assert(id);
+  _writer_lock(ctrans);
   BotCTransFrame* frame = bot_ctrans_get_frame(ctrans, id);
   if (frame) {
+    _writer_unlock(ctrans);
     g_warning("%s: coordinate frame %s already exists\n", __FUNCTION__, id);
     return 0;
   }
-  frame = _frame_new(id);
+  // The new frame is not related to any other frame yet, so none of the
+  // cached paths are affected.
+  frame = _frame_new(id, bot_g_ptr_array_size(ctrans->frames_by_index));
   g_hash_table_insert(ctrans->frames, frame->id, frame);
-  g_hash_table_remove_all(ctrans->path_cache);
+  g_ptr_array_add(ctrans->frames_by_index, frame);
+  _writer_unlock(ctrans);
   return 1;
 }
 
@@ -364,7 +766,9 @@ BotCTransLink* bot_ctrans_get_link(BotCTrans* ctrans, const char* from_frame,
   int blen = slenf + slent + 2;
   char buf[blen];
   _make_link_id2(from_frame, to_frame, buf, blen);
+  _reader_lock(ctrans);
   BotCTransLink* result = g_hash_table_lookup(ctrans->links, buf);
+  _reader_unlock(ctrans);
   return result;
 }
 
@@ -372,116 +776,334 @@ BotCTransLink* bot_ctrans_link_frames(BotCTrans* ctrans,
                                       const char* from_frame_id,
                                       const char* to_frame_id,
                                       int history_maxlen) {
+  _writer_lock(ctrans);
   BotCTransFrame* from_frame = _get_frame_or_warn(ctrans, from_frame_id);
   BotCTransFrame* to_frame = _get_frame_or_warn(ctrans, to_frame_id);
   if (!from_frame || !to_frame) {
+    _writer_unlock(ctrans);
     return NULL;
   }
-  // check if the link will result in a graph cycle.  A cycle means
-  // an overconstrained graph
-  BotCTransPath* existing_path =
-      bot_ctrans_get_new_path(ctrans, from_frame_id, to_frame_id);
-  if (existing_path) {
-    g_warning(
-        "%s: %s and %s already related. \n"
-        "         Coordinate frame graph will be overconstrained\n",
-        __FUNCTION__, from_frame->id, to_frame->id);
-    bot_ctrans_path_destroy(existing_path);
-  }
   if (history_maxlen < 1) {
     g_warning("%s: invalid history_maxlen (%d), coercing to 1\n", __FUNCTION__,
               history_maxlen);
     history_maxlen = 1;
   }
 
-  BotCTransLink* link = _link_new(from_frame, to_frame, history_maxlen);
+  BotCTransLink* link =
+      _link_new(ctrans, from_frame, to_frame, history_maxlen);
   g_hash_table_insert(ctrans->links, link->id, link);
   _frame_add_link(from_frame, link);
   _frame_add_link(to_frame, link);
-  g_hash_table_remove_all(ctrans->path_cache);
+
+  // Joining two trees leaves the path between any two frames that were
+  // already related unchanged, so the cache stays valid.  A link that closes
+  // a cycle means an overconstrained graph, and may shorten paths within its
+  // tree, so those are dropped.
+  if (!_forest_add_link(ctrans, link)) {
+    g_warning(
+        "%s: %s and %s already related. \n"
+        "         Coordinate frame graph will be overconstrained\n",
+        __FUNCTION__, from_frame->id, to_frame->id);
+    _clear_tree_paths(ctrans, _frame_get_root(from_frame));
+  }
+  _writer_unlock(ctrans);
   return link;
 }
 
-static BotCTransPath* _get_path(BotCTrans* ctrans, const char* from_frame,
-                                const char* to_frame) {
-  char slenf = strlen(from_frame);
-  char slent = strlen(to_frame);
-  int blen = slenf + slent + 2;
-  char buf[blen];
-  snprintf(buf, blen, "%s-%s", from_frame, to_frame);
-  BotCTransPath* path = g_hash_table_lookup(ctrans->path_cache, buf);
-  if (!path) {
-    path = bot_ctrans_get_new_path(ctrans, from_frame, to_frame);
-    if (path) {
-      g_hash_table_insert(ctrans->path_cache, strdup(buf), path);
+int bot_ctrans_get_frame_index(BotCTrans* ctrans, const char* frame_id) {
+  _reader_lock(ctrans);
+  BotCTransFrame* frame = bot_ctrans_get_frame(ctrans, frame_id);
+  _reader_unlock(ctrans);
+  return frame ? frame->index : -1;
+}
+
+static BotCTransPath* _get_new_path(BotCTrans* ctrans,
+                                    BotCTransFrame* from_frame,
+                                    BotCTransFrame* to_frame);
+
+// Must be called with the reader lock held.  On a cache miss, the lock is
+// briefly released so that the new path can be inserted into the cache.
+static BotCTransPath* _get_path(BotCTrans* ctrans, BotCTransFrame* from_frame,
+                                BotCTransFrame* to_frame) {
+  BotCTransPath* path = _frame_get_path(from_frame, to_frame);
+  while (!path) {
+    _reader_unlock(ctrans);
+    _writer_lock(ctrans);
+    path = _frame_get_path(from_frame, to_frame);
+    if (!path) {
+      path = _get_new_path(ctrans, from_frame, to_frame);
+      if (path) {
+        _frame_set_path(from_frame, to_frame, path);
+      }
+    }
+    _writer_unlock(ctrans);
+    _reader_lock(ctrans);
+    if (!path) {
+      return NULL;
     }
+    // the cache may have been cleared while the lock was released
+    path = _frame_get_path(from_frame, to_frame);
   }
   return path;
 }
 
+// Must be called with the reader lock held.
+static BotCTransPath* _get_path_by_id(BotCTrans* ctrans,
+                                      const char* from_frame_id,
+                                      const char* to_frame_id) {
+  BotCTransFrame* from_frame = _get_frame_or_warn(ctrans, from_frame_id);
+  BotCTransFrame* to_frame = _get_frame_or_warn(ctrans, to_frame_id);
+  if (!from_frame || !to_frame) {
+    return NULL;
+  }
+  return _get_path(ctrans, from_frame, to_frame);
+}
+
+// Must be called with the reader lock held.
+static BotCTransPath* _get_path_by_index(BotCTrans* ctrans, int from_index,
+                                         int to_index) {
+  int num_frames = bot_g_ptr_array_size(ctrans->frames_by_index);
+  if (from_index < 0 || from_index >= num_frames || to_index < 0 ||
+      to_index >= num_frames) {
+    return NULL;
+  }
+  return _get_path(ctrans,
+                   g_ptr_array_index(ctrans->frames_by_index, from_index),
+                   g_ptr_array_index(ctrans->frames_by_index, to_index));
+}
+
 int bot_ctrans_get_trans(BotCTrans* ctrans, const char* from_frame,
                          const char* to_frame, int64_t utime,
                          BotTrans* result) {
-  BotCTransPath* path = _get_path(ctrans, from_frame, to_frame);
-  if (!path) {
-    return 0;
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_id(ctrans, from_frame, to_frame);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_to_trans(path, utime, result);
+  }
+  _reader_unlock(ctrans);
+  return status;
+}
+
+int bot_ctrans_get_trans_by_index(BotCTrans* ctrans, int from_index,
+                                  int to_index, int64_t utime,
+                                  BotTrans* result) {
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_index(ctrans, from_index, to_index);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_to_trans(path, utime, result);
   }
-  return bot_ctrans_path_to_trans(path, utime, result);
+  _reader_unlock(ctrans);
+  return status;
 }
 
 int bot_ctrans_get_trans_latest(BotCTrans* ctrans, const char* from_frame,
                                 const char* to_frame, BotTrans* result) {
-  BotCTransPath* path = _get_path(ctrans, from_frame, to_frame);
-  if (!path) {
-    return 0;
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_id(ctrans, from_frame, to_frame);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_to_trans_latest(path, result);
   }
-  return bot_ctrans_path_to_trans_latest(path, result);
+  _reader_unlock(ctrans);
+  return status;
+}
+
+int bot_ctrans_get_trans_latest_by_index(BotCTrans* ctrans, int from_index,
+                                         int to_index, BotTrans* result) {
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_index(ctrans, from_index, to_index);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_to_trans_latest(path, result);
+  }
+  _reader_unlock(ctrans);
+  return status;
 }
 
 int bot_ctrans_have_trans(BotCTrans* ctrans, const char* from_frame,
                           const char* to_frame) {
-  BotCTransPath* path = _get_path(ctrans, from_frame, to_frame);
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_id(ctrans, from_frame, to_frame);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_have_trans(path);
+  }
+  _reader_unlock(ctrans);
   if (!path) {
     g_warning("%s: invalid transformation requested (%s -> %s)\n", __FUNCTION__,
               from_frame, to_frame);
-    return 0;
   }
-  return bot_ctrans_path_have_trans(path);
+  return status;
 }
 
 int bot_ctrans_get_trans_latest_timestamp(BotCTrans* ctrans,
                                           const char* from_frame,
                                           const char* to_frame,
                                           int64_t* timestamp) {
-  BotCTransPath* path = _get_path(ctrans, from_frame, to_frame);
-  if (!path) {
-    return 0;
+  _reader_lock(ctrans);
+  BotCTransPath* path = _get_path_by_id(ctrans, from_frame, to_frame);
+  int status = 0;
+  if (path) {
+    status = bot_ctrans_path_latest_timestamp(path, timestamp);
   }
-  return bot_ctrans_path_latest_timestamp(path, timestamp);
+  _reader_unlock(ctrans);
+  return status;
 }
 
-// ========= path ==========
+// Interpolated link transformations computed while servicing a batch of
+// queries, so that links shared by several paths are only interpolated once
+// per timestamp.
+typedef struct {
+  int64_t utime;
+  int have_trans;
+  BotTrans trans;
+  // index of the next entry for the same link, or -1
+  int next;
+} BatchLinkTrans;
+
+static const BatchLinkTrans* _batch_get_link_trans(GHashTable* first_entries,
+                                                   GArray* entries,
+                                                   const BotCTransLink* link,
+                                                   int64_t utime) {
+  // first_entries maps each link to the index of its first entry, plus one
+  int index =
+      GPOINTER_TO_INT(g_hash_table_lookup(first_entries, link)) - 1;
+  int prev = -1;
+  while (index >= 0) {
+    const BatchLinkTrans* entry =
+        &g_array_index(entries, BatchLinkTrans, index);
+    if (entry->utime == utime) {
+      return entry;
+    }
+    prev = index;
+    index = entry->next;
+  }
 
-struct _BotCTransPath {
-  int nlinks;
-  BotCTransLink** links;
-  int* invert;
-};
+  BatchLinkTrans entry;
+  entry.utime = utime;
+  entry.have_trans = _link_get_trans_interp(link, utime, &entry.trans);
+  entry.next = -1;
+  int new_index = entries->len;
+  g_array_append_val(entries, entry);
+  if (prev < 0) {
+    g_hash_table_insert(first_entries, (gpointer)link,
+                        GINT_TO_POINTER(new_index + 1));
+  } else {
+    g_array_index(entries, BatchLinkTrans, prev).next = new_index;
+  }
+  return &g_array_index(entries, BatchLinkTrans, new_index);
+}
 
-static BotCTransPath* _path_new(int nlinks) {
+int bot_ctrans_get_trans_batch(BotCTrans* ctrans, int n,
+                               const char** from_frames,
+                               const char** to_frames, const int64_t* utimes,
+                               BotTrans* results, int* status) {
+  GHashTable* first_entries = g_hash_table_new(g_direct_hash, g_direct_equal);
+  GArray* entries = g_array_new(FALSE, FALSE, sizeof(BatchLinkTrans));
+  int num_ok = 0;
+
+  _reader_lock(ctrans);
+  for (int i = 0; i < n; i++) {
+    BotCTransPath* path = _get_path_by_id(ctrans, from_frames[i], to_frames[i]);
+    int have_trans = path != NULL;
+    BotTrans* result = &results[i];
+    bot_trans_set_identity(result);
+    for (int lind = 0; have_trans && lind < path->nlinks; lind++) {
+      const BatchLinkTrans* entry = _batch_get_link_trans(
+          first_entries, entries, path->links[lind], utimes[i]);
+      have_trans = entry->have_trans;
+      if (!have_trans) {
+        break;
+      }
+      if (path->invert[lind]) {
+        BotTrans temp_trans = entry->trans;
+        bot_trans_invert(&temp_trans);
+        bot_trans_apply_trans(result, &temp_trans);
+      } else {
+        bot_trans_apply_trans(result, &entry->trans);
+      }
+    }
+    if (status) {
+      status[i] = have_trans;
+    }
+    num_ok += have_trans;
+  }
+  _reader_unlock(ctrans);
+
+  g_array_free(entries, TRUE);
+  g_hash_table_destroy(first_entries);
+  return num_ok;
+}
+
+// ========= path ==========
+
+static BotCTransPath* _path_new(BotCTransFrame* frame_from, int nlinks) {
   BotCTransPath* path = g_slice_new(BotCTransPath);
+  path->frame_from = frame_from;
   path->nlinks = nlinks;
   path->links = g_slice_alloc0(nlinks * sizeof(BotCTransLink*));
   path->invert = g_slice_alloc0(nlinks * sizeof(int));
+  path->memo_seq = 0;
+  path->memo_versions = g_slice_alloc(nlinks * sizeof(gint));
+  // link versions are always even, so this never matches
+  for (int i = 0; i < nlinks; i++) {
+    path->memo_versions[i] = -1;
+  }
+  // which leaves only a path with no links, whose transformation is identity
+  bot_trans_set_identity(&path->memo_trans);
   return path;
 }
 
 void bot_ctrans_path_destroy(BotCTransPath* path) {
   g_slice_free1(path->nlinks * sizeof(BotCTransLink*), path->links);
   g_slice_free1(path->nlinks * sizeof(int), path->invert);
+  g_slice_free1(path->nlinks * sizeof(gint), path->memo_versions);
   g_slice_free(BotCTransPath, path);
 }
 
+// Retrieves the current version of each link in the path.  Returns FALSE if a
+// link is in the middle of an update.
+static gboolean _path_get_link_versions(const BotCTransPath* path,
+                                        gint* versions) {
+  for (int lind = 0; lind < path->nlinks; lind++) {
+    versions[lind] = g_atomic_int_get(&path->links[lind]->seq);
+    if (versions[lind] & 1) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+static gboolean _path_memo_lookup(const BotCTransPath* path,
+                                  const gint* versions, BotTrans* result) {
+  gint seq = g_atomic_int_get(&path->memo_seq);
+  if (seq & 1) {
+    return FALSE;
+  }
+  for (int lind = 0; lind < path->nlinks; lind++) {
+    if (path->memo_versions[lind] != versions[lind]) {
+      return FALSE;
+    }
+  }
+  memcpy(result, &path->memo_trans, sizeof(BotTrans));
+  return g_atomic_int_get(&path->memo_seq) == seq;
+}
+
+static void _path_memo_store(BotCTransPath* path, const gint* versions,
+                             const BotTrans* trans) {
+  // if another query is already storing its result, let it win
+  gint seq = g_atomic_int_get(&path->memo_seq);
+  if ((seq & 1) ||
+      !g_atomic_int_compare_and_exchange(&path->memo_seq, seq, seq + 1)) {
+    return;
+  }
+  memcpy(path->memo_versions, versions, path->nlinks * sizeof(gint));
+  memcpy(&path->memo_trans, trans, sizeof(BotTrans));
+  g_atomic_int_inc(&path->memo_seq);
+}
+
 const char* bot_ctrans_path_get_frame_from(BotCTransPath* path) {
   if (0 == path->nlinks) {
     return NULL;
@@ -521,17 +1143,70 @@ static void _spnode_data_destroy(SPNodeData* ndata) {
   g_slice_free(SPNodeData, ndata);
 }
 
+// Finds the path between two frames in the same tree of the spanning forest.
+static BotCTransPath* _get_new_tree_path(BotCTransFrame* from_frame,
+                                         BotCTransFrame* to_frame) {
+  // walk both frames up to their lowest common ancestor
+  int nlinks_up = 0;
+  int nlinks_down = 0;
+  BotCTransFrame* a = from_frame;
+  BotCTransFrame* b = to_frame;
+  while (a->depth > b->depth) {
+    a = a->parent;
+    nlinks_up++;
+  }
+  while (b->depth > a->depth) {
+    b = b->parent;
+    nlinks_down++;
+  }
+  while (a != b) {
+    a = a->parent;
+    b = b->parent;
+    nlinks_up++;
+    nlinks_down++;
+  }
+
+  BotCTransPath* path = _path_new(from_frame, nlinks_up + nlinks_down);
+  BotCTransFrame* frame = from_frame;
+  for (int i = 0; i < nlinks_up; i++) {
+    path->links[i] = frame->parent_link;
+    path->invert[i] = frame->parent_link->frame_from != frame;
+    frame = frame->parent;
+  }
+  frame = to_frame;
+  for (int i = path->nlinks - 1; i >= nlinks_up; i--) {
+    path->links[i] = frame->parent_link;
+    path->invert[i] = frame->parent_link->frame_from == frame;
+    frame = frame->parent;
+  }
+  return path;
+}
+
 BotCTransPath* bot_ctrans_get_new_path(BotCTrans* ctrans,
                                        const char* from_frame_id,
                                        const char* to_frame_id) {
-  dbg("%s (%s, %s)\n", __FUNCTION__, from_frame_id, to_frame_id);
-
   BotCTransFrame* from_frame = _get_frame_or_warn(ctrans, from_frame_id);
   BotCTransFrame* to_frame = _get_frame_or_warn(ctrans, to_frame_id);
   if (!from_frame || !to_frame) {
     return NULL;
   }
-  // do a djikstra shortest path search
+  return _get_new_path(ctrans, from_frame, to_frame);
+}
+
+static BotCTransPath* _get_new_path(BotCTrans* ctrans,
+                                    BotCTransFrame* from_frame,
+                                    BotCTransFrame* to_frame) {
+  dbg("%s (%s, %s)\n", __FUNCTION__, from_frame->id, to_frame->id);
+
+  BotCTransFrame* root = _frame_get_root(from_frame);
+  if (root != _frame_get_root(to_frame)) {
+    return NULL;
+  }
+  if (!root->overconstrained) {
+    return _get_new_tree_path(from_frame, to_frame);
+  }
+
+  // there are cycles in the graph, do a djikstra shortest path search
 
   GHashTable* Q = g_hash_table_new(g_direct_hash, g_direct_equal);
   GPtrArray* all_ndata = g_ptr_array_new();
@@ -635,7 +1310,7 @@ BotCTransPath* bot_ctrans_get_new_path(BotCTrans* ctrans,
     nlinks++;
   }
 
-  BotCTransPath* path = _path_new(nlinks);
+  BotCTransPath* path = _path_new(from_frame, nlinks);
   node = to_node;
   int nind = nlinks - 1;
   while (node && node->frame != from_frame) {
@@ -675,6 +1350,14 @@ int bot_ctrans_path_to_trans(const BotCTransPath* path, int64_t utime,
 
 int bot_ctrans_path_to_trans_latest(const BotCTransPath* path,
                                     BotTrans* result) {
+  // If none of the links have been updated since the last call, reuse the
+  // previously composed transformation.
+  gint versions[path->nlinks + 1];
+  gboolean have_versions = _path_get_link_versions(path, versions);
+  if (have_versions && _path_memo_lookup(path, versions, result)) {
+    return 1;
+  }
+
   bot_trans_set_identity(result);
   BotTrans temp_trans;
   for (int lind = 0; lind < path->nlinks; lind++) {
@@ -688,6 +1371,13 @@ int bot_ctrans_path_to_trans_latest(const BotCTransPath* path,
     }
     bot_trans_apply_trans(result, &temp_trans);
   }
+
+  // Only memoize the result if no link was updated while composing it.
+  gint versions_after[path->nlinks + 1];
+  if (have_versions && _path_get_link_versions(path, versions_after) &&
+      !memcmp(versions, versions_after, path->nlinks * sizeof(gint))) {
+    _path_memo_store((BotCTransPath*)path, versions, result);
+  }
   return 1;
 }
 
@@ -697,8 +1387,7 @@ int bot_ctrans_path_latest_timestamp(const BotCTransPath* path,
   for (int lind = 0; lind < path->nlinks; lind++) {
     BotCTransLink* link = path->links[lind];
     int64_t link_timestamp;
-    int have_trans =
-        bot_ctrans_link_get_nth_trans(link, 0, NULL, &link_timestamp);
+    int have_trans = _link_get_nth_trans(link, 0, NULL, &link_timestamp);
     if (!have_trans) {
       return 0;
     }
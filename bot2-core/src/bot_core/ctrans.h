@@ -21,6 +21,7 @@
 #ifndef BOT2_CORE_BOT_CORE_CTRANS_H_
 #define BOT2_CORE_BOT_CORE_CTRANS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 #include "trans.h"
@@ -40,6 +41,20 @@
  * graph.  The path is then traversed from source to target, and the rigid body
  * transformations are composed together to form a single transformation.
  *
+ * Coordinate frames are usually related by a tree, in which case the path is
+ * found by walking up from both frames to their lowest common ancestor.  Paths
+ * are cached, and adding frames or links that do not close a cycle leaves the
+ * cached paths untouched.  Each path also remembers its most recent composed
+ * transformation, which is only recomputed after one of its links has been
+ * updated.
+ *
+ * Queries may be issued concurrently from any number of threads, and do not
+ * block, or get blocked by, bot_ctrans_link_update(), with one exception: an
+ * update that resizes the history of a link with a history window waits for
+ * in-progress queries to complete, and queries issued meanwhile wait for it.
+ * Updates to a given link must be serialized by the caller.  Adding frames or
+ * links, or resizing a history explicitly, also waits for in-progress queries.
+ *
  * Linking: `pkg-config --libs bot2-core`
  *
  * @{
@@ -59,6 +74,24 @@ typedef struct _BotCTrans BotCTrans;
  */
 typedef struct _BotCTransLink BotCTransLink;
 
+/**
+ * BotCTransLinkStats:
+ * @num_trans: number of transformations stored for the link
+ * @capacity: number of transformations the history can currently hold
+ * @memory_bytes: memory used by the history
+ * @oldest_utime: timestamp of the oldest stored transformation
+ * @newest_utime: timestamp of the newest stored transformation
+ *
+ * Describes the transformation history of a link.
+ */
+typedef struct {
+  int num_trans;
+  int capacity;
+  size_t memory_bytes;
+  int64_t oldest_utime;
+  int64_t newest_utime;
+} BotCTransLinkStats;
+
 /**
  * bot_ctrans_new:
  *
@@ -108,6 +141,62 @@ int bot_ctrans_get_trans(BotCTrans* ctrans, const char* from_frame,
 int bot_ctrans_get_trans_latest(BotCTrans* ctrans, const char* from_frame,
                                 const char* to_frame, BotTrans* result);
 
+/**
+ * bot_ctrans_get_frame_index:
+ *
+ * Looks up the index of a coordinate frame.  Indices are assigned in the
+ * order that frames are added, and remain valid for the lifetime of the
+ * BotCTrans.  Querying by index avoids looking up the frames by name.
+ *
+ * Returns: the index of the coordinate frame, or -1 if there is no such frame.
+ */
+int bot_ctrans_get_frame_index(BotCTrans* ctrans, const char* frame_id);
+
+/**
+ * bot_ctrans_get_trans_by_index:
+ *
+ * Same as bot_ctrans_get_trans(), but identifies the coordinate frames by the
+ * indices returned by bot_ctrans_get_frame_index().
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_ctrans_get_trans_by_index(BotCTrans* ctrans, int from_index,
+                                  int to_index, int64_t timestamp,
+                                  BotTrans* result);
+
+/**
+ * bot_ctrans_get_trans_latest_by_index:
+ *
+ * Same as bot_ctrans_get_trans_latest(), but identifies the coordinate frames
+ * by the indices returned by bot_ctrans_get_frame_index().
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_ctrans_get_trans_latest_by_index(BotCTrans* ctrans, int from_index,
+                                         int to_index, BotTrans* result);
+
+/**
+ * bot_ctrans_get_trans_batch:
+ * @ctrans: The CTrans object
+ * @n: number of transformations to retrieve
+ * @from_frames: source coordinate frame of each transformation
+ * @to_frames: destination coordinate frame of each transformation
+ * @utimes: time of each transformation
+ * @results: output parameter, filled in with each transformation
+ * @status: output parameter, set to 1 for each transformation that was
+ *          retrieved successfully and 0 otherwise.  May be NULL.
+ *
+ * Retrieves several transformations at once, each as bot_ctrans_get_trans()
+ * would.  Links shared by several of the transformations are only
+ * interpolated once per distinct time.
+ *
+ * Returns: the number of transformations retrieved successfully
+ */
+int bot_ctrans_get_trans_batch(BotCTrans* ctrans, int n,
+                               const char** from_frames,
+                               const char** to_frames, const int64_t* utimes,
+                               BotTrans* results, int* status);
+
 /**
  * bot_ctrans_have_trans:
  *
@@ -206,6 +295,44 @@ int bot_ctrans_link_get_n_trans(const BotCTransLink* link);
 int bot_ctrans_link_get_nth_trans(BotCTransLink* link, int index,
                                   BotTrans* transformation, int64_t* timestamp);
 
+/**
+ * bot_ctrans_link_set_history_window:
+ * @link: The link to configure
+ * @window_usec: Time span of transformations to keep, in microseconds.  0
+ *               keeps the history at its current size.
+ * @history_maxlen: Maximum number of transformations to keep.
+ *
+ * Lets the transformation history of a link grow and shrink as updates
+ * arrive, so that it covers at least the last @window_usec microseconds at
+ * whatever rate the link is updated.  The history doubles or halves at a
+ * time, and the update that resizes it waits for in-progress queries to
+ * complete, so that it can free the old history.  This must not be called
+ * concurrently with bot_ctrans_link_update() for the same link.
+ */
+void bot_ctrans_link_set_history_window(BotCTransLink* link,
+                                        int64_t window_usec,
+                                        int history_maxlen);
+
+/**
+ * bot_ctrans_link_set_history_maxlen:
+ * @link: The link to resize
+ * @history_maxlen: Number of transformations to keep.
+ *
+ * Resizes the transformation history of a link, keeping the most recent
+ * transformations if it shrinks, and turns off any history window set with
+ * bot_ctrans_link_set_history_window().  This must not be called
+ * concurrently with bot_ctrans_link_update() for the same link.
+ */
+void bot_ctrans_link_set_history_maxlen(BotCTransLink* link,
+                                        int history_maxlen);
+
+/**
+ * bot_ctrans_link_get_stats:
+ *
+ * Retrieves the size and time span of the transformation history of a link.
+ */
+void bot_ctrans_link_get_stats(BotCTransLink* link, BotCTransLinkStats* stats);
+
 const char* bot_ctrans_link_get_from_frame(BotCTransLink* link);
 const char* bot_ctrans_link_get_to_frame(BotCTransLink* link);
 
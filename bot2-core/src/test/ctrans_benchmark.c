@@ -0,0 +1,146 @@
+// -*- mode: c -*-
+// vim: set filetype=c :
+
+/*
+ * This file is part of bot2-core.
+ *
+ * bot2-core is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * bot2-core is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bot2-core. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures the cost of interpolated BotCTrans queries as a function of the
+// link history length.  Queries are spread uniformly over the stored history,
+// so on average they land halfway between the newest and the oldest entry.
+//
+// It then measures "latest" queries over chains of frames, both when the
+// links are left unchanged between queries (so the memoized transformation
+// can be reused) and when one of the links is updated before every query.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <bot_core/ctrans.h>
+#include <bot_core/rotations.h>
+#include <bot_core/timestamp.h>
+#include <bot_core/trans.h>
+
+#define UPDATE_PERIOD_USEC 5000
+#define NUM_QUERIES 200000
+
+static void run(int history_len) {
+  BotCTrans* ctrans = bot_ctrans_new();
+  bot_ctrans_add_frame(ctrans, "body");
+  bot_ctrans_add_frame(ctrans, "local");
+  BotCTransLink* link =
+      bot_ctrans_link_frames(ctrans, "body", "local", history_len);
+
+  for (int i = 0; i < history_len; i++) {
+    double rpy[3] = {0, 0, 0.001 * i};
+    double quat[4];
+    double pos[3] = {0.01 * i, 0, 0};
+    bot_roll_pitch_yaw_to_quat(rpy, quat);
+    BotTrans trans;
+    bot_trans_set_from_quat_trans(&trans, quat, pos);
+    bot_ctrans_link_update(link, &trans, (int64_t)i * UPDATE_PERIOD_USEC);
+  }
+
+  int64_t span = (int64_t)(history_len - 1) * UPDATE_PERIOD_USEC;
+  int64_t* query_times = malloc(NUM_QUERIES * sizeof(int64_t));
+  srand(history_len);
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    query_times[i] = span > 0 ? rand() % span : 0;
+  }
+
+  BotTrans result;
+  double checksum = 0;
+  int64_t start = bot_timestamp_now();
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    bot_ctrans_get_trans(ctrans, "body", "local", query_times[i], &result);
+    checksum += result.trans_vec[0];
+  }
+  int64_t ctrans_usec = bot_timestamp_now() - start;
+
+  printf("%8d %18.1f   (%g)\n", history_len, 1e3 * ctrans_usec / NUM_QUERIES,
+         checksum);
+
+  free(query_times);
+  bot_ctrans_destroy(ctrans);
+}
+
+static void run_chain(int nhops) {
+  BotCTrans* ctrans = bot_ctrans_new();
+  BotCTransLink** links = malloc(nhops * sizeof(BotCTransLink*));
+  char name[32];
+  bot_ctrans_add_frame(ctrans, "frame0");
+  for (int i = 0; i < nhops; i++) {
+    char prev_name[32];
+    snprintf(prev_name, sizeof(prev_name), "frame%d", i);
+    snprintf(name, sizeof(name), "frame%d", i + 1);
+    bot_ctrans_add_frame(ctrans, name);
+    links[i] = bot_ctrans_link_frames(ctrans, prev_name, name, 10);
+
+    double rpy[3] = {0.1, 0, 0.01 * i};
+    double quat[4];
+    double pos[3] = {1, 0, 0};
+    bot_roll_pitch_yaw_to_quat(rpy, quat);
+    BotTrans trans;
+    bot_trans_set_from_quat_trans(&trans, quat, pos);
+    bot_ctrans_link_update(links[i], &trans, 0);
+  }
+  int from_index = bot_ctrans_get_frame_index(ctrans, "frame0");
+  int to_index = bot_ctrans_get_frame_index(ctrans, name);
+
+  BotTrans result;
+  double checksum = 0;
+  int64_t start = bot_timestamp_now();
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    bot_ctrans_get_trans_latest_by_index(ctrans, from_index, to_index, &result);
+    checksum += result.trans_vec[0];
+  }
+  int64_t unchanged_usec = bot_timestamp_now() - start;
+
+  BotTrans update;
+  bot_trans_set_identity(&update);
+  start = bot_timestamp_now();
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    update.trans_vec[0] = i;
+    bot_ctrans_link_update(links[i % nhops], &update, i + 1);
+    bot_ctrans_get_trans_latest_by_index(ctrans, from_index, to_index, &result);
+    checksum += result.trans_vec[0];
+  }
+  int64_t updated_usec = bot_timestamp_now() - start;
+
+  printf("%8d %18.1f %18.1f   (%g)\n", nhops,
+         1e3 * unchanged_usec / NUM_QUERIES, 1e3 * updated_usec / NUM_QUERIES,
+         checksum);
+
+  free(links);
+  bot_ctrans_destroy(ctrans);
+}
+
+int main(int argc, char** argv) {
+  static const int history_lens[] = {1, 10, 100, 1000, 10000, 100000};
+  static const int chain_lens[] = {1, 2, 4, 8, 16};
+
+  printf("%8s %18s\n", "history", "get_trans (ns)");
+  for (int i = 0; i < sizeof(history_lens) / sizeof(history_lens[0]); i++) {
+    run(history_lens[i]);
+  }
+
+  printf("\n%8s %18s %18s\n", "hops", "unchanged (ns)", "updated (ns)");
+  for (int i = 0; i < sizeof(chain_lens) / sizeof(chain_lens[0]); i++) {
+    run_chain(chain_lens[i]);
+  }
+  return 0;
+}
@@ -21,11 +21,15 @@
 #include "bot_frames.h"
 
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 
 #include <glib.h>
+#include <lcm/eventlog.h>
 #include <lcm/lcm.h>
 
 #include <bot_core/ctrans.h>
@@ -39,11 +43,15 @@
 #define BOT_FRAMES_UPDATE_CHANNEL "BOT_FRAMES_UPDATE"
 #define DEFAULT_HISTORY_LEN 100
 
+// Entry budget for links with a history_window but no history size
+#define MAX_WINDOWED_HISTORY_LEN 100000
+
 typedef struct {
   int frame_num;
   char* frame_name;
   char* relative_to;
   char* update_channel;
+  int pose_update_channel;
   bot_core_rigid_transform_t_subscription_t* transform_subscription;
   bot_core_pose_t_subscription_t* pose_subscription;
 
@@ -80,6 +88,8 @@ struct _BotFrames {
   lcm_t* lcm;
   BotParam* bot_param;
 
+  // Serializes link updates and guards the frame handle tables.  Transform
+  // queries do not take it, BotCTrans lets them run concurrently with updates.
   GMutex* mutex;
   int num_frames;
   char* root_name;
@@ -88,6 +98,32 @@ struct _BotFrames {
 
   bot_frames_update_t_subscription_t* update_subscription;
   GList* update_callbacks;
+
+  // Asynchronous delivery of update callbacks, see
+  // bot_frames_set_update_dispatch.  Pending updates are keyed by frame name,
+  // so that each link has at most one pending notification.
+  GMutex dispatch_mutex;
+  GCond dispatch_cond;
+  BotFramesDispatchMode dispatch_mode;
+  int64_t dispatch_period_usec;
+  int64_t last_dispatch_time;
+  GHashTable* pending_updates;
+  GThread* dispatch_thread;
+  int dispatch_stop;
+  guint dispatch_source_id;
+  BotFramesDispatchStats dispatch_stats;
+};
+
+typedef struct {
+  char* frame_name;
+  char* relative_to;
+  int64_t utime;
+} pending_update_t;
+
+struct _BotFramesQuery {
+  BotFrames* bot_frames;
+  int from_id;
+  int to_id;
 };
 
 static void _dispatch_update_callbacks(BotFrames* bot_frames,
@@ -100,6 +136,143 @@ static void _dispatch_update_callbacks(BotFrames* bot_frames,
   }
 }
 
+static void _pending_update_destroy(pending_update_t* pending) {
+  free(pending->frame_name);
+  free(pending->relative_to);
+  g_slice_free(pending_update_t, pending);
+}
+
+static GHashTable* _pending_updates_new(void) {
+  return g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                               (GDestroyNotify)_pending_update_destroy);
+}
+
+// Must be called with dispatch_mutex held.  Returns the pending updates, and
+// leaves an empty table in their place.
+static GHashTable* _take_pending_updates(BotFrames* bot_frames) {
+  GHashTable* pending_updates = bot_frames->pending_updates;
+  bot_frames->pending_updates = _pending_updates_new();
+  bot_frames->last_dispatch_time = g_get_monotonic_time();
+  bot_frames->dispatch_stats.num_dispatched +=
+      g_hash_table_size(pending_updates);
+  return pending_updates;
+}
+
+static void _dispatch_pending_updates(BotFrames* bot_frames,
+                                      GHashTable* pending_updates) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, pending_updates);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    pending_update_t* pending = (pending_update_t*)value;
+    _dispatch_update_callbacks(bot_frames, pending->frame_name,
+                               pending->relative_to, pending->utime);
+  }
+  g_hash_table_destroy(pending_updates);
+}
+
+static gpointer _dispatch_thread(gpointer user) {
+  BotFrames* bot_frames = (BotFrames*)user;
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  while (!bot_frames->dispatch_stop) {
+    if (g_hash_table_size(bot_frames->pending_updates) == 0) {
+      g_cond_wait(&bot_frames->dispatch_cond, &bot_frames->dispatch_mutex);
+      continue;
+    }
+    GHashTable* pending_updates = _take_pending_updates(bot_frames);
+    g_mutex_unlock(&bot_frames->dispatch_mutex);
+    _dispatch_pending_updates(bot_frames, pending_updates);
+    g_mutex_lock(&bot_frames->dispatch_mutex);
+
+    // enforce the maximum dispatch rate, letting updates accumulate meanwhile
+    gint64 end_time =
+        bot_frames->last_dispatch_time + bot_frames->dispatch_period_usec;
+    while (!bot_frames->dispatch_stop &&
+           g_cond_wait_until(&bot_frames->dispatch_cond,
+                             &bot_frames->dispatch_mutex, end_time)) {
+    }
+  }
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+  return NULL;
+}
+
+static gboolean _dispatch_source(gpointer user) {
+  BotFrames* bot_frames = (BotFrames*)user;
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  bot_frames->dispatch_source_id = 0;
+  GHashTable* pending_updates = _take_pending_updates(bot_frames);
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+  _dispatch_pending_updates(bot_frames, pending_updates);
+  return FALSE;
+}
+
+// Delivers a link update to the update callbacks, either right away or by
+// queueing it for the dispatcher.
+static void _notify_update(BotFrames* bot_frames, const char* frame_name,
+                           const char* relative_to, int64_t utime) {
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  bot_frames->dispatch_stats.num_received++;
+  if (bot_frames->dispatch_mode == BOT_FRAMES_DISPATCH_SYNC) {
+    bot_frames->dispatch_stats.num_dispatched++;
+    g_mutex_unlock(&bot_frames->dispatch_mutex);
+    _dispatch_update_callbacks(bot_frames, frame_name, relative_to, utime);
+    return;
+  }
+
+  // coalesce with any pending update for the same link, latest utime wins
+  pending_update_t* pending = (pending_update_t*)g_hash_table_lookup(
+      bot_frames->pending_updates, frame_name);
+  if (pending == NULL) {
+    pending = g_slice_new(pending_update_t);
+    pending->frame_name = strdup(frame_name);
+    pending->relative_to = strdup(relative_to);
+    pending->utime = utime;
+    g_hash_table_insert(bot_frames->pending_updates, pending->frame_name,
+                        pending);
+  } else if (utime >= pending->utime) {
+    pending->utime = utime;
+    bot_frames->dispatch_stats.num_coalesced++;
+  } else {
+    bot_frames->dispatch_stats.num_dropped++;
+  }
+
+  if (bot_frames->dispatch_mode == BOT_FRAMES_DISPATCH_THREAD) {
+    g_cond_signal(&bot_frames->dispatch_cond);
+  } else if (bot_frames->dispatch_source_id == 0) {
+    int64_t delay_usec = bot_frames->last_dispatch_time +
+                         bot_frames->dispatch_period_usec -
+                         g_get_monotonic_time();
+    if (delay_usec > 0) {
+      bot_frames->dispatch_source_id = g_timeout_add(
+          (delay_usec + 999) / 1000, _dispatch_source, bot_frames);
+    } else {
+      bot_frames->dispatch_source_id =
+          g_idle_add(_dispatch_source, bot_frames);
+    }
+  }
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+}
+
+// Stops the dispatch thread or main loop source, if any.  Pending updates
+// stay queued.
+static void _stop_dispatcher(BotFrames* bot_frames) {
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  GThread* thread = bot_frames->dispatch_thread;
+  bot_frames->dispatch_thread = NULL;
+  bot_frames->dispatch_stop = 1;
+  g_cond_signal(&bot_frames->dispatch_cond);
+  if (bot_frames->dispatch_source_id != 0) {
+    g_source_remove(bot_frames->dispatch_source_id);
+    bot_frames->dispatch_source_id = 0;
+  }
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+
+  if (thread) {
+    g_thread_join(thread);
+  }
+  bot_frames->dispatch_stop = 0;
+}
+
 static void on_transform_update(const lcm_recv_buf_t* rbuf, const char* channel,
                                 const bot_core_rigid_transform_t* msg,
                                 void* user_data) {
@@ -115,8 +288,8 @@ static void on_transform_update(const lcm_recv_buf_t* rbuf, const char* channel,
   bot_ctrans_link_update(frame_handle->ctrans_link, &link_transf, msg->utime);
   g_mutex_unlock(bot_frames->mutex);
 
-  _dispatch_update_callbacks(bot_frames, frame_handle->frame_name,
-                             frame_handle->relative_to, msg->utime);
+  _notify_update(bot_frames, frame_handle->frame_name,
+                 frame_handle->relative_to, msg->utime);
 }
 
 static void on_pose_update(const lcm_recv_buf_t* rbuf, const char* channel,
@@ -133,8 +306,8 @@ static void on_pose_update(const lcm_recv_buf_t* rbuf, const char* channel,
   bot_ctrans_link_update(frame_handle->ctrans_link, &link_transf, msg->utime);
   g_mutex_unlock(bot_frames->mutex);
 
-  _dispatch_update_callbacks(bot_frames, frame_handle->frame_name,
-                             frame_handle->relative_to, msg->utime);
+  _notify_update(bot_frames, frame_handle->frame_name,
+                 frame_handle->relative_to, msg->utime);
 }
 
 static void on_frames_update(const lcm_recv_buf_t* rbuf, const char* channel,
@@ -174,8 +347,8 @@ static void on_frames_update(const lcm_recv_buf_t* rbuf, const char* channel,
   }
   g_mutex_unlock(bot_frames->mutex);
 
-  _dispatch_update_callbacks(bot_frames, frame_handle->frame_name,
-                             frame_handle->relative_to, msg->utime);
+  _notify_update(bot_frames, frame_handle->frame_name,
+                 frame_handle->relative_to, msg->utime);
 }
 
 BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
@@ -196,6 +369,10 @@ BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
 
   // create the callback lists
   self->update_callbacks = NULL;
+  g_mutex_init(&self->dispatch_mutex);
+  g_cond_init(&self->dispatch_cond);
+  self->dispatch_mode = BOT_FRAMES_DISPATCH_SYNC;
+  self->pending_updates = _pending_updates_new();
 
   int num_frames =
       bot_param_get_num_subkeys(self->bot_param, "coordinate_frames");
@@ -256,11 +433,19 @@ BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
     snprintf(param_key, sizeof(param_key), "coordinate_frames.%s.history",
              frame_name);
     int history;
-    ret = bot_param_get_int(self->bot_param, param_key, &history);
-    if (ret < 0) {
+    int have_history = bot_param_get_int(self->bot_param, param_key, &history);
+    if (have_history < 0) {
       history = DEFAULT_HISTORY_LEN;
     }
 
+    // get the history time window, if any
+    snprintf(param_key, sizeof(param_key),
+             "coordinate_frames.%s.history_window", frame_name);
+    double history_window;
+    if (bot_param_get_double(self->bot_param, param_key, &history_window) < 0) {
+      history_window = 0;
+    }
+
     // get the initial transform
     snprintf(param_key, sizeof(param_key),
              "coordinate_frames.%s.initial_transform", frame_name);
@@ -281,9 +466,21 @@ BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
       goto fail;
     }
 
-    // create and initialize the link
-    BotCTransLink* link = bot_ctrans_link_frames(self->ctrans, frame_name,
-                                                 relative_to, history + 1);
+    // create and initialize the link.  With a history window, the history
+    // starts out small and grows as needed, with the history size (if any)
+    // as the entry budget.
+    BotCTransLink* link;
+    if (history_window > 0) {
+      int history_maxlen =
+          have_history < 0 ? MAX_WINDOWED_HISTORY_LEN : history + 1;
+      link = bot_ctrans_link_frames(self->ctrans, frame_name, relative_to,
+                                    MIN(DEFAULT_HISTORY_LEN, history_maxlen));
+      bot_ctrans_link_set_history_window(link, (int64_t)(history_window * 1e6),
+                                         history_maxlen);
+    } else {
+      link = bot_ctrans_link_frames(self->ctrans, frame_name, relative_to,
+                                    history + 1);
+    }
     bot_ctrans_link_update(link, &init_trans, 0);
 
     // add the frame to the hash table
@@ -331,7 +528,10 @@ BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
       }
       // first time around, allocate and set the timer goin...
       frame_handle->update_channel = update_channel;
-      if (!pose_update_chan) {
+      frame_handle->pose_update_channel = pose_update_chan;
+      if (!self->lcm) {
+        // offline, populated by bot_frames_new_from_log
+      } else if (!pose_update_chan) {
         frame_handle->transform_subscription =
             bot_core_rigid_transform_t_subscribe(
                 self->lcm, update_channel, on_transform_update, (void*)self);
@@ -345,8 +545,10 @@ BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param) {
   }
 
   // subscribe to the default update handler
-  self->update_subscription = bot_frames_update_t_subscribe(
-      self->lcm, BOT_FRAMES_UPDATE_CHANNEL, on_frames_update, (void*)self);
+  if (self->lcm) {
+    self->update_subscription = bot_frames_update_t_subscribe(
+        self->lcm, BOT_FRAMES_UPDATE_CHANNEL, on_frames_update, (void*)self);
+  }
 
   g_strfreev(frame_names);
   g_mutex_unlock(self->mutex);
@@ -363,6 +565,11 @@ static void _update_handler_t_destroy(void* data, void* user) {
 }
 
 void bot_frames_destroy(BotFrames* bot_frames) {
+  _stop_dispatcher(bot_frames);
+  g_hash_table_destroy(bot_frames->pending_updates);
+  g_mutex_clear(&bot_frames->dispatch_mutex);
+  g_cond_clear(&bot_frames->dispatch_cond);
+
   g_mutex_lock(bot_frames->mutex);
 
   bot_ctrans_destroy(bot_frames->ctrans);
@@ -395,9 +602,403 @@ void bot_frames_destroy(BotFrames* bot_frames) {
   g_slice_free(BotFrames, bot_frames);
 }
 
+// ========= offline transform store ==========
+
+// Identifies a sidecar file written by bot_frames_new_from_log
+#define LOG_SIDECAR_MAGIC "BOTFRLG2"
+
+typedef struct {
+  int64_t utime;
+  BotTrans trans;
+} logged_trans_t;
+
+// Transformations of one link, as read from a log
+typedef struct {
+  char* frame_name;
+  char* relative_to;
+  GArray* entries;
+} logged_link_t;
+
+// Sidecar layout: the header, then for each link its frame name and
+// relative_to (each a length followed by the NUL-terminated string, padded to
+// 8 bytes), its number of transformations, and the transformations.
+// config_digest is a SHA-256 of the frames config the log was read with, since
+// that decides which messages were kept, and for which links.
+typedef struct {
+  char magic[8];
+  int64_t log_size;
+  int64_t log_mtime;
+  uint8_t config_digest[32];
+  int64_t num_links;
+} log_sidecar_header_t;
+
+static void _logged_link_destroy(logged_link_t* logged_link) {
+  free(logged_link->frame_name);
+  free(logged_link->relative_to);
+  g_array_free(logged_link->entries, TRUE);
+  free(logged_link);
+}
+
+static logged_link_t* _logged_link_lookup(GHashTable* logged_links,
+                                          const char* frame_name,
+                                          const char* relative_to) {
+  logged_link_t* logged_link = g_hash_table_lookup(logged_links, frame_name);
+  if (logged_link == NULL) {
+    logged_link = (logged_link_t*)calloc(1, sizeof(logged_link_t));
+    logged_link->frame_name = strdup(frame_name);
+    logged_link->relative_to = strdup(relative_to);
+    logged_link->entries = g_array_new(FALSE, FALSE, sizeof(logged_trans_t));
+    g_hash_table_insert(logged_links, logged_link->frame_name, logged_link);
+  } else if (strcmp(relative_to, logged_link->relative_to) != 0) {
+    return NULL;
+  }
+  return logged_link;
+}
+
+static void _logged_link_add(GHashTable* logged_links, const char* frame_name,
+                             const char* relative_to, int64_t utime,
+                             const double trans[3], const double quat[4]) {
+  logged_link_t* logged_link =
+      _logged_link_lookup(logged_links, frame_name, relative_to);
+  if (logged_link == NULL) {
+    return;
+  }
+  logged_trans_t entry;
+  entry.utime = utime;
+  bot_trans_set_from_quat_trans(&entry.trans, quat, trans);
+  g_array_append_val(logged_link->entries, entry);
+}
+
+static GHashTable* _logged_links_new(void) {
+  return g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+                               (GDestroyNotify)_logged_link_destroy);
+}
+
+static GHashTable* _scan_log(BotFrames* bot_frames, const char* log_filename) {
+  lcm_eventlog_t* log = lcm_eventlog_create(log_filename, "r");
+  if (!log) {
+    fprintf(stderr, "BotFrames Error: could not open log %s\n", log_filename);
+    return NULL;
+  }
+
+  GHashTable* logged_links = _logged_links_new();
+  lcm_eventlog_event_t* event;
+  while ((event = lcm_eventlog_read_next_event(log)) != NULL) {
+    if (strcmp(event->channel, BOT_FRAMES_UPDATE_CHANNEL) == 0) {
+      bot_frames_update_t msg;
+      if (bot_frames_update_t_decode(event->data, 0, event->datalen, &msg) >=
+          0) {
+        // as in on_frames_update, ignore updates relative to the wrong frame
+        frame_handle_t* frame_handle = (frame_handle_t*)g_hash_table_lookup(
+            bot_frames->frame_handles_by_name, msg.frame);
+        if (frame_handle == NULL ||
+            (frame_handle->relative_to != NULL &&
+             strcmp(msg.relative_to, frame_handle->relative_to) == 0)) {
+          _logged_link_add(logged_links, msg.frame, msg.relative_to, msg.utime,
+                           msg.trans, msg.quat);
+        }
+        bot_frames_update_t_decode_cleanup(&msg);
+      }
+    } else {
+      frame_handle_t* frame_handle = (frame_handle_t*)g_hash_table_lookup(
+          bot_frames->frame_handles_by_channel, event->channel);
+      if (frame_handle != NULL && frame_handle->pose_update_channel) {
+        bot_core_pose_t msg;
+        if (bot_core_pose_t_decode(event->data, 0, event->datalen, &msg) >=
+            0) {
+          _logged_link_add(logged_links, frame_handle->frame_name,
+                           frame_handle->relative_to, msg.utime, msg.pos,
+                           msg.orientation);
+          bot_core_pose_t_decode_cleanup(&msg);
+        }
+      } else if (frame_handle != NULL) {
+        bot_core_rigid_transform_t msg;
+        if (bot_core_rigid_transform_t_decode(event->data, 0, event->datalen,
+                                              &msg) >= 0) {
+          _logged_link_add(logged_links, frame_handle->frame_name,
+                           frame_handle->relative_to, msg.utime, msg.trans,
+                           msg.quat);
+          bot_core_rigid_transform_t_decode_cleanup(&msg);
+        }
+      }
+    }
+    lcm_eventlog_free_event(event);
+  }
+  lcm_eventlog_destroy(log);
+  return logged_links;
+}
+
+static gint _logged_trans_compare(gconstpointer a, gconstpointer b) {
+  int64_t utime_a = ((const logged_trans_t*)a)->utime;
+  int64_t utime_b = ((const logged_trans_t*)b)->utime;
+  return utime_a < utime_b ? -1 : (utime_a > utime_b ? 1 : 0);
+}
+
+// Sorts the transformations of each link by time, and loads them into
+// appropriately sized link histories.
+static void _apply_logged_links(BotFrames* bot_frames,
+                                GHashTable* logged_links) {
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, logged_links);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    logged_link_t* logged_link = (logged_link_t*)value;
+    GArray* entries = logged_link->entries;
+    // stable, so later messages still replace earlier ones with the same time
+    g_array_sort(entries, _logged_trans_compare);
+
+    frame_handle_t* frame_handle = (frame_handle_t*)g_hash_table_lookup(
+        bot_frames->frame_handles_by_name, logged_link->frame_name);
+    if (frame_handle == NULL) {
+      // a frame that only appears in bot_frames_update_t messages
+      if (g_hash_table_lookup(bot_frames->frame_handles_by_name,
+                              logged_link->relative_to) == NULL) {
+        fprintf(stderr,
+                "BotFrames Error: ignoring logged link %s->%s, frame %s is "
+                "unknown\n",
+                logged_link->frame_name, logged_link->relative_to,
+                logged_link->relative_to);
+        continue;
+      }
+      bot_ctrans_add_frame(bot_frames->ctrans, logged_link->frame_name);
+      frame_handle = (frame_handle_t*)calloc(1, sizeof(frame_handle_t));
+      frame_handle->frame_num = bot_frames->num_frames++;
+      frame_handle->frame_name = strdup(logged_link->frame_name);
+      frame_handle->relative_to = strdup(logged_link->relative_to);
+      frame_handle->ctrans_link = bot_ctrans_link_frames(
+          bot_frames->ctrans, frame_handle->frame_name,
+          frame_handle->relative_to, MAX(entries->len, 1));
+      g_hash_table_insert(bot_frames->frame_handles_by_name,
+                          (gpointer)frame_handle->frame_name,
+                          (gpointer)frame_handle);
+    } else if (frame_handle->ctrans_link == NULL) {
+      continue;  // the root frame
+    } else {
+      // keep the initial transform around for queries before the first update
+      bot_ctrans_link_set_history_maxlen(
+          frame_handle->ctrans_link,
+          bot_ctrans_link_get_n_trans(frame_handle->ctrans_link) +
+              MAX(entries->len, 1));
+    }
+
+    for (int i = 0; i < entries->len; i++) {
+      const logged_trans_t* entry = &g_array_index(entries, logged_trans_t, i);
+      bot_ctrans_link_update(frame_handle->ctrans_link, &entry->trans,
+                             entry->utime);
+    }
+    frame_handle->was_updated = entries->len > 0;
+  }
+}
+
+static void _checksum_update_string(GChecksum* checksum, const char* str) {
+  // include the NUL, so that adjacent strings cannot run into each other
+  if (str) {
+    g_checksum_update(checksum, (const guchar*)str, strlen(str) + 1);
+  } else {
+    g_checksum_update(checksum, (const guchar*)"\xff", 1);
+  }
+}
+
+// Computes a digest of what _scan_log depends on: the name, relative_to and
+// update channel of every configured frame, in order of name.
+static void _frames_config_digest(BotFrames* bot_frames, uint8_t digest[32]) {
+  GChecksum* checksum = g_checksum_new(G_CHECKSUM_SHA256);
+  GList* frame_names = g_list_sort(
+      g_hash_table_get_keys(bot_frames->frame_handles_by_name),
+      (GCompareFunc)strcmp);
+  for (GList* iter = frame_names; iter; iter = iter->next) {
+    frame_handle_t* frame_handle = (frame_handle_t*)g_hash_table_lookup(
+        bot_frames->frame_handles_by_name, iter->data);
+    _checksum_update_string(checksum, frame_handle->frame_name);
+    _checksum_update_string(checksum, frame_handle->relative_to);
+    _checksum_update_string(checksum, frame_handle->update_channel);
+    guchar pose_update_channel = frame_handle->pose_update_channel != 0;
+    g_checksum_update(checksum, &pose_update_channel, 1);
+  }
+  g_list_free(frame_names);
+
+  gsize digest_len = 32;
+  g_checksum_get_digest(checksum, digest, &digest_len);
+  g_checksum_free(checksum);
+}
+
+static void _write_sidecar_string(FILE* f, const char* str) {
+  static const char padding[8] = {0};
+  int64_t len = strlen(str) + 1;
+  int64_t padded_len = (len + 7) & ~7;
+  fwrite(&padded_len, sizeof(padded_len), 1, f);
+  fwrite(str, 1, len, f);
+  fwrite(padding, 1, padded_len - len, f);
+}
+
+static void _write_sidecar(const char* sidecar_filename,
+                           const struct stat* log_stat,
+                           const uint8_t config_digest[32],
+                           GHashTable* logged_links) {
+  // write to a temporary file first, so that a partially written sidecar is
+  // never picked up
+  char* tmp_filename = g_strdup_printf("%s.tmp", sidecar_filename);
+  FILE* f = fopen(tmp_filename, "wb");
+  if (!f) {
+    fprintf(stderr, "BotFrames Error: could not write %s\n", tmp_filename);
+    g_free(tmp_filename);
+    return;
+  }
+
+  log_sidecar_header_t header;
+  memcpy(header.magic, LOG_SIDECAR_MAGIC, sizeof(header.magic));
+  header.log_size = log_stat->st_size;
+  header.log_mtime = log_stat->st_mtime;
+  memcpy(header.config_digest, config_digest, sizeof(header.config_digest));
+  header.num_links = g_hash_table_size(logged_links);
+  fwrite(&header, sizeof(header), 1, f);
+
+  GHashTableIter iter;
+  gpointer value;
+  g_hash_table_iter_init(&iter, logged_links);
+  while (g_hash_table_iter_next(&iter, NULL, &value)) {
+    logged_link_t* logged_link = (logged_link_t*)value;
+    _write_sidecar_string(f, logged_link->frame_name);
+    _write_sidecar_string(f, logged_link->relative_to);
+    int64_t num_entries = logged_link->entries->len;
+    fwrite(&num_entries, sizeof(num_entries), 1, f);
+    fwrite(logged_link->entries->data, sizeof(logged_trans_t), num_entries, f);
+  }
+
+  int failed = ferror(f);
+  if (fclose(f) != 0 || failed || rename(tmp_filename, sidecar_filename) != 0) {
+    fprintf(stderr, "BotFrames Error: could not write %s\n", sidecar_filename);
+    remove(tmp_filename);
+  }
+  g_free(tmp_filename);
+}
+
+// Returns a pointer to the next len bytes of the sidecar, or NULL if the
+// sidecar is truncated.
+static const char* _read_sidecar_bytes(const char** pos, const char* end,
+                                       int64_t len) {
+  if (len < 0 || end - *pos < len) {
+    return NULL;
+  }
+  const char* result = *pos;
+  *pos += len;
+  return result;
+}
+
+static const char* _read_sidecar_string(const char** pos, const char* end) {
+  const int64_t* len = (const int64_t*)_read_sidecar_bytes(pos, end, 8);
+  if (!len) {
+    return NULL;
+  }
+  const char* str = _read_sidecar_bytes(pos, end, *len);
+  if (!str || *len == 0 || memchr(str, 0, *len) == NULL) {
+    return NULL;
+  }
+  return str;
+}
+
+// Loads the transformations saved by _write_sidecar, provided that they were
+// saved for the same log file and frames config.
+static GHashTable* _read_sidecar(const char* sidecar_filename,
+                                 const struct stat* log_stat,
+                                 const uint8_t config_digest[32]) {
+  GMappedFile* mapped = g_mapped_file_new(sidecar_filename, FALSE, NULL);
+  if (!mapped) {
+    return NULL;
+  }
+  const char* pos = g_mapped_file_get_contents(mapped);
+  const char* end = pos + g_mapped_file_get_length(mapped);
+
+  GHashTable* logged_links = NULL;
+  const log_sidecar_header_t* header = (const log_sidecar_header_t*)
+      _read_sidecar_bytes(&pos, end, sizeof(log_sidecar_header_t));
+  if (!header ||
+      memcmp(header->magic, LOG_SIDECAR_MAGIC, sizeof(header->magic)) != 0 ||
+      header->log_size != log_stat->st_size ||
+      header->log_mtime != log_stat->st_mtime ||
+      memcmp(header->config_digest, config_digest,
+             sizeof(header->config_digest)) != 0) {
+    goto done;
+  }
+
+  logged_links = _logged_links_new();
+  for (int64_t i = 0; i < header->num_links; i++) {
+    const char* frame_name = _read_sidecar_string(&pos, end);
+    const char* relative_to = _read_sidecar_string(&pos, end);
+    const int64_t* num_entries =
+        (const int64_t*)_read_sidecar_bytes(&pos, end, 8);
+    const char* entries =
+        num_entries && *num_entries <= INT_MAX / sizeof(logged_trans_t)
+            ? _read_sidecar_bytes(&pos, end,
+                                  *num_entries * sizeof(logged_trans_t))
+            : NULL;
+    if (!frame_name || !relative_to || !entries) {
+      fprintf(stderr, "BotFrames Error: %s is corrupt, ignoring it\n",
+              sidecar_filename);
+      g_hash_table_destroy(logged_links);
+      logged_links = NULL;
+      goto done;
+    }
+    logged_link_t* logged_link =
+        _logged_link_lookup(logged_links, frame_name, relative_to);
+    if (logged_link) {
+      g_array_append_vals(logged_link->entries, entries, *num_entries);
+    }
+  }
+
+done:
+  g_mapped_file_unref(mapped);
+  return logged_links;
+}
+
+BotFrames* bot_frames_new_from_log(const char* log_filename,
+                                   BotParam* bot_param,
+                                   const char* sidecar_filename) {
+  struct stat log_stat;
+  if (stat(log_filename, &log_stat) != 0) {
+    fprintf(stderr, "BotFrames Error: could not open log %s\n", log_filename);
+    return NULL;
+  }
+
+  BotFrames* self = bot_frames_new(NULL, bot_param);
+  if (!self) {
+    return NULL;
+  }
+
+  g_mutex_lock(self->mutex);
+  GHashTable* logged_links = NULL;
+  uint8_t config_digest[32];
+  if (sidecar_filename) {
+    _frames_config_digest(self, config_digest);
+    logged_links = _read_sidecar(sidecar_filename, &log_stat, config_digest);
+  }
+  int from_sidecar = logged_links != NULL;
+  if (!from_sidecar) {
+    logged_links = _scan_log(self, log_filename);
+  }
+  if (!logged_links) {
+    g_mutex_unlock(self->mutex);
+    bot_frames_destroy(self);
+    return NULL;
+  }
+
+  _apply_logged_links(self, logged_links);
+  if (sidecar_filename && !from_sidecar) {
+    _write_sidecar(sidecar_filename, &log_stat, config_digest, logged_links);
+  }
+  g_hash_table_destroy(logged_links);
+  g_mutex_unlock(self->mutex);
+  return self;
+}
+
 void bot_frames_update_frame(BotFrames* bot_frames, const char* frame_name,
                              const char* relative_to, const BotTrans* trans,
                              int64_t utime) {
+  if (!bot_frames->lcm) {
+    fprintf(stderr, "BotFrames Error: cannot update frame %s offline\n",
+            frame_name);
+    return;
+  }
   bot_frames_update_t msg;
   msg.frame = (char*)frame_name;
   msg.relative_to = (char*)relative_to;
@@ -420,36 +1021,212 @@ void bot_frames_add_update_subscriber(
   g_mutex_unlock(bot_frames->mutex);
 }
 
+void bot_frames_set_update_dispatch(BotFrames* bot_frames,
+                                    BotFramesDispatchMode mode,
+                                    double max_rate_hz) {
+  _stop_dispatcher(bot_frames);
+
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  bot_frames->dispatch_mode = mode;
+  bot_frames->dispatch_period_usec =
+      max_rate_hz > 0 ? (int64_t)(1e6 / max_rate_hz) : 0;
+  GHashTable* pending_updates = NULL;
+  if (g_hash_table_size(bot_frames->pending_updates) > 0) {
+    if (mode == BOT_FRAMES_DISPATCH_SYNC) {
+      pending_updates = _take_pending_updates(bot_frames);
+    } else if (mode == BOT_FRAMES_DISPATCH_MAIN_LOOP) {
+      bot_frames->dispatch_source_id =
+          g_idle_add(_dispatch_source, bot_frames);
+    }
+  }
+  if (mode == BOT_FRAMES_DISPATCH_THREAD) {
+    bot_frames->dispatch_thread =
+        g_thread_new("bot_frames_dispatch", _dispatch_thread, bot_frames);
+  }
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+
+  if (pending_updates) {
+    _dispatch_pending_updates(bot_frames, pending_updates);
+  }
+}
+
+void bot_frames_get_dispatch_stats(BotFrames* bot_frames,
+                                   BotFramesDispatchStats* stats) {
+  g_mutex_lock(&bot_frames->dispatch_mutex);
+  *stats = bot_frames->dispatch_stats;
+  g_mutex_unlock(&bot_frames->dispatch_mutex);
+}
+
 int bot_frames_get_latest_timestamp(BotFrames* bot_frames,
                                     const char* from_frame,
                                     const char* to_frame, int64_t* timestamp) {
-  g_mutex_lock(bot_frames->mutex);
-  int status = bot_ctrans_get_trans_latest_timestamp(
-      bot_frames->ctrans, from_frame, to_frame, timestamp);
-  g_mutex_unlock(bot_frames->mutex);
-  return status;
+  return bot_ctrans_get_trans_latest_timestamp(bot_frames->ctrans, from_frame,
+                                               to_frame, timestamp);
 }
 
 int bot_frames_get_trans_with_utime(BotFrames* bot_frames,
                                     const char* from_frame,
                                     const char* to_frame, int64_t utime,
                                     BotTrans* result) {
-  g_mutex_lock(bot_frames->mutex);
-  int status = bot_ctrans_get_trans(bot_frames->ctrans, from_frame, to_frame,
-                                    utime, result);
-  g_mutex_unlock(bot_frames->mutex);
-  return status;
+  return bot_ctrans_get_trans(bot_frames->ctrans, from_frame, to_frame, utime,
+                              result);
 }
 
 int bot_frames_get_trans(BotFrames* bot_frames, const char* from_frame,
                          const char* to_frame, BotTrans* result) {
+  return bot_ctrans_get_trans_latest(bot_frames->ctrans, from_frame, to_frame,
+                                     result);
+}
+
+int bot_frames_get_trans_batch(BotFrames* bot_frames, int n,
+                               const char** from_frames,
+                               const char** to_frames, const int64_t* utimes,
+                               BotTrans* results, int* status) {
+  return bot_ctrans_get_trans_batch(bot_frames->ctrans, n, from_frames,
+                                    to_frames, utimes, results, status);
+}
+
+// Number of intervals over which the sensor->target transformation is
+// interpolated when deskewing a scan.  Beams falling between two knots use a
+// linear blend of the knot matrices.  Blending rotations by theta shrinks the
+// rotated part of a beam by at most 1 - cos(theta / 2) <= theta^2 / 8 of its
+// range, which is what bounds the error documented in bot_frames.h.
+#define DESKEW_NUM_SEGMENTS 8
+
+int bot_frames_deskew_planar_lidar(BotFrames* bot_frames,
+                                   const bot_core_planar_lidar_t* scan,
+                                   const char* sensor_frame,
+                                   const char* target_frame,
+                                   int64_t utime_start, int64_t utime_end,
+                                   double* points) {
+  const char* from_frames[DESKEW_NUM_SEGMENTS + 1];
+  const char* to_frames[DESKEW_NUM_SEGMENTS + 1];
+  int64_t utimes[DESKEW_NUM_SEGMENTS + 1];
+  BotTrans knots[DESKEW_NUM_SEGMENTS + 1];
+  for (int k = 0; k <= DESKEW_NUM_SEGMENTS; k++) {
+    from_frames[k] = sensor_frame;
+    to_frames[k] = target_frame;
+    utimes[k] =
+        utime_start + (utime_end - utime_start) * k / DESKEW_NUM_SEGMENTS;
+  }
+  if (bot_frames_get_trans_batch(bot_frames, DESKEW_NUM_SEGMENTS + 1,
+                                 from_frames, to_frames, utimes, knots,
+                                 NULL) != DESKEW_NUM_SEGMENTS + 1) {
+    return 0;
+  }
+
+  // Beams lie in the sensor's xy plane, so only the first two columns of the
+  // rotation and the translation are needed.  For each segment, keep the
+  // matrix at its start and the change in the matrix over the segment.
+  double mats[DESKEW_NUM_SEGMENTS + 1][12];
+  for (int k = 0; k <= DESKEW_NUM_SEGMENTS; k++) {
+    bot_trans_get_mat_3x4(&knots[k], mats[k]);
+  }
+  double dmats[DESKEW_NUM_SEGMENTS][12];
+  for (int k = 0; k < DESKEW_NUM_SEGMENTS; k++) {
+    for (int j = 0; j < 12; j++) {
+      dmats[k][j] = mats[k + 1][j] - mats[k][j];
+    }
+  }
+
+  int nranges = scan->nranges;
+  double segments_per_beam =
+      nranges > 1 ? (double)DESKEW_NUM_SEGMENTS / (nranges - 1) : 0;
+
+  // step the beam direction by rotating it, rather than calling sin and cos
+  // for every beam
+  double c = cos(scan->rad0);
+  double s = sin(scan->rad0);
+  const double cstep = cos(scan->radstep);
+  const double sstep = sin(scan->radstep);
+
+  for (int i = 0; i < nranges; i++) {
+    double x = scan->ranges[i] * c;
+    double y = scan->ranges[i] * s;
+
+    double u = i * segments_per_beam;
+    int k = (int)u;
+    if (k >= DESKEW_NUM_SEGMENTS) {
+      k = DESKEW_NUM_SEGMENTS - 1;
+    }
+    double a = u - k;
+    const double* m = mats[k];
+    const double* dm = dmats[k];
+
+    double* p = points + 3 * i;
+    p[0] = (m[0] + a * dm[0]) * x + (m[1] + a * dm[1]) * y + m[3] + a * dm[3];
+    p[1] = (m[4] + a * dm[4]) * x + (m[5] + a * dm[5]) * y + m[7] + a * dm[7];
+    p[2] =
+        (m[8] + a * dm[8]) * x + (m[9] + a * dm[9]) * y + m[11] + a * dm[11];
+
+    double c_next = c * cstep - s * sstep;
+    s = s * cstep + c * sstep;
+    c = c_next;
+  }
+  return 1;
+}
+
+int bot_frames_get_link_stats(BotFrames* bot_frames, const char* frame_name,
+                              BotCTransLinkStats* stats) {
   g_mutex_lock(bot_frames->mutex);
-  int status = bot_ctrans_get_trans_latest(bot_frames->ctrans, from_frame,
-                                           to_frame, result);
+  frame_handle_t* frame_handle = (frame_handle_t*)g_hash_table_lookup(
+      bot_frames->frame_handles_by_name, frame_name);
+  int status = 0;
+  if (frame_handle != NULL && frame_handle->ctrans_link != NULL) {
+    bot_ctrans_link_get_stats(frame_handle->ctrans_link, stats);
+    status = 1;
+  }
   g_mutex_unlock(bot_frames->mutex);
   return status;
 }
 
+int bot_frames_get_frame_id(BotFrames* bot_frames, const char* frame_name) {
+  return bot_ctrans_get_frame_index(bot_frames->ctrans, frame_name);
+}
+
+int bot_frames_get_trans_by_id(BotFrames* bot_frames, int from_id, int to_id,
+                               BotTrans* result) {
+  return bot_ctrans_get_trans_latest_by_index(bot_frames->ctrans, from_id,
+                                              to_id, result);
+}
+
+int bot_frames_get_trans_with_utime_by_id(BotFrames* bot_frames, int from_id,
+                                          int to_id, int64_t utime,
+                                          BotTrans* result) {
+  return bot_ctrans_get_trans_by_index(bot_frames->ctrans, from_id, to_id,
+                                       utime, result);
+}
+
+BotFramesQuery* bot_frames_query_new(BotFrames* bot_frames,
+                                     const char* from_frame,
+                                     const char* to_frame) {
+  int from_id = bot_frames_get_frame_id(bot_frames, from_frame);
+  int to_id = bot_frames_get_frame_id(bot_frames, to_frame);
+  if (from_id < 0 || to_id < 0) {
+    return NULL;
+  }
+  BotFramesQuery* query = g_slice_new0(BotFramesQuery);
+  query->bot_frames = bot_frames;
+  query->from_id = from_id;
+  query->to_id = to_id;
+  return query;
+}
+
+void bot_frames_query_destroy(BotFramesQuery* query) {
+  g_slice_free(BotFramesQuery, query);
+}
+
+int bot_frames_query_get_trans(BotFramesQuery* query, BotTrans* result) {
+  return bot_frames_get_trans_by_id(query->bot_frames, query->from_id,
+                                    query->to_id, result);
+}
+
+int bot_frames_query_get_trans_with_utime(BotFramesQuery* query,
+                                          int64_t utime, BotTrans* result) {
+  return bot_frames_get_trans_with_utime_by_id(
+      query->bot_frames, query->from_id, query->to_id, utime, result);
+}
+
 int bot_frames_get_trans_mat_3x4(BotFrames* bot_frames, const char* from_frame,
                                  const char* to_frame, double mat[12]) {
   BotTrans bt;
@@ -500,19 +1277,13 @@ int bot_frames_get_trans_latest_timestamp(BotFrames* bot_frames,
                                           const char* from_frame,
                                           const char* to_frame,
                                           int64_t* timestamp) {
-  g_mutex_lock(bot_frames->mutex);
-  int status = bot_ctrans_get_trans_latest_timestamp(
-      bot_frames->ctrans, from_frame, to_frame, timestamp);
-  g_mutex_unlock(bot_frames->mutex);
-  return status;
+  return bot_ctrans_get_trans_latest_timestamp(bot_frames->ctrans, from_frame,
+                                               to_frame, timestamp);
 }
 
 int bot_frames_have_trans(BotFrames* bot_frames, const char* from_frame,
                           const char* to_frame) {
-  g_mutex_lock(bot_frames->mutex);
-  int status = bot_ctrans_have_trans(bot_frames->ctrans, from_frame, to_frame);
-  g_mutex_unlock(bot_frames->mutex);
-  return status;
+  return bot_ctrans_have_trans(bot_frames->ctrans, from_frame, to_frame);
 }
 
 int bot_frames_transform_vec(BotFrames* bot_frames, const char* from_frame,
@@ -539,18 +1310,12 @@ int bot_frames_rotate_vec(BotFrames* bot_frames, const char* from_frame,
 
 int bot_frames_get_n_trans(BotFrames* bot_frames, const char* from_frame,
                            const char* to_frame, int nth_from_latest) {
-  g_mutex_lock(bot_frames->mutex);
   BotCTransLink* link =
       bot_ctrans_get_link(bot_frames->ctrans, from_frame, to_frame);
-  int n_trans;
   if (!link) {
-    n_trans = 0;
-  } else {
-    n_trans = bot_ctrans_link_get_n_trans(link);
+    return 0;
   }
-  g_mutex_unlock(bot_frames->mutex);
-
-  return n_trans;
+  return bot_ctrans_link_get_n_trans(link);
 }
 
 /**
@@ -559,21 +1324,17 @@ int bot_frames_get_n_trans(BotFrames* bot_frames, const char* from_frame,
 int bot_frames_get_nth_trans(BotFrames* bot_frames, const char* from_frame,
                              const char* to_frame, int nth_from_latest,
                              BotTrans* btrans, int64_t* timestamp) {
-  g_mutex_lock(bot_frames->mutex);
   BotCTransLink* link =
       bot_ctrans_get_link(bot_frames->ctrans, from_frame, to_frame);
-  int status;
   if (!link) {
-    status = 0;
-  } else {
-    status =
-        bot_ctrans_link_get_nth_trans(link, nth_from_latest, btrans, timestamp);
-    if (status && btrans &&
-        0 != strcmp(to_frame, bot_ctrans_link_get_to_frame(link))) {
-      bot_trans_invert(btrans);
-    }
+    return 0;
+  }
+  int status =
+      bot_ctrans_link_get_nth_trans(link, nth_from_latest, btrans, timestamp);
+  if (status && btrans &&
+      0 != strcmp(to_frame, bot_ctrans_link_get_to_frame(link))) {
+    bot_trans_invert(btrans);
   }
-  g_mutex_unlock(bot_frames->mutex);
   return status;
 }
 const char* bot_frames_get_relative_to(BotFrames* bot_frames,
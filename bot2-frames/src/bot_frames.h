@@ -25,8 +25,10 @@
 
 #include <lcm/lcm.h>
 
+#include <bot_core/ctrans.h>
 #include <bot_core/trans.h>
 #include <bot_param/param_client.h>
+#include <lcmtypes/bot_core_planar_lidar_t.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -54,6 +56,11 @@ extern "C" {
  *      3) defining a pose_update_channel, where bot_core_pose_t messages will
  *         be listened for
  *
+ * Transform queries may be made from any number of threads.  They do not
+ * block each other, nor the LCM handlers applying frame updates, except on a
+ * frame with a history_window: an update that grows or shrinks its history
+ * waits for running queries to finish, and new queries wait for that update.
+ *
  * It assumes that there is a block in the param file specifying the layout of
  * the coordinate frames.
  * For example:
@@ -64,6 +71,10 @@ extern "C" {
  *      relative_to = "local";
  *      history = 1000;                # number of past transforms to keep
  *                                     # around,
+ *      history_window = 2.0;          # optional: seconds of past transforms
+ *                                     # to keep around.  The history grows
+ *                                     # and shrinks with the update rate,
+ *                                     # up to 'history' transforms
  *      pose_update_channel = "POSE";  # bot_core_pose_t messages will be
  *                                     # listened for this channel
  *      initial_transform {
@@ -97,6 +108,14 @@ extern "C" {
  */
 typedef struct _BotFrames BotFrames;
 
+/**
+ * BotFramesQuery:
+ *
+ * A transform query between two fixed coordinate frames.  Resolves the frame
+ * names once, so that repeated queries skip the name lookups.
+ */
+typedef struct _BotFramesQuery BotFramesQuery;
+
 /**
  * bot_frames_new
  *
@@ -115,6 +134,34 @@ typedef struct _BotFrames BotFrames;
  */
 BotFrames* bot_frames_new(lcm_t* lcm, BotParam* bot_param);
 
+/**
+ * bot_frames_new_from_log
+ *
+ * allocates and initializes a new BotFrames structure for offline processing
+ * of an LCM log.  The frames are set up from bot_param as in bot_frames_new,
+ * and the log is then read once for the update channels of the frames and for
+ * bot_frames_update_t messages.  Every transform in the log is kept, sorted
+ * by time, so the transform at any time covered by the log can be queried,
+ * in any order and from any number of threads.
+ *
+ * The returned structure is not attached to LCM, so it is not updated
+ * further and bot_frames_update_frame cannot be used with it.
+ *
+ * log_filename: path of the LCM log to read
+ * bot_param: pointer to a BotParam structure that contains a
+ *  "coordinate_frames" key
+ * sidecar_filename: optional path of a cache file.  If it holds the
+ *  transforms of the same log, read with the same frames and update channels
+ *  in bot_param, they are memory mapped from it instead of reading the log.
+ *  Otherwise it is (re)written after reading the log.  May be NULL.
+ *
+ * returns a newly allocated/initialized pointer to a BotFrames structure, or
+ * NULL if the log could not be read
+ */
+BotFrames* bot_frames_new_from_log(const char* log_filename,
+                                   BotParam* bot_param,
+                                   const char* sidecar_filename);
+
 /**
  * bot_frames_destroy
  *
@@ -196,6 +243,67 @@ void bot_frames_add_update_subscriber(
     BotFrames* bot_frames, bot_frames_link_update_handler_t* callback_func,
     void* user);
 
+/**
+ * BotFramesDispatchMode
+ *
+ * How update callbacks are delivered.
+ *
+ * BOT_FRAMES_DISPATCH_SYNC: every update is delivered from the LCM handler
+ *  that received it (the default)
+ * BOT_FRAMES_DISPATCH_THREAD: updates are delivered from a thread owned by
+ *  the BotFrames structure
+ * BOT_FRAMES_DISPATCH_MAIN_LOOP: updates are delivered from the default GLib
+ *  main context
+ */
+typedef enum {
+  BOT_FRAMES_DISPATCH_SYNC,
+  BOT_FRAMES_DISPATCH_THREAD,
+  BOT_FRAMES_DISPATCH_MAIN_LOOP,
+} BotFramesDispatchMode;
+
+/**
+ * BotFramesDispatchStats
+ *
+ * num_received: link updates received
+ * num_dispatched: notifications delivered to the update callbacks
+ * num_coalesced: updates merged into a newer pending notification for the
+ *  same link
+ * num_dropped: updates discarded because a pending notification for the same
+ *  link was newer
+ */
+typedef struct {
+  int64_t num_received;
+  int64_t num_dispatched;
+  int64_t num_coalesced;
+  int64_t num_dropped;
+} BotFramesDispatchStats;
+
+/**
+ * bot_frames_set_update_dispatch
+ *
+ * selects how update callbacks are delivered.  In the asynchronous modes,
+ * slow callbacks no longer hold up LCM handling: the LCM handlers only queue
+ * the update, and updates to a link that arrive before the previous one was
+ * delivered are coalesced into a single notification with the latest utime.
+ * Notifications are delivered in bursts, at most max_rate_hz times per second.
+ *
+ * bot_frames: the BotFrames structure
+ * mode: how to deliver update callbacks
+ * max_rate_hz: maximum rate of delivery in the asynchronous modes, or 0 to
+ *  deliver as soon as possible
+ */
+void bot_frames_set_update_dispatch(BotFrames* bot_frames,
+                                    BotFramesDispatchMode mode,
+                                    double max_rate_hz);
+
+/**
+ * bot_frames_get_dispatch_stats
+ *
+ * retrieves counters describing the delivery of update callbacks
+ */
+void bot_frames_get_dispatch_stats(BotFrames* bot_frames,
+                                   BotFramesDispatchStats* stats);
+
 /**
  * bot_frames_get_trans
  *
@@ -231,6 +339,160 @@ int bot_frames_get_trans_with_utime(BotFrames* bot_frames,
                                     const char* to_frame, int64_t utime,
                                     BotTrans* result);
 
+/**
+ * bot_frames_get_trans_batch
+ *
+ * compute several rigid body transformations at once.  Each transformation
+ * is computed as by bot_frames_get_trans_with_utime, but links that are
+ * shared by several of the requested transformations (e.g., body->local) are
+ * only interpolated once per distinct utime.
+ *
+ * bot_frames: BotFrames structure to get transforms
+ * n: number of transformations to compute
+ * from_frames: names of the frames at the start of each transform
+ * to_frames: names of the frames at the end of each transform
+ * utimes: time (in microseconds) of each transform
+ * results: resulting transformations
+ * status: set to 1 for each transformation that was computed, 0 for each that
+ *  was not.  May be NULL.
+ *
+ * Returns: the number of transformations computed successfully
+ */
+int bot_frames_get_trans_batch(BotFrames* bot_frames, int n,
+                               const char** from_frames,
+                               const char** to_frames, const int64_t* utimes,
+                               BotTrans* results, int* status);
+
+/**
+ * bot_frames_deskew_planar_lidar
+ *
+ * project a planar lidar scan into a coordinate frame, compensating for the
+ * motion of the sensor while the scan was swept.  Beams are assumed to be
+ * evenly spaced in time between utime_start (the first beam) and utime_end
+ * (the last beam).
+ *
+ * The sensor_frame -> target_frame transformation is only looked up at 9
+ * evenly spaced knots over the sweep, and each beam is transformed by a
+ * linear blend of the 3x4 matrices of the two knots around it.  The blend is
+ * not exactly rigid: if the sensor rotates by theta radians between two
+ * knots, a beam of range r is displaced by at most r * theta^2 / 8 from where
+ * a rigid interpolation of the knots would put it (e.g., 0.1 mm at 30 m for a
+ * sensor turning at 90 deg/s during a 25 ms scan).  Motion between the knots
+ * is taken to be uniform, so transformation updates faster than 8 per scan
+ * are not followed.
+ *
+ * bot_frames: BotFrames structure to get transforms
+ * scan: the scan to project
+ * sensor_frame: string of the name of the frame the scan was measured in
+ * target_frame: string of the name of the frame to project the scan into
+ * utime_start: time (in microseconds) of the first beam
+ * utime_end: time (in microseconds) of the last beam
+ * points: output array of 3 * scan->nranges doubles, filled with the x, y, z
+ *  coordinates of every beam in target_frame.  Beams are not filtered, so
+ *  invalid ranges produce points too.
+ *
+ * Returns: 1 on success, 0 if the transformation is not available over the
+ * whole sweep
+ */
+int bot_frames_deskew_planar_lidar(BotFrames* bot_frames,
+                                   const bot_core_planar_lidar_t* scan,
+                                   const char* sensor_frame,
+                                   const char* target_frame,
+                                   int64_t utime_start, int64_t utime_end,
+                                   double* points);
+
+/**
+ * bot_frames_get_link_stats
+ *
+ * Retrieves the size, memory use, and time span of the transformation history
+ * kept for a frame, i.e., for its link to the frame it is relative_to.
+ *
+ * frame_name: string of the name of the frame
+ * stats: output parameter
+ *
+ * Returns: 1 on success, 0 if the frame does not exist or is the root frame
+ */
+int bot_frames_get_link_stats(BotFrames* bot_frames, const char* frame_name,
+                              BotCTransLinkStats* stats);
+
+/**
+ * bot_frames_get_frame_id
+ *
+ * Looks up the integer id of a coordinate frame.  Ids remain valid for the
+ * lifetime of the BotFrames structure, and can be passed to
+ * bot_frames_get_trans_by_id and bot_frames_get_trans_with_utime_by_id to
+ * avoid looking up the frames by name on every query.
+ *
+ * Returns: the id of the frame, or -1 if there is no such frame
+ */
+int bot_frames_get_frame_id(BotFrames* bot_frames, const char* frame_name);
+
+/**
+ * bot_frames_get_trans_by_id
+ *
+ * Same as bot_frames_get_trans, with the frames identified by the ids returned
+ * by bot_frames_get_frame_id.
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_frames_get_trans_by_id(BotFrames* bot_frames, int from_id, int to_id,
+                               BotTrans* result);
+
+/**
+ * bot_frames_get_trans_with_utime_by_id
+ *
+ * Same as bot_frames_get_trans_with_utime, with the frames identified by the
+ * ids returned by bot_frames_get_frame_id.
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_frames_get_trans_with_utime_by_id(BotFrames* bot_frames, int from_id,
+                                          int to_id, int64_t utime,
+                                          BotTrans* result);
+
+/**
+ * bot_frames_query_new
+ *
+ * Creates a query for the transformation from one coordinate frame to
+ * another.  The query must be destroyed before the BotFrames structure.
+ *
+ * from_frame: string of the name of the frame at the start of the transform
+ * to_frame: string of the name of the frame at the end of the transform
+ *
+ * Returns: a newly allocated BotFramesQuery, or NULL if either frame does not
+ * exist
+ */
+BotFramesQuery* bot_frames_query_new(BotFrames* bot_frames,
+                                     const char* from_frame,
+                                     const char* to_frame);
+
+/**
+ * bot_frames_query_destroy
+ *
+ * free's a BotFramesQuery allocated by bot_frames_query_new
+ */
+void bot_frames_query_destroy(BotFramesQuery* query);
+
+/**
+ * bot_frames_query_get_trans
+ *
+ * compute the latest rigid body transformation for a query.
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_frames_query_get_trans(BotFramesQuery* query, BotTrans* result);
+
+/**
+ * bot_frames_query_get_trans_with_utime
+ *
+ * compute the rigid body transformation for a query at time utime (in
+ * microseconds).
+ *
+ * Returns: 1 on success, 0 on failure
+ */
+int bot_frames_query_get_trans_with_utime(BotFramesQuery* query,
+                                          int64_t utime, BotTrans* result);
+
 /**
  * bot_frames_get_trans_latest_timestamp
  *
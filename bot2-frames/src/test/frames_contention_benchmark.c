@@ -0,0 +1,178 @@
+// -*- mode: c -*-
+// vim: set filetype=c :
+
+/*
+ * This file is part of bot2-frames.
+ *
+ * bot2-frames is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * bot2-frames is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bot2-frames. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures BotFrames query throughput with several threads querying
+// transforms while body poses stream in at 200 Hz, and how long each pose
+// update takes to be handled while the queries are running.
+//
+// Runs entirely in-process over the memq:// LCM provider.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <lcm/lcm.h>
+
+#include <bot_core/timestamp.h>
+#include <bot_core/trans.h>
+#include <bot_param/param_client.h>
+#include <lcmtypes/bot_core_rigid_transform_t.h>
+
+#include "bot_frames/bot_frames.h"
+
+#define RUN_USEC 2000000
+#define UPDATE_PERIOD_USEC 5000
+
+static const char* params_str =
+    "coordinate_frames {\n"
+    "  root_frame = \"local\";\n"
+    "  body {\n"
+    "    relative_to = \"local\";\n"
+    "    history = 1000;\n"
+    "    update_channel = \"BODY_TO_LOCAL\";\n"
+    "    initial_transform {\n"
+    "      translation = [ 0, 0, 0 ];\n"
+    "      quat = [ 1, 0, 0, 0 ];\n"
+    "    }\n"
+    "  }\n"
+    "  laser {\n"
+    "    relative_to = \"body\";\n"
+    "    history = 0;\n"
+    "    initial_transform {\n"
+    "      translation = [ 0.5, 0, 0.2 ];\n"
+    "      rpy = [ 0, 0, 0 ];\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
+
+typedef struct {
+  lcm_t* lcm;
+  BotFrames* frames;
+  volatile gint done;
+
+  int64_t num_updates;
+  int64_t update_usec_total;
+  int64_t update_usec_max;
+} state_t;
+
+typedef struct {
+  state_t* state;
+  GThread* thread;
+  int64_t num_queries;
+} reader_t;
+
+static gpointer writer_thread(gpointer user) {
+  state_t* s = (state_t*)user;
+  bot_core_rigid_transform_t msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.quat[0] = 1;
+  while (!g_atomic_int_get(&s->done)) {
+    msg.utime = bot_timestamp_now();
+    msg.trans[0] += 0.01;
+    bot_core_rigid_transform_t_publish(s->lcm, "BODY_TO_LOCAL", &msg);
+
+    int64_t start = bot_timestamp_now();
+    lcm_handle(s->lcm);
+    int64_t elapsed = bot_timestamp_now() - start;
+
+    s->num_updates++;
+    s->update_usec_total += elapsed;
+    if (elapsed > s->update_usec_max) {
+      s->update_usec_max = elapsed;
+    }
+    g_usleep(UPDATE_PERIOD_USEC);
+  }
+  return NULL;
+}
+
+static gpointer reader_thread(gpointer user) {
+  reader_t* r = (reader_t*)user;
+  BotTrans trans;
+  while (!g_atomic_int_get(&r->state->done)) {
+    // motion compensation style query, slightly behind the latest pose
+    int64_t latest;
+    if (!bot_frames_get_latest_timestamp(r->state->frames, "body", "local",
+                                         &latest)) {
+      continue;
+    }
+    bot_frames_get_trans_with_utime(r->state->frames, "laser", "local",
+                                    latest - 10000, &trans);
+    r->num_queries++;
+  }
+  return NULL;
+}
+
+static void run(state_t* s, int num_readers) {
+  s->num_updates = 0;
+  s->update_usec_total = 0;
+  s->update_usec_max = 0;
+  g_atomic_int_set(&s->done, 0);
+
+  GThread* writer = g_thread_new("writer", writer_thread, s);
+  reader_t* readers = calloc(num_readers, sizeof(reader_t));
+  for (int i = 0; i < num_readers; i++) {
+    readers[i].state = s;
+    readers[i].thread = g_thread_new("reader", reader_thread, &readers[i]);
+  }
+
+  g_usleep(RUN_USEC);
+  g_atomic_int_set(&s->done, 1);
+
+  int64_t num_queries = 0;
+  for (int i = 0; i < num_readers; i++) {
+    g_thread_join(readers[i].thread);
+    num_queries += readers[i].num_queries;
+  }
+  g_thread_join(writer);
+  free(readers);
+
+  double seconds = RUN_USEC * 1e-6;
+  printf("%7d %14.0f %14.0f %14.1f %14lld\n", num_readers,
+         num_queries / seconds, num_queries / seconds / num_readers,
+         s->num_updates ? (double)s->update_usec_total / s->num_updates : 0.0,
+         (long long)s->update_usec_max);
+}
+
+int main(int argc, char** argv) {
+  static const int num_readers[] = {1, 2, 4, 8, 12};
+
+  state_t s;
+  memset(&s, 0, sizeof(s));
+  s.lcm = lcm_create("memq://");
+  BotParam* param = bot_param_new_from_string(params_str, strlen(params_str));
+  s.frames = bot_frames_new(s.lcm, param);
+  if (!s.lcm || !param || !s.frames) {
+    fprintf(stderr, "Error: could not set up BotFrames\n");
+    return 1;
+  }
+
+  printf("%7s %14s %14s %14s %14s\n", "readers", "queries/s",
+         "per reader/s", "update (us)", "max update (us)");
+  for (int i = 0; i < sizeof(num_readers) / sizeof(num_readers[0]); i++) {
+    run(&s, num_readers[i]);
+  }
+
+  bot_frames_destroy(s.frames);
+  bot_param_destroy(param);
+  lcm_destroy(s.lcm);
+  return 0;
+}
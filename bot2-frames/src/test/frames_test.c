@@ -0,0 +1,442 @@
+// -*- mode: c -*-
+// vim: set filetype=c :
+
+/*
+ * This file is part of bot2-frames.
+ *
+ * bot2-frames is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * bot2-frames is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bot2-frames. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// frames_test.c
+//
+// Checks the BotFrames query APIs against bot_frames_get_trans_with_utime.
+// Frame updates go through an in-process LCM (memq://), so no param server
+// or network is needed.  Returns nonzero if any check fails.
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <glib.h>
+#include <lcm/eventlog.h>
+#include <lcm/lcm.h>
+
+#include <bot_core/rotations.h>
+#include <bot_core/trans.h>
+#include <bot_param/param_client.h>
+#include <lcmtypes/bot_core_planar_lidar_t.h>
+#include <lcmtypes/bot_core_rigid_transform_t.h>
+
+#include "bot_frames/bot_frames.h"
+
+// body turns about z at YAW_RATE rad/s while moving along x at SPEED m/s,
+// with an update every UPDATE_PERIOD_USEC over [START_UTIME, END_UTIME]
+#define YAW_RATE (M_PI / 2)
+#define SPEED 1.0
+#define UPDATE_PERIOD_USEC 10000
+#define START_UTIME 1000000
+#define END_UTIME 2000000
+
+// %s is the update channel of body
+static const char* frames_config_format =
+    "coordinate_frames {\n"
+    "  root_frame = \"local\";\n"
+    "  body {\n"
+    "    relative_to = \"local\";\n"
+    "    history = 1000;\n"
+    "    update_channel = \"%s\";\n"
+    "    initial_transform {\n"
+    "      translation = [ 0, 0, 0 ];\n"
+    "      quat = [ 1, 0, 0, 0 ];\n"
+    "    }\n"
+    "  }\n"
+    "  laser {\n"
+    "    relative_to = \"body\";\n"
+    "    history = 0;\n"
+    "    initial_transform {\n"
+    "      translation = [ 0.5, 0, 0.3 ];\n"
+    "      rpy = [ 0, 0, 0 ];\n"
+    "    }\n"
+    "  }\n"
+    "}\n";
+
+static BotParam* new_frames_param(const char* body_channel) {
+  char config[1024];
+  snprintf(config, sizeof(config), frames_config_format, body_channel);
+  return bot_param_new_from_string(config, strlen(config));
+}
+
+static int num_failures = 0;
+
+static void check(int ok, const char* what) {
+  if (!ok) {
+    fprintf(stderr, "FAILED: %s\n", what);
+    num_failures++;
+  }
+}
+
+static int trans_equal(const BotTrans* a, const BotTrans* b, double tol) {
+  for (int i = 0; i < 3; i++) {
+    if (fabs(a->trans_vec[i] - b->trans_vec[i]) > tol) {
+      return 0;
+    }
+  }
+  for (int i = 0; i < 4; i++) {
+    if (fabs(a->rot_quat[i] - b->rot_quat[i]) > tol) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void body_to_local(int64_t utime, bot_core_rigid_transform_t* msg) {
+  double t = (utime - START_UTIME) * 1e-6;
+  double rpy[3] = {0, 0, YAW_RATE * t};
+  msg->utime = utime;
+  msg->trans[0] = SPEED * t;
+  msg->trans[1] = 0;
+  msg->trans[2] = 0;
+  bot_roll_pitch_yaw_to_quat(rpy, msg->quat);
+}
+
+// Publishes the body motion and handles each message, so that the link
+// history is complete when this returns.
+static void publish_body_motion(lcm_t* lcm) {
+  for (int64_t utime = START_UTIME; utime <= END_UTIME;
+       utime += UPDATE_PERIOD_USEC) {
+    bot_core_rigid_transform_t msg;
+    body_to_local(utime, &msg);
+    bot_core_rigid_transform_t_publish(lcm, "BODY_TO_LOCAL", &msg);
+    lcm_handle(lcm);
+  }
+}
+
+static void write_body_motion_log(const char* log_filename) {
+  lcm_eventlog_t* log = lcm_eventlog_create(log_filename, "w");
+  uint8_t buf[256];
+  for (int64_t utime = START_UTIME; utime <= END_UTIME;
+       utime += UPDATE_PERIOD_USEC) {
+    bot_core_rigid_transform_t msg;
+    body_to_local(utime, &msg);
+    lcm_eventlog_event_t event;
+    memset(&event, 0, sizeof(event));
+    event.timestamp = utime;
+    event.channel = (char*)"BODY_TO_LOCAL";
+    event.channellen = strlen(event.channel);
+    event.data = buf;
+    event.datalen =
+        bot_core_rigid_transform_t_encode(buf, 0, sizeof(buf), &msg);
+    lcm_eventlog_write_event(log, &event);
+  }
+  lcm_eventlog_destroy(log);
+}
+
+// Checks that laser->local in frames matches the online frames over the log.
+static int frames_match(BotFrames* frames, BotFrames* expected_frames) {
+  for (int64_t utime = START_UTIME; utime <= END_UTIME; utime += 777) {
+    BotTrans trans;
+    BotTrans expected;
+    if (!bot_frames_get_trans_with_utime(frames, "laser", "local", utime,
+                                         &trans) ||
+        !bot_frames_get_trans_with_utime(expected_frames, "laser", "local",
+                                         utime, &expected) ||
+        !trans_equal(&trans, &expected, 1e-12)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// bot_frames_get_trans_batch gives the same results as single queries,
+// including for repeated times and frames, and flags failed entries.
+static void test_trans_batch(BotFrames* frames) {
+  enum { N = 8 };
+  const char* from_frames[N] = {"laser", "laser", "body",  "laser",
+                                "local", "laser", "nosuch", "body"};
+  const char* to_frames[N] = {"local", "local", "local", "body",
+                              "laser", "local", "local",  "local"};
+  int64_t utimes[N] = {1234567, 1234567, 1234567, 1500000,
+                       1234567, 1999999, 1500000, 1005000};
+  BotTrans results[N];
+  int status[N];
+  int num_ok = bot_frames_get_trans_batch(frames, N, from_frames, to_frames,
+                                          utimes, results, status);
+  check(num_ok == N - 1, "batch: all but the unknown frame are computed");
+  for (int i = 0; i < N; i++) {
+    BotTrans expected;
+    int ok = bot_frames_get_trans_with_utime(frames, from_frames[i],
+                                             to_frames[i], utimes[i],
+                                             &expected);
+    check(status[i] == ok, "batch: status matches single query");
+    if (ok && status[i]) {
+      check(trans_equal(&results[i], &expected, 1e-12),
+            "batch: result matches single query");
+    }
+  }
+}
+
+// bot_frames_deskew_planar_lidar stays within the error bound documented in
+// bot_frames.h of projecting each beam with its own transformation.
+static void test_deskew_planar_lidar(BotFrames* frames) {
+  enum { NUM_BEAMS = 1081 };
+  // 25 usec per beam, so that the beam times are whole microseconds
+  const int64_t utime_start = 1400000;
+  const int64_t utime_end = utime_start + 25 * (NUM_BEAMS - 1);
+  const double range = 30;
+  float ranges[NUM_BEAMS];
+  for (int i = 0; i < NUM_BEAMS; i++) {
+    ranges[i] = range;
+  }
+  bot_core_planar_lidar_t scan;
+  memset(&scan, 0, sizeof(scan));
+  scan.utime = utime_start;
+  scan.nranges = NUM_BEAMS;
+  scan.ranges = ranges;
+  scan.rad0 = -3 * M_PI / 4;
+  scan.radstep = 1.5 * M_PI / (NUM_BEAMS - 1);
+
+  static double points[3 * NUM_BEAMS];
+  check(bot_frames_deskew_planar_lidar(frames, &scan, "laser", "local",
+                                       utime_start, utime_end, points),
+        "deskew: succeeds within the history");
+
+  // the body turns by theta between two of the 8 knots, and beams are at
+  // most range + |laser offset| from the rotation axis
+  double theta = YAW_RATE * (utime_end - utime_start) * 1e-6 / 8;
+  double offset = sqrt(0.5 * 0.5 + 0.3 * 0.3);
+  double bound = (range + offset) * theta * theta / 8 + 1e-9;
+
+  double max_error = 0;
+  for (int i = 0; i < NUM_BEAMS; i++) {
+    int64_t utime = utime_start + 25 * i;
+    double angle = scan.rad0 + i * (double)scan.radstep;
+    double beam[3] = {ranges[i] * cos(angle), ranges[i] * sin(angle), 0};
+    BotTrans trans;
+    bot_frames_get_trans_with_utime(frames, "laser", "local", utime, &trans);
+    double expected[3];
+    bot_trans_apply_vec(&trans, beam, expected);
+    double error = sqrt(pow(points[3 * i] - expected[0], 2) +
+                        pow(points[3 * i + 1] - expected[1], 2) +
+                        pow(points[3 * i + 2] - expected[2], 2));
+    max_error = fmax(max_error, error);
+  }
+  check(max_error <= bound, "deskew: points within the documented bound");
+
+  // without deskewing, the last beam would be off by far more than that
+  BotTrans start_trans;
+  bot_frames_get_trans_with_utime(frames, "laser", "local", utime_start,
+                                  &start_trans);
+  double angle = scan.rad0 + (NUM_BEAMS - 1) * (double)scan.radstep;
+  double beam[3] = {range * cos(angle), range * sin(angle), 0};
+  double skewed[3];
+  bot_trans_apply_vec(&start_trans, beam, skewed);
+  const double* last = points + 3 * (NUM_BEAMS - 1);
+  check(fabs(skewed[0] - last[0]) + fabs(skewed[1] - last[1]) > 100 * bound,
+        "deskew: compensates for the motion over the sweep");
+}
+
+// bot_frames_new_from_log gives the same transformations as receiving the
+// log online, uses a valid sidecar instead of the log, and ignores a sidecar
+// written for a different frames config.
+static void test_new_from_log(BotFrames* online_frames, BotParam* param) {
+  char log_filename[] = "/tmp/frames_test_XXXXXX";
+  int fd = mkstemp(log_filename);
+  if (fd < 0) {
+    check(0, "log: could not create a temporary log");
+    return;
+  }
+  close(fd);
+  char sidecar_filename[sizeof(log_filename) + 8];
+  snprintf(sidecar_filename, sizeof(sidecar_filename), "%s.frames",
+           log_filename);
+  write_body_motion_log(log_filename);
+
+  BotFrames* frames =
+      bot_frames_new_from_log(log_filename, param, sidecar_filename);
+  check(frames && frames_match(frames, online_frames),
+        "log: matches the online frames");
+  if (frames) {
+    bot_frames_destroy(frames);
+  }
+
+  // blank the log, keeping its size and mtime, so that only the sidecar
+  // still holds the transformations
+  struct stat log_stat;
+  stat(log_filename, &log_stat);
+  FILE* f = fopen(log_filename, "r+b");
+  for (off_t i = 0; i < log_stat.st_size; i++) {
+    fputc(0, f);
+  }
+  fclose(f);
+  struct utimbuf times = {log_stat.st_atime, log_stat.st_mtime};
+  utime(log_filename, &times);
+
+  frames = bot_frames_new_from_log(log_filename, param, sidecar_filename);
+  check(frames && frames_match(frames, online_frames),
+        "log: the sidecar is used for the same log and config");
+  if (frames) {
+    bot_frames_destroy(frames);
+  }
+
+  // with body updated from another channel, the sidecar is stale: the blank
+  // log is read instead, leaving body at its initial transform
+  BotParam* other_param = new_frames_param("BODY_POSE");
+  frames = bot_frames_new_from_log(log_filename, other_param, sidecar_filename);
+  BotTrans trans;
+  check(frames &&
+            bot_frames_get_trans_with_utime(frames, "body", "local", 1500000,
+                                            &trans) &&
+            fabs(trans.trans_vec[0]) < 1e-12,
+        "log: a sidecar for another frames config is ignored");
+  if (frames) {
+    bot_frames_destroy(frames);
+  }
+  bot_param_destroy(other_param);
+
+  remove(sidecar_filename);
+  remove(log_filename);
+}
+
+typedef struct {
+  GMutex mutex;
+  int num_calls;
+  int64_t last_utime;
+  int in_order;
+  GThread* thread;
+} update_record_t;
+
+static void record_update(BotFrames* bot_frames, const char* frame,
+                          const char* relative_to, int64_t utime, void* user) {
+  update_record_t* record = (update_record_t*)user;
+  g_mutex_lock(&record->mutex);
+  record->num_calls++;
+  record->in_order = record->in_order && utime > record->last_utime;
+  record->last_utime = utime;
+  record->thread = g_thread_self();
+  g_mutex_unlock(&record->mutex);
+}
+
+static void publish_body_updates(lcm_t* lcm, int64_t first_utime, int n) {
+  for (int i = 0; i < n; i++) {
+    bot_core_rigid_transform_t msg;
+    body_to_local(first_utime + i * UPDATE_PERIOD_USEC, &msg);
+    bot_core_rigid_transform_t_publish(lcm, "BODY_TO_LOCAL", &msg);
+    lcm_handle(lcm);
+  }
+}
+
+// Update callbacks are delivered for every update in SYNC mode, and coalesced
+// to the latest update of each link in the MAIN_LOOP and THREAD modes.
+static void test_update_dispatch(lcm_t* lcm, BotParam* param) {
+  BotFrames* frames = bot_frames_new(lcm, param);
+  update_record_t record;
+  memset(&record, 0, sizeof(record));
+  g_mutex_init(&record.mutex);
+  record.in_order = 1;
+  bot_frames_add_update_subscriber(frames, record_update, &record);
+  BotFramesDispatchStats stats;
+
+  int64_t utime = END_UTIME + UPDATE_PERIOD_USEC;
+  publish_body_updates(lcm, utime, 10);
+  utime += 10 * UPDATE_PERIOD_USEC;
+  bot_frames_get_dispatch_stats(frames, &stats);
+  check(record.num_calls == 10 && record.in_order &&
+            record.last_utime == utime - UPDATE_PERIOD_USEC &&
+            record.thread == g_thread_self(),
+        "dispatch: SYNC delivers every update from the LCM handler");
+  check(stats.num_received == 10 && stats.num_dispatched == 10,
+        "dispatch: SYNC counts every update as dispatched");
+
+  // nothing is delivered until the main loop runs, then the latest update
+  // only; an update older than the pending one is dropped
+  bot_frames_set_update_dispatch(frames, BOT_FRAMES_DISPATCH_MAIN_LOOP, 0);
+  record.num_calls = 0;
+  publish_body_updates(lcm, utime, 10);
+  utime += 10 * UPDATE_PERIOD_USEC;
+  publish_body_updates(lcm, utime - 5 * UPDATE_PERIOD_USEC, 1);
+  check(record.num_calls == 0,
+        "dispatch: MAIN_LOOP does not deliver from the LCM handler");
+  while (g_main_context_iteration(NULL, FALSE)) {
+  }
+  bot_frames_get_dispatch_stats(frames, &stats);
+  check(record.num_calls == 1 &&
+            record.last_utime == utime - UPDATE_PERIOD_USEC,
+        "dispatch: MAIN_LOOP coalesces to the latest update");
+  check(stats.num_received == 21 && stats.num_dispatched == 11 &&
+            stats.num_coalesced == 9 && stats.num_dropped == 1,
+        "dispatch: MAIN_LOOP counts coalesced and dropped updates");
+
+  // at 5 Hz, a burst of updates is delivered in a few notifications from
+  // the dispatch thread, ending with the latest update
+  bot_frames_set_update_dispatch(frames, BOT_FRAMES_DISPATCH_THREAD, 5);
+  g_mutex_lock(&record.mutex);
+  record.num_calls = 0;
+  g_mutex_unlock(&record.mutex);
+  publish_body_updates(lcm, utime, 20);
+  utime += 20 * UPDATE_PERIOD_USEC;
+  int64_t end_time = g_get_monotonic_time() + 2000000;
+  int delivered = 0;
+  while (!delivered && g_get_monotonic_time() < end_time) {
+    g_usleep(10000);
+    g_mutex_lock(&record.mutex);
+    delivered = record.last_utime == utime - UPDATE_PERIOD_USEC;
+    g_mutex_unlock(&record.mutex);
+  }
+  bot_frames_get_dispatch_stats(frames, &stats);
+  g_mutex_lock(&record.mutex);
+  check(delivered && record.num_calls < 20 &&
+            record.thread != g_thread_self(),
+        "dispatch: THREAD coalesces a burst and delivers the latest update");
+  check(stats.num_received == 41 &&
+            stats.num_dispatched == 11 + record.num_calls &&
+            stats.num_dispatched + stats.num_coalesced + stats.num_dropped ==
+                stats.num_received,
+        "dispatch: THREAD accounts for every update");
+  g_mutex_unlock(&record.mutex);
+
+  bot_frames_destroy(frames);
+  g_mutex_clear(&record.mutex);
+}
+
+int main(int argc, char** argv) {
+  lcm_t* lcm = lcm_create("memq://");
+  BotParam* param = new_frames_param("BODY_TO_LOCAL");
+  if (!lcm || !param) {
+    fprintf(stderr, "could not create LCM or BotParam\n");
+    return 1;
+  }
+  BotFrames* frames = bot_frames_new(lcm, param);
+  publish_body_motion(lcm);
+
+  test_trans_batch(frames);
+  test_deskew_planar_lidar(frames);
+  test_new_from_log(frames, param);
+  test_update_dispatch(lcm, param);
+
+  bot_frames_destroy(frames);
+  bot_param_destroy(param);
+  lcm_destroy(lcm);
+
+  if (num_failures) {
+    fprintf(stderr, "%d checks failed\n", num_failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+  return 0;
+}
@@ -25,14 +25,18 @@
 #include <getopt.h>
 #include <math.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <list>
+#include <vector>
 
 #include <lcm/lcm.h>
 
@@ -67,11 +71,290 @@ static int _fileutils_write_fully(int fd, const void* b, int len) {
   return cnt;
 }
 
+// Messages sent over TCP are gathered into writev() calls of at most this many
+// messages and about this many bytes.  Each message takes 2 pieces, its header
+// (channel length, channel and data length) and its data, so that a full
+// batch stays within IOV_MAX.  The age of the messages left is checked again
+// after each call.
+#define TCP_MAX_BATCH_MSGS 512
+#define TCP_MAX_BATCH_BYTES (1 << 20)
+
+// Large enough for the encoded lcm_tunnel_udp_msg_t without its data.
+#define UDP_HEADER_MAX_SIZE 64
+
+// Large enough for any fragment a tunnel sends.
+#define UDP_DATAGRAM_MAX_SIZE \
+  (UDP_HEADER_MAX_SIZE + MAX_PAYLOAD_BYTES_PER_FRAGMENT)
+
+// UDP datagrams are sent and received this many at a time, with one
+// sendmmsg() or recvmmsg() call where the platform has them.
+#define UDP_BATCH_SIZE 64
+
+// on_udp_data returns to the main loop after this many datagrams even if more
+// are waiting, so that the other sources get a turn.
+#define UDP_MAX_DATAGRAMS_PER_WAKEUP 1024
+
+#ifdef __linux__
+typedef struct mmsghdr udp_mmsghdr_t;
+#else
+// Without sendmmsg() and recvmmsg(), a batch is sent and received one
+// datagram at a time.
+typedef struct {
+  struct msghdr msg_hdr;
+  unsigned int msg_len;
+} udp_mmsghdr_t;
+#endif
+
+// Buffers for receiving a batch of datagrams.
+struct udp_recv_batch_t {
+  udp_mmsghdr_t msgs[UDP_BATCH_SIZE];
+  struct iovec iov[UDP_BATCH_SIZE];
+  uint8_t bufs[UDP_BATCH_SIZE][UDP_DATAGRAM_MAX_SIZE];
+};
+
+// Size of the fields of an lcm_tunnel_udp_msg_t that precede its data.
+static int udp_header_size() {
+  lcm_tunnel_udp_msg_t header;
+  memset(&header, 0, sizeof(header));
+  int header_size = lcm_tunnel_udp_msg_t_encoded_size(&header);
+  assert(header_size <= UDP_HEADER_MAX_SIZE);
+  return header_size;
+}
+
+// Encodes the fields of an lcm_tunnel_udp_msg_t that precede its data, and
+// returns their size.
+static int encode_udp_header(uint8_t* buf, int16_t seqno, int16_t fragno,
+                             int32_t payload_size, int32_t data_size) {
+  lcm_tunnel_udp_msg_t header;
+  header.seqno = seqno;
+  header.fragno = fragno;
+  header.payload_size = payload_size;
+  header.data_size = 0;
+  header.data = NULL;
+  int header_size = udp_header_size();
+  lcm_tunnel_udp_msg_t_encode(buf, 0, header_size, &header);
+  // data_size is the last field before the data
+  __int32_t_encode_array(buf, header_size - 4, 4, &data_size, 1);
+  return header_size;
+}
+
+// Decodes the lcm_tunnel_udp_msg_t in buf, leaving its data in buf instead of
+// copying it out, so msg needs no cleanup.  Returns the number of bytes
+// decoded, or -1 if buf doesn't hold one.
+static int decode_udp_header(uint8_t* buf, int size,
+                             lcm_tunnel_udp_msg_t* msg) {
+  int header_size = udp_header_size();
+  if (size < header_size) {
+    return -1;
+  }
+  int32_t data_size;
+  __int32_t_decode_array(buf, header_size - 4, 4, &data_size, 1);
+  if (data_size < 0 || data_size > size - header_size) {
+    return -1;
+  }
+  // decode the fields from a copy that claims no data
+  uint8_t header[UDP_HEADER_MAX_SIZE];
+  memcpy(header, buf, header_size);
+  int32_t no_data = 0;
+  __int32_t_encode_array(header, header_size - 4, 4, &no_data, 1);
+  if (lcm_tunnel_udp_msg_t_decode(header, 0, header_size, msg) < 0) {
+    return -1;
+  }
+  msg->data_size = data_size;
+  msg->data = buf + header_size;
+  return header_size + data_size;
+}
+
+// Writes all of iov, and returns false on error.  iov is modified.
+static bool _writev_fully(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t cnt = writev(fd, iov, iovcnt);
+    if (cnt < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("writev");
+      return false;
+    }
+    // skip what has been written
+    while (iovcnt > 0 && (size_t)cnt >= iov->iov_len) {
+      cnt -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if (iovcnt > 0) {
+      iov->iov_base = (char*)iov->iov_base + cnt;
+      iov->iov_len -= cnt;
+    }
+  }
+  return true;
+}
+
+// With TCP_CORK set, partial segments are held back until it is cleared, so
+// that a batch of small messages leaves in full segments.  Not every platform
+// supports it.
+static void set_tcp_cork(int fd, int cork) {
+#ifdef TCP_CORK
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &cork, sizeof(cork));
+#endif
+}
+
+static inline struct iovec make_iovec(void* base, size_t len) {
+  struct iovec iov;
+  iov.iov_base = base;
+  iov.iov_len = len;
+  return iov;
+}
+
+static inline udp_mmsghdr_t make_mmsghdr(struct iovec* iov, size_t iovlen) {
+  udp_mmsghdr_t mmsg;
+  memset(&mmsg, 0, sizeof(mmsg));
+  mmsg.msg_hdr.msg_iov = iov;
+  mmsg.msg_hdr.msg_iovlen = iovlen;
+  return mmsg;
+}
+
+// Sends datagrams from msgs[*sent] on with one call, and returns the status
+// for checkUDPSendStatus().  A datagram that fails is skipped, so that the
+// rest of the batch still goes out, as when each was sent on its own.
+static int _send_udp_batch(int fd, udp_mmsghdr_t* msgs, int nmsgs, int* sent) {
+  int status;
+  do {
+#ifdef __linux__
+    status = sendmmsg(fd, msgs + *sent, nmsgs - *sent, 0);
+#else
+    status = sendmsg(fd, &msgs[*sent].msg_hdr, 0) < 0 ? -1 : 1;
+#endif
+  } while (status < 0 && errno == EINTR);
+  *sent += status < 0 ? 1 : status;
+  return status;
+}
+
+// Receives up to nmsgs waiting datagrams without blocking, and returns how
+// many, or -1 with errno set if there were none.
+static int _recv_udp_batch(int fd, udp_mmsghdr_t* msgs, int nmsgs) {
+#ifdef __linux__
+  return recvmmsg(fd, msgs, nmsgs, MSG_DONTWAIT, NULL);
+#else
+  int n = 0;
+  for (; n < nmsgs; n++) {
+    ssize_t len = recvmsg(fd, &msgs[n].msg_hdr, MSG_DONTWAIT);
+    if (len < 0) {
+      break;
+    }
+    msgs[n].msg_len = len;
+  }
+  return n > 0 ? n : -1;
+#endif
+}
+
+// With QoS classes, the send thread takes messages about this many bytes at a
+// time, so that messages of a higher priority that arrive meanwhile don't wait
+// for long.
+#define SEND_MAX_BATCH_BYTES (1 << 16)
+
+// messages smaller than this are sent uncompressed
+#define COMPRESS_MIN_BYTES 128
+// a channel whose messages shrink by less than this on average is sent
+// uncompressed, trying again after COMPRESS_RETRY_INTERVAL messages, and twice
+// as many each time that fails, up to COMPRESS_MAX_RETRY_INTERVAL
+#define COMPRESS_MIN_RATIO 1.1
+#define COMPRESS_RETRY_INTERVAL 100
+#define COMPRESS_MAX_RETRY_INTERVAL 3200
+// set in the data size of a TCP frame whose data is compressed
+#define TCP_COMPRESSED_FLAG 0x80000000u
+
+TunnelQosQueue::TunnelQosQueue(const lcm_tunnel_qos_class_t* qos, int64_t now)
+    : regex(NULL),
+      priority(qos->priority),
+      rate_limit(qos->rate_limit),
+      burst_size(qos->burst_size > 0 ? qos->burst_size : qos->rate_limit),
+      max_latency_us((int64_t)qos->max_latency_ms * 1000),
+      conflate(qos->conflate),
+      tokens(burst_size),
+      last_refill(now),
+      bytes(0),
+      dropped(0) {
+  if (qos->channels != NULL) {
+    char* rchannel = g_strdup_printf("^%s$", qos->channels);
+    GError* rerr = NULL;
+    regex = g_regex_new(rchannel, (GRegexCompileFlags)0, (GRegexMatchFlags)0,
+                        &rerr);
+    if (rerr != NULL) {
+      fprintf(stderr, "Invalid regex: \"%s\"\n", rchannel);
+      g_error_free(rerr);
+    }
+    g_free(rchannel);
+  }
+}
+
+TunnelQosQueue::~TunnelQosQueue() {
+  while (!queue.empty()) {
+    queue.front()->unref();
+    queue.pop_front();
+  }
+  if (regex != NULL) {
+    g_regex_unref(regex);
+  }
+}
+
+bool TunnelQosQueue::matches(const char* channel) {
+  return regex != NULL &&
+      g_regex_match(regex, channel, (GRegexMatchFlags)0, NULL);
+}
+
+void TunnelQosQueue::refill(int64_t now) {
+  if (rate_limit > 0 && now > last_refill) {
+    tokens = MIN(burst_size, tokens + rate_limit * (now - last_refill) * 1e-6);
+  }
+  last_refill = now;
+}
+
+int64_t TunnelQosQueue::nextSendableTime(int64_t now) {
+  if (canSend()) {
+    return now;
+  }
+  return now + (int64_t)ceil(-tokens * 1e6 / rate_limit) + 1;
+}
+
+uint32_t TunnelQosQueue::dropOldest() {
+  TunnelLcmMessage* drop_msg = queue.front();
+  queue.pop_front();
+  uint32_t size = drop_msg->encoded_size;
+  bytes -= size;
+  dropped++;
+  drop_msg->unref();
+  return size;
+}
+
+TunnelLcmMessage* TunnelQosQueue::remove(const char* channel) {
+  // there is at most one message per channel, so this is short
+  for (size_t i = queue.size(); i > 0; i--) {
+    TunnelLcmMessage* old_msg = queue[i - 1];
+    if (strcmp(old_msg->channel, channel) == 0) {
+      queue.erase(queue.begin() + (i - 1));
+      bytes -= old_msg->encoded_size;
+      return old_msg;
+    }
+  }
+  return NULL;
+}
+
+static bool higherPriority(const TunnelQosQueue* a, const TunnelQosQueue* b) {
+  return a->priority > b->priority;
+}
+
 LcmTunnel::LcmTunnel(bool verbose, const char* lcm_channel)
     : verbose(verbose),
       regex(NULL),
       stopSendThread(false),
       bytesInQueue(0),
+      qosChannels(NULL),
+      deflate_stream(NULL),
+      compressStats(NULL),
+      inflate_stream(NULL),
+      inflate_buf(NULL),
+      inflate_buf_sz(0),
       channel((char*)calloc(65536, sizeof(char))),
       channel_sz(65536),
       buf((char*)calloc(65536, sizeof(char))),
@@ -79,6 +362,7 @@ LcmTunnel::LcmTunnel(bool verbose, const char* lcm_channel)
       udp_fd(-1),
       server_udp_port(-1),
       udp_send_seqno(0),
+      udp_recv_batch(NULL),
       recFlags((char*)calloc(1024, sizeof(char))),
       recFlags_sz(1024),
       cur_seqno(0),
@@ -139,12 +423,23 @@ LcmTunnel::~LcmTunnel() {
   g_thread_join(sendThread);  // wait for thread to exit
 
   g_mutex_lock(sendQueueLock);
-  while (!sendQueue.empty()) {
-    delete sendQueue.front();
-    sendQueue.pop_front();
-  }
+  clearQos();
   g_mutex_unlock(sendQueueLock);
 
+  if (compressStats != NULL) {
+    printCompressStats();
+    g_hash_table_destroy(compressStats);
+  }
+  if (deflate_stream != NULL) {
+    deflateEnd(deflate_stream);
+    g_free(deflate_stream);
+  }
+  if (inflate_stream != NULL) {
+    inflateEnd(inflate_stream);
+    g_free(inflate_stream);
+  }
+  free(inflate_buf);
+
   g_mutex_clear(sendQueueLock);
   g_free(sendQueueLock);
   g_cond_clear(sendQueueCond);
@@ -175,6 +470,7 @@ LcmTunnel::~LcmTunnel() {
   free(buf);
   free(channel);
   free(recFlags);
+  delete udp_recv_batch;
   free(tunnel_params);
 
   delete ldpc_dec;
@@ -220,6 +516,7 @@ int LcmTunnel::connectToClient(
 
   bytes_to_read = 4;
   bytes_read = 0;
+  buf_offset = 0;
   tunnel_state = CLIENT_MSG_SZ;  // we're waiting for the client connect message
 
   return 1;
@@ -238,6 +535,7 @@ int LcmTunnel::connectToServer(
   lcm = lcm_;
   introspect = introspect_;
   mainloop = mainloop_;
+  initQos();
 
   if (tunnel_params->udp) {
     // allocate UDP socket
@@ -316,6 +614,7 @@ int LcmTunnel::connectToServer(
   // set state for tcp receptions
   bytes_to_read = 4;
   bytes_read = 0;
+  buf_offset = 0;
   if (tunnel_params->udp) {
     tunnel_state = SERVER_MSG_SZ;  // wait for udp port from server
   } else {
@@ -332,64 +631,157 @@ int LcmTunnel::connectToServer(
 void LcmTunnel::publishLcmMessagesInBuf(int numBytes) {
   int msgOffset = 0;
   while (msgOffset < numBytes) {
-    // decode
+    // decode, as a compressed message if it isn't a plain one
     lcm_tunnel_sub_msg_t p;
-    msgOffset +=
+    int decoded =
         lcm_tunnel_sub_msg_t_decode(buf, msgOffset, numBytes - msgOffset, &p);
-    // and publish
-    LcmTunnelServer::check_and_send_to_tunnels(p.channel, p.data, p.data_size,
-                                               this);
-    lcm_publish(lcm, p.channel, p.data, p.data_size);
-    if (verbose) {
-      printf("publishing [%s] (%.3fKb)\n", p.channel, p.data_size * 1e-3);
+    if (decoded >= 0) {
+      // and publish
+      publishLcmMessage(p.channel, p.data, p.data_size, false);
+      if (verbose) {
+        printf("publishing [%s] (%.3fKb)\n", p.channel, p.data_size * 1e-3);
+      }
+      check_ret(lcm_tunnel_sub_msg_t_decode_cleanup(&p));
+    } else {
+      lcm_tunnel_compressed_msg_t z;
+      decoded = lcm_tunnel_compressed_msg_t_decode(buf, msgOffset,
+                                                   numBytes - msgOffset, &z);
+      if (decoded < 0) {
+        fprintf(stderr, "Received corrupted message\n");
+        return;
+      }
+      publishLcmMessage(z.channel, z.data, z.data_size, true);
+      if (verbose) {
+        printf("publishing [%s] (%.3fKb compressed)\n", z.channel,
+               z.data_size * 1e-3);
+      }
+      check_ret(lcm_tunnel_compressed_msg_t_decode_cleanup(&z));
     }
-
-    check_ret(lcm_tunnel_sub_msg_t_decode_cleanup(&p));
+    msgOffset += decoded;
   }
   assert(msgOffset == numBytes);
 }
 
+// Publishes a message from the remote end, and forwards it to the other
+// tunnels that want it.
+void LcmTunnel::publishLcmMessage(const char* lcm_channel, const uint8_t* data,
+                                  int data_size, bool compressed) {
+  if (compressed) {
+    data_size = inflateData(data, data_size);
+    if (data_size < 0) {
+      fprintf(stderr, "Could not decompress message on \"%s\", dropping it\n",
+              lcm_channel);
+      return;
+    }
+    data = inflate_buf;
+  }
+  LcmTunnelServer::check_and_send_to_tunnels(lcm_channel, data, data_size,
+                                             this);
+  lcm_publish(lcm, lcm_channel, data, data_size);
+}
+
+// Decompresses data_size bytes of zlib stream into inflate_buf, and returns
+// the decompressed size, or -1 if the stream is corrupt or incomplete.
+int LcmTunnel::inflateData(const uint8_t* data, int data_size) {
+  if (inflate_stream == NULL) {
+    inflate_stream = g_new0(z_stream, 1);
+    if (inflateInit(inflate_stream) != Z_OK) {
+      g_free(inflate_stream);
+      inflate_stream = NULL;
+      return -1;
+    }
+  } else {
+    inflateReset(inflate_stream);
+  }
+  inflate_stream->next_in = (Bytef*)data;
+  inflate_stream->avail_in = data_size;
+  int size = 0;
+  int status = Z_OK;
+  while (status == Z_OK) {
+    if (size == inflate_buf_sz) {
+      inflate_buf_sz = MAX(2 * inflate_buf_sz, 65536);
+      inflate_buf = (uint8_t*)realloc(inflate_buf, inflate_buf_sz);
+    }
+    inflate_stream->next_out = inflate_buf + size;
+    inflate_stream->avail_out = inflate_buf_sz - size;
+    status = inflate(inflate_stream, Z_NO_FLUSH);
+    size = inflate_buf_sz - inflate_stream->avail_out;
+  }
+  return status == Z_STREAM_END ? size : -1;
+}
+
 int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
                            void* user_data) {
   LcmTunnel* self = (LcmTunnel*)user_data;
 
-  uint8_t recv_buffer[65535];
+  udp_recv_batch_t* batch = self->udp_recv_batch;
+  if (batch == NULL) {
+    batch = self->udp_recv_batch = new udp_recv_batch_t;
+    for (int i = 0; i < UDP_BATCH_SIZE; i++) {
+      batch->iov[i] = make_iovec(batch->bufs[i], UDP_DATAGRAM_MAX_SIZE);
+      batch->msgs[i] = make_mmsghdr(&batch->iov[i], 1);
+    }
+  }
 
-  int recv_status = recv(self->udp_fd, recv_buffer, 65535, 0);
+  // handle everything that has arrived, a batch at a time, instead of a single
+  // datagram per wakeup
+  int ndatagrams = 0;
+  while (ndatagrams < UDP_MAX_DATAGRAMS_PER_WAKEUP) {
+    int recv_status = _recv_udp_batch(self->udp_fd, batch->msgs,
+                                      UDP_BATCH_SIZE);
+    if (recv_status < 0) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        perror("recv error: ");
+      }
+      break;
+    }
 
-  if (recv_status < 0) {
-    perror("recv error: ");
-    return TRUE;
+    // self may be gone once a datagram returns FALSE
+    for (int i = 0; i < recv_status; i++) {
+      if (batch->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+        fprintf(stderr, "Received Corrupted UDP packet!\n");
+      } else if (!on_udp_datagram(self, batch->bufs[i],
+                                  batch->msgs[i].msg_len)) {
+        return FALSE;
+      }
+    }
+    ndatagrams += recv_status;
+    if (recv_status < UDP_BATCH_SIZE) {
+      break;
+    }
   }
+  return TRUE;
+}
 
-  lcm_tunnel_udp_msg_t* recv_udp_msg =
-      (lcm_tunnel_udp_msg_t*)calloc(1, sizeof(lcm_tunnel_udp_msg_t));
-  int decode_ret =
-      lcm_tunnel_udp_msg_t_decode(recv_buffer, 0, recv_status, recv_udp_msg);
+int LcmTunnel::on_udp_datagram(LcmTunnel* self, uint8_t* datagram,
+                               int datagram_size) {
+  lcm_tunnel_udp_msg_t recv_udp_msg;
+  int decode_ret = decode_udp_header(datagram, datagram_size, &recv_udp_msg);
   if (decode_ret < 0) {
     lcm_tunnel_disconnect_msg_t disc_msg;
-    decode_ret = lcm_tunnel_disconnect_msg_t_decode(recv_buffer, 0, recv_status,
+    decode_ret = lcm_tunnel_disconnect_msg_t_decode(datagram, 0, datagram_size,
                                                     &disc_msg);
     if (decode_ret >= 0) {
       fprintf(stderr, "Received a disconnect message... disconnecting!\n");
       LcmTunnelServer::disconnectClient(self);
-    } else {
-      fprintf(stderr, "Received Corrupted UDP packet!\n");
+      return FALSE;
     }
+    fprintf(stderr, "Received Corrupted UDP packet!\n");
+    return TRUE;
   }
 
-  if (self->verbose && recv_udp_msg->seqno < self->cur_seqno) {
+  if (self->verbose && recv_udp_msg.seqno < self->cur_seqno) {
     printf("Got Out of order packet!\n");
   }
 
   // start of a new message?
-  if (recv_udp_msg->seqno > self->cur_seqno ||
-      recv_udp_msg->seqno < (int32_t)self->cur_seqno -
+  if (recv_udp_msg.seqno > self->cur_seqno ||
+      recv_udp_msg.seqno < (int32_t)self->cur_seqno -
               SEQNO_WRAP_GAP) {  // handle wrap-around with second part
     if ((!self->message_complete && self->cur_seqno > 0) ||
-        recv_udp_msg->seqno > (self->cur_seqno + 1)) {
+        recv_udp_msg.seqno > (self->cur_seqno + 1)) {
       printf("packets %d to %d dropped! with %d of %d fragments received, ",
-             self->cur_seqno, recv_udp_msg->seqno - 1, self->numFragsRec,
+             self->cur_seqno, recv_udp_msg.seqno - 1, self->numFragsRec,
              self->nfrags);
       if (self->tunnel_params->fec > 1 &&
           self->nfrags >= MIN_NUM_FRAGMENTS_FOR_FEC) {
@@ -398,8 +790,8 @@ int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
         printf("not FECed\n");
       }
     }
-    self->cur_seqno = recv_udp_msg->seqno;
-    self->nfrags = getNumFragments(recv_udp_msg->payload_size);
+    self->cur_seqno = recv_udp_msg.seqno;
+    self->nfrags = getNumFragments(recv_udp_msg.payload_size);
     self->numFragsRec = 0;
     // increase the recFlags buffers
     if (self->recFlags_sz < self->nfrags) {
@@ -411,7 +803,7 @@ int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
     self->completeTo_fragno = 0;
     self->fragment_buf_offset = 0;
 
-    int messageSize = recv_udp_msg->payload_size;
+    int messageSize = recv_udp_msg.payload_size;
     // increase buffer size if needed, also make enough space for the channel in
     // case we're using FEC
     if (self->buf_sz < messageSize) {
@@ -434,26 +826,26 @@ int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
     self->message_complete = 0;
   }
 
-  if (!self->message_complete && recv_udp_msg->seqno == self->cur_seqno &&
-      getNumFragments(recv_udp_msg->payload_size) == self->nfrags) {
+  if (!self->message_complete && recv_udp_msg.seqno == self->cur_seqno &&
+      getNumFragments(recv_udp_msg.payload_size) == self->nfrags) {
     self->numFragsRec++;
     if (self->tunnel_params->fec < 1 ||
         self->nfrags < MIN_NUM_FRAGMENTS_FOR_FEC) {  // we're not using FEC for
                                                      // this message
       // have we already received this fragment?
-      if (recv_udp_msg->fragno < self->nfrags &&
-          !self->recFlags[recv_udp_msg->fragno]) {
-        self->recFlags[recv_udp_msg->fragno] = 1;
+      if (recv_udp_msg.fragno < self->nfrags &&
+          !self->recFlags[recv_udp_msg.fragno]) {
+        self->recFlags[recv_udp_msg.fragno] = 1;
 
         // copy everything to the app->buf
         int64_t pos_start =
-            recv_udp_msg->fragno * MAX_PAYLOAD_BYTES_PER_FRAGMENT;
+            recv_udp_msg.fragno * MAX_PAYLOAD_BYTES_PER_FRAGMENT;
         int64_t pos_end =
-            MIN(recv_udp_msg->payload_size,
-                (recv_udp_msg->fragno + 1) * MAX_PAYLOAD_BYTES_PER_FRAGMENT);
+            MIN(recv_udp_msg.payload_size,
+                (recv_udp_msg.fragno + 1) * MAX_PAYLOAD_BYTES_PER_FRAGMENT);
         int64_t curPayloadSize = pos_end - pos_start;
-        assert(recv_udp_msg->data_size == curPayloadSize);
-        memcpy(self->buf + pos_start, recv_udp_msg->data, curPayloadSize);
+        assert(recv_udp_msg.data_size == curPayloadSize);
+        memcpy(self->buf + pos_start, recv_udp_msg.data, curPayloadSize);
 
         self->message_complete = 1;
         for (uint32_t i = self->completeTo_fragno; i < self->nfrags; i++) {
@@ -467,19 +859,19 @@ int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
 
         if (self->message_complete) {
           // publish all the lcm messages in the buffer
-          self->publishLcmMessagesInBuf(recv_udp_msg->payload_size);
+          self->publishLcmMessagesInBuf(recv_udp_msg.payload_size);
         }
       } else if (self->verbose) {
         printf("ignoring udp packet\n");
       }
     } else {  // we're using FEC
-      int dec_done = self->ldpc_dec->processPacket(recv_udp_msg->data,
-                                                   recv_udp_msg->fragno);
+      int dec_done = self->ldpc_dec->processPacket(recv_udp_msg.data,
+                                                   recv_udp_msg.fragno);
       if (dec_done != 0) {
         if (dec_done == 1) {
           check_ret(self->ldpc_dec->getObject((uint8_t*)self->buf));
           // publish all the lcm messages in the buffer
-          self->publishLcmMessagesInBuf(recv_udp_msg->payload_size);
+          self->publishLcmMessagesInBuf(recv_udp_msg.payload_size);
         } else {
           fprintf(stderr,
                   "ldpc got all the sent packets, but couldn't reconstruct... "
@@ -494,30 +886,35 @@ int LcmTunnel::on_udp_data(GIOChannel* source, GIOCondition cond,
     printf(
         "ignoring udp packet seqno=%d, nfrag =%d, \t self-> seqno=%d, "
         "nfrags=%d\n",
-        recv_udp_msg->seqno, getNumFragments(recv_udp_msg->payload_size),
+        recv_udp_msg.seqno, getNumFragments(recv_udp_msg.payload_size),
         self->cur_seqno, self->nfrags);
   }
 
-  lcm_tunnel_udp_msg_t_destroy(recv_udp_msg);
-
   return TRUE;
 }
 
 int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
                            void* user_data) {
-  int ret = TRUE;
   LcmTunnel* self = (LcmTunnel*)user_data;
 
-  // increase buffer size if needed
+  // keep the unprocessed bytes at the start of the buffer, with room for the
+  // whole field that is being read
+  if (self->buf_offset > 0) {
+    memmove(self->buf, self->buf + self->buf_offset,
+            self->bytes_read - self->buf_offset);
+    self->bytes_read -= self->buf_offset;
+    self->buf_offset = 0;
+  }
   if (self->buf_sz < self->bytes_to_read) {
-    assert(self->bytes_read == 0);
     self->buf = (char*)realloc(self->buf, self->bytes_to_read);
     self->buf_sz = self->bytes_to_read;
   }
 
-  ssize_t nread =
-      read(ssocket_get_fd(self->tcp_sock), self->buf + self->bytes_read,
-           self->bytes_to_read - self->bytes_read);
+  // read as much as fits, so that a burst of small messages is handled in one
+  // wakeup
+  ssize_t nread = read(ssocket_get_fd(self->tcp_sock),
+                       self->buf + self->bytes_read,
+                       self->buf_sz - self->bytes_read);
 
   if (nread <= 0) {
     perror("tcp receive error: ");
@@ -526,26 +923,38 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
   }
 
   self->bytes_read += nread;
-  assert(self->bytes_read <= self->bytes_to_read);
+  assert(self->bytes_read <= self->buf_sz);
 
-  if (self->bytes_read != self->bytes_to_read) {
-    return TRUE;
+  // handle every complete field.  self may be gone once a field returns FALSE
+  int ret = TRUE;
+  while (ret && self->bytes_read - self->buf_offset >= self->bytes_to_read) {
+    char* field = self->buf + self->buf_offset;
+    self->buf_offset += self->bytes_to_read;
+    ret = on_tcp_field(self, field, self->bytes_to_read);
   }
+  return ret;
+}
+
+// Handles a field of bytes_to_read bytes received in tunnel_state, and sets up
+// the next one.  Returns FALSE if TCP data should no longer be handled.
+int LcmTunnel::on_tcp_field(LcmTunnel* self, char* field, int field_size) {
+  int ret = TRUE;
 
   switch (self->tunnel_state) {
     case CLIENT_MSG_SZ:
-      self->bytes_to_read = ntohl(*(uint32_t*)self->buf);
+      self->bytes_to_read = ntohl(*(uint32_t*)field);
       self->tunnel_state = CLIENT_MSG_DATA;
       break;
     case CLIENT_MSG_DATA: {
       lcm_tunnel_params_t tp_rec;
       int decode_status =
-          lcm_tunnel_params_t_decode(self->buf, 0, self->bytes_read, &tp_rec);
+          lcm_tunnel_params_t_decode(field, 0, field_size, &tp_rec);
       if (decode_status <= 0) {
         fprintf(stdout, "invalid request (%d)\n", decode_status);
         return FALSE;
       }
       self->tunnel_params = lcm_tunnel_params_t_copy(&tp_rec);
+      self->initQos();
 
       if (self->udp_fd >= 0) {
         close(self->udp_fd);
@@ -583,6 +992,9 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
         lcm_tunnel_params_t tp_port_msg;
         tp_port_msg.channels = (char*)" ";
         tp_port_msg.udp_port = ntohs(udp_addr.sin_port);
+        tp_port_msg.compress_level = 0;
+        tp_port_msg.num_qos_classes = 0;
+        tp_port_msg.qos_classes = NULL;
         int msg_sz = lcm_tunnel_params_t_encoded_size(&tp_port_msg);
         uint8_t msg[msg_sz];
         lcm_tunnel_params_t_encode(msg, 0, msg_sz, &tp_port_msg);
@@ -617,6 +1029,10 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
 
       fprintf(stderr, "%s subscribed to \"%s\" -- ", self->name,
               self->tunnel_params->channels);
+      if (self->tunnel_params->compress_level > 0) {
+        fprintf(stderr, "zlib level %d, ",
+                self->tunnel_params->compress_level);
+      }
 
       if (self->udp_fd >= 0) {
         if (self->tunnel_params->fec > 1) {
@@ -647,13 +1063,13 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
       lcm_subscription_set_queue_capacity(self->subscription, 0);
     } break;
     case SERVER_MSG_SZ:
-      self->bytes_to_read = ntohl(*(uint32_t*)self->buf);
+      self->bytes_to_read = ntohl(*(uint32_t*)field);
       self->tunnel_state = SERVER_MSG_DATA;
       break;
     case SERVER_MSG_DATA: {
       lcm_tunnel_params_t tp_rec;
       int decode_status =
-          lcm_tunnel_params_t_decode(self->buf, 0, self->bytes_read, &tp_rec);
+          lcm_tunnel_params_t_decode(field, 0, field_size, &tp_rec);
       if (decode_status <= 0) {
         fprintf(stderr, "invalid request (%d)\n", decode_status);
         return FALSE;
@@ -681,7 +1097,7 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
       ret = FALSE;  // don't want the TCP handler to be run again
     } break;
     case RECV_CHAN_SZ:
-      self->bytes_to_read = ntohl(*(uint32_t*)self->buf);
+      self->bytes_to_read = ntohl(*(uint32_t*)field);
       self->tunnel_state = RECV_CHAN;
 
       if (self->channel_sz < self->bytes_to_read + 1) {
@@ -690,31 +1106,30 @@ int LcmTunnel::on_tcp_data(GIOChannel* source, GIOCondition cond,
       }
       break;
     case RECV_CHAN:
-      memcpy(self->channel, self->buf, self->bytes_read);
-      self->channel[self->bytes_read] = 0;
+      memcpy(self->channel, field, field_size);
+      self->channel[field_size] = 0;
 
       self->bytes_to_read = 4;
       self->tunnel_state = RECV_DATA_SZ;
       break;
-    case RECV_DATA_SZ:
-      self->bytes_to_read = ntohl(*(uint32_t*)self->buf);
+    case RECV_DATA_SZ: {
+      uint32_t data_sz = ntohl(*(uint32_t*)field);
+      self->recv_compressed = (data_sz & TCP_COMPRESSED_FLAG) != 0;
+      self->bytes_to_read = data_sz & ~TCP_COMPRESSED_FLAG;
       self->tunnel_state = RECV_DATA;
-      break;
+    } break;
     case RECV_DATA:
       if (self->verbose) {
         printf("Recieved TCP message on channel \"%s\"\n", self->channel);
       }
-      LcmTunnelServer::check_and_send_to_tunnels(self->channel, self->buf,
-                                                 self->bytes_read, self);
-      lcm_publish(self->lcm, self->channel, (uint8_t*)self->buf,
-                  self->bytes_read);
+      self->publishLcmMessage(self->channel, (uint8_t*)field, field_size,
+                              self->recv_compressed);
 
       self->bytes_to_read = 4;
       self->tunnel_state = RECV_CHAN_SZ;
       break;
   }
 
-  self->bytes_read = 0;
 
   return ret;
 }
@@ -725,29 +1140,29 @@ gpointer LcmTunnel::sendThreadFunc(gpointer user_data) {
   g_mutex_lock(self->sendQueueLock);
   int64_t nextFlushTime = 0;
   while (!self->stopSendThread) {
-    if (self->sendQueue.empty()) {
+    if (self->bytesInQueue == 0) {
       g_cond_wait(self->sendQueueCond, self->sendQueueLock);
       nextFlushTime =
           _timestamp_now() + self->tunnel_params->max_delay_ms * 1000;
       continue;
     }
     int64_t now = _timestamp_now();
-    if (self->tunnel_params->max_delay_ms > 0 &&
-        self->bytesInQueue < NUM_BYTES_TO_SEND_IMMEDIATELY &&
-        nextFlushTime > now && !self->flushImmediately) {
+    int64_t sendTime = self->nextSendTime(nextFlushTime, now);
+    if (sendTime > now) {
+      // g_cond_wait_until() takes a monotonic time
       g_cond_wait_until(self->sendQueueCond, self->sendQueueLock,
-                        nextFlushTime);
+                        g_get_monotonic_time() + (sendTime - now));
 
       continue;
     }
     // there is stuff in the queue that we need to handle
-    self->flushImmediately = false;
 
-    // take current contents out of the queue
+    // take what should go next out of the queue
     std::deque<TunnelLcmMessage*> tmpQueue;
-    tmpQueue.swap(self->sendQueue);
-    uint32_t bytesInTmpQueue = self->bytesInQueue;
-    self->bytesInQueue = 0;
+    uint32_t bytesInTmpQueue = self->takeMessagesToSend(tmpQueue, now);
+    if (tmpQueue.empty()) {
+      continue;
+    }
     g_mutex_unlock(self->sendQueueLock);
     // release lock for sending
 
@@ -767,6 +1182,166 @@ gpointer LcmTunnel::sendThreadFunc(gpointer user_data) {
   return NULL;
 }
 
+// Sets up a queue for each QoS class in tunnel_params, followed by the
+// built-in ones.
+void LcmTunnel::initQos() {
+  g_mutex_lock(sendQueueLock);
+  clearQos();
+
+  int64_t now = _timestamp_now();
+  for (int i = 0; i < tunnel_params->num_qos_classes; i++) {
+    lcm_tunnel_qos_class_t* qos = &tunnel_params->qos_classes[i];
+    fprintf(stderr,
+            "QoS for \"%s\": priority %d, rate limit %d B/s, burst %d B, "
+            "max latency %dms%s\n",
+            qos->channels, qos->priority, qos->rate_limit, qos->burst_size,
+            qos->max_latency_ms, qos->conflate ? ", conflated" : "");
+    qosQueues.push_back(new TunnelQosQueue(qos, now));
+  }
+
+  // time sync messages are not held back to be batched
+  lcm_tunnel_qos_class_t qos;
+  memset(&qos, 0, sizeof(qos));
+  qos.channels = (char*)"TIMESYNC";
+  qos.max_latency_ms = 0;
+  qosQueues.push_back(new TunnelQosQueue(&qos, now));
+  // the class of unmatched channels comes last
+  qos.channels = NULL;
+  qos.max_latency_ms = -1;
+  qosQueues.push_back(new TunnelQosQueue(&qos, now));
+
+  qosOrder = qosQueues;
+  std::stable_sort(qosOrder.begin(), qosOrder.end(), higherPriority);
+  qosChannels = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  g_mutex_unlock(sendQueueLock);
+}
+
+void LcmTunnel::clearQos() {
+  for (size_t i = 0; i < qosQueues.size(); i++) {
+    delete qosQueues[i];
+  }
+  qosQueues.clear();
+  qosOrder.clear();
+  if (qosChannels != NULL) {
+    GHashTableIter iter;
+    gpointer channel;
+    gpointer value;
+    g_hash_table_iter_init(&iter, qosChannels);
+    while (g_hash_table_iter_next(&iter, &channel, &value)) {
+      tunnel_channel_t* info = (tunnel_channel_t*)value;
+      if (info->conflated > 0) {
+        fprintf(stderr, "%s: %llu messages conflated on %s\n", name,
+                (unsigned long long)info->conflated, (char*)channel);
+      }
+    }
+    g_hash_table_destroy(qosChannels);
+    qosChannels = NULL;
+  }
+  bytesInQueue = 0;
+}
+
+tunnel_channel_t* LcmTunnel::qosChannel(const char* channel) {
+  tunnel_channel_t* info =
+      (tunnel_channel_t*)g_hash_table_lookup(qosChannels, channel);
+  if (info == NULL) {
+    info = g_new0(tunnel_channel_t, 1);
+    info->queue = qosQueues.back();
+    for (size_t i = 0; i + 1 < qosQueues.size(); i++) {
+      if (qosQueues[i]->matches(channel)) {
+        info->queue = qosQueues[i];
+        break;
+      }
+    }
+    g_hash_table_insert(qosChannels, g_strdup(channel), info);
+  }
+  return info;
+}
+
+// Returns when the next messages should be sent: right away if there are
+// enough of them, otherwise once they have been batched for max_delay_ms or
+// half of their latency budget, but not before a rate limit lets them through.
+int64_t LcmTunnel::nextSendTime(int64_t flushTime, int64_t now) {
+  int64_t sendTime = G_MAXINT64;
+  uint32_t sendableBytes = 0;
+  for (size_t i = 0; i < qosQueues.size(); i++) {
+    TunnelQosQueue* queue = qosQueues[i];
+    if (queue->queue.empty()) {
+      continue;
+    }
+    queue->refill(now);
+    if (!queue->canSend()) {
+      sendTime = MIN(sendTime, queue->nextSendableTime(now));
+      continue;
+    }
+    sendableBytes += queue->bytes;
+
+    int64_t queueSendTime = flushTime;
+    if (queue->max_latency_us >= 0) {
+      queueSendTime =
+          MIN(queueSendTime,
+              queue->queue.front()->recv_utime + queue->max_latency_us / 2);
+    }
+    sendTime = MIN(sendTime, queueSendTime);
+  }
+  // with nothing sendable, wait for the rate limits rather than spinning
+  if (sendableBytes > 0 && (tunnel_params->max_delay_ms <= 0 ||
+                            sendableBytes >= NUM_BYTES_TO_SEND_IMMEDIATELY)) {
+    sendTime = MIN(sendTime, now);
+  }
+  return sendTime;
+}
+
+// Moves the messages to send next into msgQueue, highest priority first, as
+// far as the rate limits allow and up to about SEND_MAX_BATCH_BYTES.  Messages
+// past their latency budget are dropped instead.  Returns the bytes moved.
+uint32_t LcmTunnel::takeMessagesToSend(
+    std::deque<TunnelLcmMessage*>& msgQueue, int64_t now) {
+  // without QoS classes there is nothing to get ahead of a batch
+  uint32_t maxBytes = SEND_MAX_BATCH_BYTES;
+  if (tunnel_params->num_qos_classes == 0) {
+    maxBytes = MAX_SEND_BUFFER_SIZE;
+  }
+  uint32_t bytes = 0;
+  for (size_t i = 0; i < qosOrder.size(); i++) {
+    TunnelQosQueue* queue = qosOrder[i];
+    if (queue->max_latency_us > 0) {
+      uint64_t dropped = queue->dropped;
+      while (!queue->queue.empty() &&
+             now - queue->queue.front()->recv_utime > queue->max_latency_us) {
+        bytesInQueue -= queue->dropOldest();
+      }
+      if (verbose && queue->dropped > dropped) {
+        printf("dropped %d messages that missed their latency budget\n",
+               (int)(queue->dropped - dropped));
+      }
+    }
+
+    queue->refill(now);
+    if (msgQueue.empty() && queue->rate_limit <= 0 &&
+        queue->bytes <= maxBytes) {
+      // take the whole queue at once
+      msgQueue.swap(queue->queue);
+      bytes = queue->bytes;
+      bytesInQueue -= bytes;
+      queue->bytes = 0;
+      continue;
+    }
+    while (!queue->queue.empty() && queue->canSend()) {
+      TunnelLcmMessage* msg = queue->queue.front();
+      if (bytes > 0 && bytes + msg->encoded_size > maxBytes) {
+        return bytes;
+      }
+      queue->queue.pop_front();
+      queue->bytes -= msg->encoded_size;
+      queue->tokens -= msg->encoded_size;
+      bytesInQueue -= msg->encoded_size;
+      bytes += msg->encoded_size;
+      msgQueue.push_back(msg);
+    }
+  }
+  return bytes;
+}
+
 void LcmTunnel::send_to_remote(const void* data, uint32_t len,
                                const char* lcm_channel) {
   lcm_recv_buf_t rbuf;
@@ -780,22 +1355,42 @@ void LcmTunnel::send_to_remote(const void* data, uint32_t len,
 
 void LcmTunnel::send_to_remote(const lcm_recv_buf_t* rbuf,
                                const char* lcm_channel) {
-  g_mutex_lock(sendQueueLock);
   TunnelLcmMessage* new_msg = new TunnelLcmMessage(rbuf, lcm_channel);
+  send_to_remote(new_msg);
+  new_msg->unref();
+}
+
+void LcmTunnel::send_to_remote(TunnelLcmMessage* new_msg) {
+  g_mutex_lock(sendQueueLock);
+  tunnel_channel_t* info = qosChannel(new_msg->channel);
+  TunnelQosQueue* queue = info->queue;
+  // The newer message goes to the back rather than in the place of the one it
+  // replaces, so that the queue stays in the order the messages came in, which
+  // the latency budget relies on.
+  TunnelLcmMessage* old_msg =
+      queue->conflate ? queue->remove(new_msg->channel) : NULL;
+  if (old_msg != NULL) {
+    bytesInQueue -= old_msg->encoded_size;
+    info->conflated++;
+    old_msg->unref();
+  }
+  new_msg->ref();
+  queue->queue.push_back(new_msg);
+  queue->bytes += new_msg->encoded_size;
   bytesInQueue += new_msg->encoded_size;
-  sendQueue.push_back(new_msg);
   while (bytesInQueue > MAX_SEND_BUFFER_SIZE) {
     fprintf(stderr,
             "Warning: send queue is too big (%dMB), dropping messages\n",
             bytesInQueue / (2 << 20));
-    // need to drop some stuff
-    TunnelLcmMessage* drop_msg = sendQueue.front();
-    sendQueue.pop_front();
-    bytesInQueue -= drop_msg->encoded_size;
-    delete drop_msg;
-  }
-  // hack to not delay time sync messages
-  flushImmediately = strcmp(lcm_channel, "TIMESYNC") == 0;
+    // need to drop some stuff, starting with the lowest priority
+    TunnelQosQueue* drop_queue = NULL;
+    for (size_t i = qosOrder.size(); drop_queue == NULL && i > 0; i--) {
+      if (!qosOrder[i - 1]->queue.empty()) {
+        drop_queue = qosOrder[i - 1];
+      }
+    }
+    bytesInQueue -= drop_queue->dropOldest();
+  }
   g_mutex_unlock(sendQueueLock);
   g_cond_broadcast(sendQueueCond);  // signal to say there is a message waiting
 }
@@ -849,6 +1444,10 @@ bool LcmTunnel::send_lcm_messages(std::deque<TunnelLcmMessage*>& msgQueue,
       return true;
     }
 
+    if (tunnel_params->compress_level > 0) {
+      bytesInQueue = compressMessages(msgQueue);
+    }
+
     udp_send_seqno++;  // increment the sequence counter
     udp_send_seqno = udp_send_seqno % SEQNO_WRAP_VAL;
     if (verbose) {
@@ -872,29 +1471,25 @@ bool LcmTunnel::send_lcm_messages(std::deque<TunnelLcmMessage*>& msgQueue,
               "WARNING! Queue contains more than the max message size of %d "
               "bytes... we're WAY behind, dropping msgs\n",
               maxMsgSize);
-      while (msgSize < maxMsgSize) {
+      while (msgSize > maxMsgSize) {
         // drop messages
         TunnelLcmMessage* drop_msg = msgQueue.front();
         msgQueue.pop_front();
         msgSize -= drop_msg->encoded_size;
-        delete drop_msg;
+        drop_msg->unref();
       }
+      nfragments = getNumFragments(msgSize);
     }
-    // put the entire queue into 1 big buffer
-    uint8_t* msgBuf = (uint8_t*)malloc(msgSize * sizeof(uint8_t));
-    uint32_t msgBufOffset = 0;
-    while (!msgQueue.empty()) {
-      TunnelLcmMessage* msg = msgQueue.front();
-      msgQueue.pop_front();
-      lcm_tunnel_sub_msg_t_encode(msgBuf, msgBufOffset, msgSize - msgBufOffset,
-                                  msg->sub_msg);
-      msgBufOffset += msg->encoded_size;
-      delete msg;
-    }
-    assert(msgBufOffset == msgSize);
 
     if (tunnel_params->fec < 1 ||
         nfragments < MIN_NUM_FRAGMENTS_FOR_FEC) {  // don't use FEC
+      // the payload is the encoded messages back to back, so each fragment is
+      // gathered straight from them behind its own header, and the fragments
+      // are sent a batch at a time
+      udp_mmsghdr_t mmsgs[UDP_BATCH_SIZE];
+      uint8_t headers[UDP_BATCH_SIZE][UDP_HEADER_MAX_SIZE];
+      int iovStart[UDP_BATCH_SIZE + 1];  // first iovec of each fragment
+      std::vector<struct iovec> iov;
       int sendRepeats = 1;
       if (fabs(tunnel_params->fec) > 1) {  // fec <0 means always send
                                            // duplicates
@@ -902,112 +1497,305 @@ bool LcmTunnel::send_lcm_messages(std::deque<TunnelLcmMessage*>& msgQueue,
             fabs(tunnel_params->fec));  // send ceil of the fec rate times
       }
       for (int r = 0; r < sendRepeats; r++) {
-        msgBufOffset = 0;
-        for (int i = 0; i < nfragments; i++) {
-          lcm_tunnel_udp_msg_t msg;
-          msg.seqno = udp_send_seqno;
-          msg.fragno = i;
-          msg.payload_size = msgSize;
-
-          msg.data_size =
-              MIN(MAX_PAYLOAD_BYTES_PER_FRAGMENT, msgSize - msgBufOffset);
-          msg.data = msgBuf + msgBufOffset;
-
-          msgBufOffset += msg.data_size;
-
-          int msg_sz = lcm_tunnel_udp_msg_t_encoded_size(&msg);
-          uint8_t msg_buf[msg_sz];
-          lcm_tunnel_udp_msg_t_encode(msg_buf, 0, msg_sz, &msg);
-          int send_status = send(udp_fd, msg_buf, msg_sz, 0);
-          checkUDPSendStatus(send_status);
+        size_t msgIdx = 0;
+        int msgOffset = 0;
+        uint32_t msgBufOffset = 0;
+        for (int i = 0; i < nfragments; i += UDP_BATCH_SIZE) {
+          int nbatch = MIN(UDP_BATCH_SIZE, nfragments - i);
+          iov.clear();
+          for (int j = 0; j < nbatch; j++) {
+            int data_size =
+                MIN(MAX_PAYLOAD_BYTES_PER_FRAGMENT, msgSize - msgBufOffset);
+            msgBufOffset += data_size;
+
+            iovStart[j] = iov.size();
+            iov.push_back(make_iovec(
+                headers[j], encode_udp_header(headers[j], udp_send_seqno,
+                                              i + j, msgSize, data_size)));
+            while (data_size > 0) {
+              TunnelLcmMessage* msg = msgQueue[msgIdx];
+              int len = MIN(data_size, msg->encoded_size - msgOffset);
+              iov.push_back(make_iovec(msg->encoded + msgOffset, len));
+              data_size -= len;
+              msgOffset += len;
+              if (msgOffset == msg->encoded_size) {
+                msgIdx++;
+                msgOffset = 0;
+              }
+            }
+          }
+          iovStart[nbatch] = iov.size();
+
+          // iov is complete, so it won't move any more
+          for (int j = 0; j < nbatch; j++) {
+            mmsgs[j] = make_mmsghdr(&iov[iovStart[j]],
+                                    iovStart[j + 1] - iovStart[j]);
+          }
+          int sent = 0;
+          while (sent < nbatch) {
+            checkUDPSendStatus(_send_udp_batch(udp_fd, mmsgs, nbatch, &sent));
+          }
         }
       }
     } else {  // use tunnel error correction to send
+      // the encoder needs the whole payload in one buffer
+      uint8_t* msgBuf = (uint8_t*)malloc(msgSize * sizeof(uint8_t));
+      uint32_t msgBufOffset = 0;
+      for (size_t i = 0; i < msgQueue.size(); i++) {
+        memcpy(msgBuf + msgBufOffset, msgQueue[i]->encoded,
+               msgQueue[i]->encoded_size);
+        msgBufOffset += msgQueue[i]->encoded_size;
+      }
+      assert(msgBufOffset == msgSize);
+
       ldpc_enc_wrapper* ldpc_enc = new ldpc_enc_wrapper(
           msgBuf, msgSize, MAX_PAYLOAD_BYTES_PER_FRAGMENT, tunnel_params->fec);
 
-      lcm_tunnel_udp_msg_t msg;
-      msg.seqno = udp_send_seqno;
-      msg.payload_size = msgSize;
+      udp_mmsghdr_t mmsgs[UDP_BATCH_SIZE];
+      uint8_t headers[UDP_BATCH_SIZE][UDP_HEADER_MAX_SIZE];
+      std::vector<uint8_t> packets(UDP_BATCH_SIZE *
+                                   MAX_PAYLOAD_BYTES_PER_FRAGMENT);
+      struct iovec iov[2 * UDP_BATCH_SIZE];
 
       int enc_done = 0;
       while (!enc_done) {
-        uint8_t data_buf[MAX_PAYLOAD_BYTES_PER_FRAGMENT];
-        msg.data_size = MAX_PAYLOAD_BYTES_PER_FRAGMENT;
-        msg.data = data_buf;
-        enc_done = ldpc_enc->getNextPacket(msg.data, &msg.fragno);
-
-        int msg_sz = lcm_tunnel_udp_msg_t_encoded_size(&msg);
-        uint8_t msg_buf[msg_sz];
-        lcm_tunnel_udp_msg_t_encode(msg_buf, 0, msg_sz, &msg);
-        int send_status = send(udp_fd, msg_buf, msg_sz, 0);
-        checkUDPSendStatus(send_status);
+        int nbatch = 0;
+        for (; !enc_done && nbatch < UDP_BATCH_SIZE; nbatch++) {
+          uint8_t* packet = &packets[nbatch * MAX_PAYLOAD_BYTES_PER_FRAGMENT];
+          int16_t fragno;
+          enc_done = ldpc_enc->getNextPacket(packet, &fragno);
+
+          iov[2 * nbatch] = make_iovec(
+              headers[nbatch],
+              encode_udp_header(headers[nbatch], udp_send_seqno, fragno,
+                                msgSize, MAX_PAYLOAD_BYTES_PER_FRAGMENT));
+          iov[2 * nbatch + 1] =
+              make_iovec(packet, MAX_PAYLOAD_BYTES_PER_FRAGMENT);
+          mmsgs[nbatch] = make_mmsghdr(&iov[2 * nbatch], 2);
+        }
+        int sent = 0;
+        while (sent < nbatch) {
+          checkUDPSendStatus(_send_udp_batch(udp_fd, mmsgs, nbatch, &sent));
+        }
       }
       delete ldpc_enc;
+      free(msgBuf);
     }
-    free(msgBuf);
-  } else {
-    int cfd = ssocket_get_fd(tcp_sock);
-    assert(cfd > 0);
 
     while (!msgQueue.empty()) {
-      TunnelLcmMessage* msg = msgQueue.front();
+      msgQueue.front()->unref();
       msgQueue.pop_front();
+    }
+  } else {
+    int cfd = ssocket_get_fd(tcp_sock);
+    assert(cfd > 0);
 
+    if (tunnel_params->compress_level > 0) {
+      compressMessages(msgQueue);
+    }
+    if (server_params->tcp_cork) {
+      set_tcp_cork(cfd, 1);
+    }
+    bool success = true;
+    std::vector<char> headers;
+    while (success && !msgQueue.empty()) {
+      // pick as many messages as fit in one writev()
+      TunnelLcmMessage* batch[TCP_MAX_BATCH_MSGS];
+      int chanLens[TCP_MAX_BATCH_MSGS];
+      int nbatch = 0;
+      size_t headerBytes = 0;
+      int batchBytes = 0;
+      size_t nmsgs = 0;
       int64_t now = _timestamp_now();
-      double age_ms = (now - msg->recv_utime) * 1.0e-3;
-      if (tunnel_params->tcp_max_age_ms > 0 &&
-          age_ms > tunnel_params->tcp_max_age_ms) {
-        // message has been queued up for too long.  Drop it.
-        if (verbose) {
-          fprintf(stderr,
-                  "%s message too old (age = %d, param = %d), dropping.\n",
-                  msg->sub_msg->channel, (int)age_ms,
-                  tunnel_params->tcp_max_age_ms);
-        }
-      } else {
-        // send channel
-        int chan_len = strlen(msg->sub_msg->channel);
-        uint32_t chan_len_n = htonl(chan_len);
-        if (4 != _fileutils_write_fully(cfd, &chan_len_n, 4)) {
-          delete msg;
-          return false;
-        }
-        if (chan_len !=
-            _fileutils_write_fully(cfd, msg->sub_msg->channel, chan_len)) {
-          delete msg;
-          return false;
+      for (; nmsgs < msgQueue.size() && nbatch < TCP_MAX_BATCH_MSGS &&
+           batchBytes < TCP_MAX_BATCH_BYTES;
+           nmsgs++) {
+        TunnelLcmMessage* msg = msgQueue[nmsgs];
+        double age_ms = (now - msg->recv_utime) * 1.0e-3;
+        if (tunnel_params->tcp_max_age_ms > 0 &&
+            age_ms > tunnel_params->tcp_max_age_ms) {
+          // message has been queued up for too long.  Drop it.
+          if (verbose) {
+            fprintf(stderr,
+                    "%s message too old (age = %d, param = %d), dropping.\n",
+                    msg->channel, (int)age_ms, tunnel_params->tcp_max_age_ms);
+          }
+          continue;
         }
+        int chan_len = strlen(msg->channel);
+        batch[nbatch] = msg;
+        chanLens[nbatch++] = chan_len;
+        headerBytes += 8 + chan_len;
+        batchBytes += 8 + chan_len + msg->data_size;
+      }
 
-        // send data
-        int data_size_n = htonl(msg->sub_msg->data_size);
-        if (4 != _fileutils_write_fully(cfd, &data_size_n, 4)) {
-          delete msg;
-          return false;
-        }
-        if (msg->sub_msg->data_size !=
-            _fileutils_write_fully(cfd, msg->sub_msg->data,
-                                   msg->sub_msg->data_size)) {
-          delete msg;
-          return false;
+      // frame them: channel length, channel and data length copied into one
+      // header, followed by the data
+      struct iovec iov[2 * TCP_MAX_BATCH_MSGS];
+      int niov = 0;
+      headers.resize(headerBytes);
+      size_t offset = 0;
+      for (int i = 0; i < nbatch; i++) {
+        TunnelLcmMessage* msg = batch[i];
+        char* header = &headers[offset];
+        uint32_t len = htonl(chanLens[i]);
+        memcpy(header, &len, 4);
+        memcpy(header + 4, msg->channel, chanLens[i]);
+        len =
+            htonl(msg->data_size | (msg->compressed ? TCP_COMPRESSED_FLAG : 0));
+        memcpy(header + 4 + chanLens[i], &len, 4);
+        iov[niov++] = make_iovec(header, 8 + chanLens[i]);
+        iov[niov++] = make_iovec(msg->data, msg->data_size);
+        offset += 8 + chanLens[i];
+      }
+
+      success = _writev_fully(cfd, iov, niov);
+      for (size_t i = 0; i < nmsgs; i++) {
+        TunnelLcmMessage* msg = msgQueue.front();
+        msgQueue.pop_front();
+        if (success && verbose) {
+          printf("Sent \"%s\".\n", msg->channel);
         }
+        msg->unref();
       }
-      if (verbose) {
-        printf("Sent \"%s\".\n", msg->sub_msg->channel);
+    }
+    if (!success) {
+      while (!msgQueue.empty()) {
+        msgQueue.front()->unref();
+        msgQueue.pop_front();
       }
-      delete msg;
+      return false;
+    }
+    if (server_params->tcp_cork) {
+      set_tcp_cork(cfd, 0);
     }
   }
 
   return true;
 }
 
+// Replaces the messages in msgQueue that compress well with compressed
+// copies, and returns the new number of bytes in the queue.
+uint32_t LcmTunnel::compressMessages(std::deque<TunnelLcmMessage*>& msgQueue) {
+  if (compressStats == NULL) {
+    compressStats =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+  }
+  uint32_t bytes = 0;
+  for (size_t i = 0; i < msgQueue.size(); i++) {
+    TunnelLcmMessage* msg = msgQueue[i];
+    tunnel_compress_stats_t* stats = (tunnel_compress_stats_t*)
+        g_hash_table_lookup(compressStats, msg->channel);
+    if (stats == NULL) {
+      stats = g_new0(tunnel_compress_stats_t, 1);
+      g_hash_table_insert(compressStats, g_strdup(msg->channel), stats);
+    }
+    stats->bytes_in += msg->data_size;
+    if (msg->data_size >= COMPRESS_MIN_BYTES) {
+      if (stats->skip > 0) {
+        stats->skip--;
+      } else {
+        TunnelLcmMessage* zmsg = compressMessage(msg, stats);
+        if (zmsg != NULL) {
+          msg->unref();
+          msgQueue[i] = msg = zmsg;
+        }
+      }
+    }
+    stats->bytes_out += msg->data_size;
+    bytes += msg->encoded_size;
+  }
+  return bytes;
+}
+
+// Returns a compressed copy of msg, or NULL if compressing doesn't make it
+// smaller.  Channels whose messages don't compress well are skipped for a
+// while.
+TunnelLcmMessage* LcmTunnel::compressMessage(TunnelLcmMessage* msg,
+                                             tunnel_compress_stats_t* stats) {
+  if (deflate_stream == NULL) {
+    deflate_stream = g_new0(z_stream, 1);
+    if (deflateInit(deflate_stream, tunnel_params->compress_level) != Z_OK) {
+      fprintf(stderr, "%s: invalid zlib level %d, not compressing\n", name,
+              tunnel_params->compress_level);
+      g_free(deflate_stream);
+      deflate_stream = NULL;
+      tunnel_params->compress_level = 0;
+      return NULL;
+    }
+  } else {
+    deflateReset(deflate_stream);
+  }
+
+  int64_t start = _timestamp_now();
+  TunnelLcmMessage* zmsg = new TunnelLcmMessage(
+      msg->channel, msg->recv_utime,
+      deflateBound(deflate_stream, msg->data_size), true);
+  deflate_stream->next_in = msg->data;
+  deflate_stream->avail_in = msg->data_size;
+  deflate_stream->next_out = zmsg->data;
+  deflate_stream->avail_out = zmsg->data_size;
+  // deflateBound() leaves enough room to finish in one call
+  int status = deflate(deflate_stream, Z_FINISH);
+  zmsg->setDataSize(zmsg->data_size - deflate_stream->avail_out);
+  stats->compress_usec += _timestamp_now() - start;
+  stats->compress_bytes += msg->data_size;
+
+  // a running average, restarted by the first message after a pause
+  double ratio = (double)msg->data_size / zmsg->data_size;
+  if (stats->ratio > 0) {
+    stats->ratio = 0.875 * stats->ratio + 0.125 * ratio;
+  } else {
+    stats->ratio = ratio;
+  }
+  if (stats->ratio < COMPRESS_MIN_RATIO) {
+    if (stats->backoff > 0) {
+      stats->backoff = MIN(2 * stats->backoff, COMPRESS_MAX_RETRY_INTERVAL);
+    } else {
+      stats->backoff = COMPRESS_RETRY_INTERVAL;
+    }
+    stats->skip = stats->backoff;
+    if (verbose) {
+      printf("not compressing \"%s\" for %d messages, ratio %.2f\n",
+             msg->channel, stats->skip, stats->ratio);
+    }
+    stats->ratio = 0;
+  } else {
+    stats->backoff = 0;
+  }
+
+  if (status != Z_STREAM_END || zmsg->data_size >= msg->data_size) {
+    zmsg->unref();
+    return NULL;
+  }
+  return zmsg;
+}
+
+void LcmTunnel::printCompressStats() {
+  GHashTableIter iter;
+  gpointer channel, value;
+  g_hash_table_iter_init(&iter, compressStats);
+  while (g_hash_table_iter_next(&iter, &channel, &value)) {
+    tunnel_compress_stats_t* stats = (tunnel_compress_stats_t*)value;
+    if (stats->compress_bytes > 0) {
+      fprintf(stderr,
+              "%s: compressed %s %.2f:1, %.3f MB to %.3f MB, at %.1f MB/s\n",
+              name, (char*)channel,
+              (double)stats->bytes_in / stats->bytes_out,
+              stats->bytes_in * 1e-6, stats->bytes_out * 1e-6,
+              (double)stats->compress_bytes / MAX(stats->compress_usec, 1));
+    }
+  }
+}
+
 static gboolean on_introspect_timer(void* user_data) {
   introspect_t* ini = (introspect_t*)user_data;
   introspect_send_introspection_packet(ini);
   return TRUE;
 }
 
+#define MAX_QOS_CLASSES 16
+
 typedef struct {
   bool connectToServer;
   char server_addr_str[1024];
@@ -1021,8 +1809,76 @@ typedef struct {
   int tcp_max_age_ms;
   int max_delay_ms;
   float fec;
+  int compress_level;
+  int tcp_cork;
+  lcm_tunnel_qos_class_t qos_classes[MAX_QOS_CLASSES];
+  int num_qos_classes;
 } app_params_t;
 
+static const char* qos_options[] = {"priority=", "rate=", "burst=",
+                                    "latency=", "conflate="};
+
+// Returns which of qos_options str starts with, or -1.
+static int qos_option(const char* str) {
+  for (int i = 0; i < (int)(sizeof(qos_options) / sizeof(qos_options[0]));
+       i++) {
+    if (strncmp(str, qos_options[i], strlen(qos_options[i])) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Parses a --qos argument, CHAN followed by ",OPTION=N" for any of
+// qos_options.  Returns false if it is malformed.
+static bool parse_qos_class(const char* spec, lcm_tunnel_qos_class_t* qos) {
+  memset(qos, 0, sizeof(*qos));
+  qos->max_latency_ms = -1;
+
+  // the regex can contain commas itself, so it ends at the first comma that
+  // starts an option
+  const char* opt = strchr(spec, ',');
+  while (opt != NULL && qos_option(opt + 1) < 0) {
+    opt = strchr(opt + 1, ',');
+  }
+  if (opt == NULL) {
+    opt = spec + strlen(spec);
+  }
+  qos->channels = g_strndup(spec, opt - spec);
+
+  while (*opt == ',') {
+    int option = qos_option(opt + 1);
+    if (option < 0) {
+      return false;
+    }
+    const char* value = opt + 1 + strlen(qos_options[option]);
+    char* e;
+    int32_t n = strtol(value, &e, 0);
+    if (e == value || (*e != ',' && *e != '\0')) {
+      return false;
+    }
+    switch (option) {
+      case 0:
+        qos->priority = n;
+        break;
+      case 1:
+        qos->rate_limit = n;
+        break;
+      case 2:
+        qos->burst_size = n;
+        break;
+      case 3:
+        qos->max_latency_ms = n;
+        break;
+      case 4:
+        qos->conflate = n != 0;
+        break;
+    }
+    opt = e;
+  }
+  return true;
+}
+
 static void usage(const char* progname) {
   char* basename = g_path_get_basename(progname);
   printf(
@@ -1063,6 +1919,13 @@ static void usage(const char* progname) {
       "when -u\n"
       "                              is specified.  Default: 10000\n"
       "\n"
+      "    -c, --tcp-cork            Send the messages we forward over TCP in "
+      "full\n"
+      "                              segments, holding back the last partial "
+      "one\n"
+      "                              until the whole batch is written "
+      "(Linux)\n"
+      "\n"
       "    -f, --fec=FEC             Request server to use UDP packets with "
       "Forward\n"
       "                              Error Correction applied at a rate of FEC "
@@ -1078,12 +1941,44 @@ static void usage(const char* progname) {
       "resiliency\n"
       "                              --fec and --dup cannot be used together\n"
       "\n"
+      "    -z, --compress=LEVEL      Compress the messages sent in both "
+      "directions\n"
+      "                              with zlib at LEVEL (1-9), except on "
+      "channels\n"
+      "                              whose messages don't get smaller, such "
+      "as\n"
+      "                              images\n"
+      "\n"
       "\n"
       "    -w, --wait-time-ms=TIME   Request server to queue up lcm messages "
       "for\n"
       "                              TIME ms before sending as a group\n"
       "                              for efficiency reasons\n"
       "\n"
+      "    -Q, --qos=CHAN[,OPT=N]... Queue the messages on channels that "
+      "match\n"
+      "                              regex CHAN on their own, in both "
+      "directions,\n"
+      "                              and send them according to the OPTs:\n"
+      "                              priority=N  Classes with a higher "
+      "priority\n"
+      "                                are sent first.  Default: 0\n"
+      "                              rate=N  Send at most N bytes/s...\n"
+      "                              burst=N  ...in bursts of up to N "
+      "bytes.\n"
+      "                                Default: one second's worth\n"
+      "                              latency=N  Hold messages for at most "
+      "N/2 ms\n"
+      "                                to batch them, and drop them after N "
+      "ms.\n"
+      "                                0 sends them right away\n"
+      "                              conflate=1  Only send the latest "
+      "message on\n"
+      "                                each channel, replacing any that is\n"
+      "                                still waiting\n"
+      "                              Can be given up to %d times.  The first\n"
+      "                              class that matches a channel applies.\n"
+      "\n"
       "Examples:\n"
       "\n"
       " %s \n"
@@ -1108,9 +2003,18 @@ static void usage(const char* progname) {
       "    We forward traffic on channels ABC and DEF to 192.168.1.1 via UDP "
       "with\n"
       "    FEC 1.5.  Server does not forward anything back.\n"
+      "\n"
+      " %s -Q \"ESTOP|POSE,priority=10,latency=100\" \\\n"
+      "    -Q \"STATUS.*,conflate=1\" \\\n"
+      "    -Q \"MAP_TILES.*,priority=-1,rate=50000\" 192.168.1.1\n"
+      "    Tunnels all channels, sending ESTOP and POSE ahead of everything "
+      "else\n"
+      "    and map tiles behind everything else, at no more than 50 kB/s.  "
+      "Only\n"
+      "    the latest message on each STATUS channel is sent.\n"
       "\n",
-      basename, DEFAULT_PORT, DEFAULT_PORT, basename, basename, basename,
-      basename, basename);
+      basename, DEFAULT_PORT, DEFAULT_PORT, MAX_QOS_CLASSES, basename,
+      basename, basename, basename, basename, basename);
   free(basename);
   exit(1);
 }
@@ -1118,7 +2022,7 @@ static void usage(const char* progname) {
 int main(int argc, char** argv) {
   setlinebuf(stdout);
 
-  const char* optstring = "hvqur:s:R:S:p:f:l:m:d:w:";
+  const char* optstring = "hvqucr:s:R:S:p:f:l:m:d:w:Q:z:";
 
   app_params_t params;
   memset(&params, 0, sizeof(params));
@@ -1147,6 +2051,9 @@ int main(int argc, char** argv) {
                                {"wait-time-us", required_argument, 0, 'w'},
                                {"lcm-url", required_argument, 0, 'l'},
                                {"tcp-max-age-ms", required_argument, 0, 'm'},
+                               {"tcp-cork", no_argument, 0, 'c'},
+                               {"qos", required_argument, 0, 'Q'},
+                               {"compress", required_argument, 0, 'z'},
                                {0, 0, 0, 0}};
 
   int c;
@@ -1206,6 +2113,9 @@ int main(int argc, char** argv) {
       case 'u':
         params.udp = 1;
         break;
+      case 'c':
+        params.tcp_cork = 1;
+        break;
       case 'l':
         if (strlen(optarg) > sizeof(params.lcm_url) - 1) {
           fprintf(stderr, "LCM URL string too long\n");
@@ -1229,6 +2139,25 @@ int main(int argc, char** argv) {
         }
         break;
       }
+      case 'Q':
+        if (params.num_qos_classes == MAX_QOS_CLASSES) {
+          fprintf(stderr, "too many QoS classes\n");
+          return 1;
+        }
+        if (!parse_qos_class(optarg,
+                             &params.qos_classes[params.num_qos_classes++])) {
+          usage(argv[0]);
+        }
+        break;
+      case 'z': {
+        char* e;
+        params.compress_level = strtol(optarg, &e, 0);
+        if (*e != '\0' || params.compress_level < 1 ||
+            params.compress_level > 9) {
+          usage(argv[0]);
+        }
+        break;
+      }
       case 'f': {
         char* e;
         if (params.fec < 0) {
@@ -1305,6 +2234,7 @@ int main(int argc, char** argv) {
   snprintf(serv_params.lcm_url, sizeof(serv_params.lcm_url), "%s",
            params.lcm_url);
   serv_params.verbose = params.verbose;
+  serv_params.tcp_cork = params.tcp_cork;
   if (!LcmTunnelServer::initializeServer(&serv_params)) {
     exit(1);
   }
@@ -1313,10 +2243,13 @@ int main(int argc, char** argv) {
   if (params.connectToServer) {
     lcm_tunnel_params_t tunnel_params;
     tunnel_params.fec = params.fec;
+    tunnel_params.compress_level = params.compress_level;
     tunnel_params.tcp_max_age_ms = params.tcp_max_age_ms;
     tunnel_params.udp = params.udp;
     tunnel_params.max_delay_ms = params.max_delay_ms;
     tunnel_params.channels = strdup(params.channels_send);
+    tunnel_params.num_qos_classes = params.num_qos_classes;
+    tunnel_params.qos_classes = params.qos_classes;
     LcmTunnel* tunnelClient = new LcmTunnel(params.verbose, NULL);
     int ret = tunnelClient->connectToServer(
         LcmTunnelServer::lcm, LcmTunnelServer::introspect,
@@ -25,12 +25,17 @@
 #include <string.h>
 
 #include <deque>
+#include <vector>
 
 #include <glib.h>
 #include <lcm/lcm.h>
+#include <lcm/lcm_coretypes.h>
+#include <zlib.h>
 
 #include "introspect.h"
+#include "lcmtypes/lcm_tunnel_compressed_msg_t.h"
 #include "lcmtypes/lcm_tunnel_params_t.h"
+#include "lcmtypes/lcm_tunnel_qos_class_t.h"
 #include "lcmtypes/lcm_tunnel_sub_msg_t.h"
 #include "ldpc/ldpc_wrapper.h"
 // IWYU pragma: no_forward_declare ldpc_dec_wrapper
@@ -65,26 +70,142 @@ typedef struct {
   int verbose;
   char lcm_url[1024];
   int startedAsClient;
+  int tcp_cork;  // hold back partial TCP segments while a batch is written
 } tunnel_server_params_t;
 
+struct udp_recv_batch_t;
+
+// An LCM message waiting to be sent, stored as an encoded
+// lcm_tunnel_sub_msg_t, or lcm_tunnel_compressed_msg_t if it is compressed, so
+// that the send path can hand it to the socket as is.  Messages are reference
+// counted, so that one forwarded to several tunnels is only copied once.
 class TunnelLcmMessage {
  public:
-  TunnelLcmMessage(const lcm_recv_buf_t* rbuf, const char* chan) {
-    sub_msg = (lcm_tunnel_sub_msg_t*)malloc(sizeof(lcm_tunnel_sub_msg_t));
-    sub_msg->channel = strdup(chan);
+  TunnelLcmMessage(const lcm_recv_buf_t* rbuf, const char* chan)
+      : ref_count(1) {
+    init(chan, rbuf->data_size, false);
     recv_utime = rbuf->recv_utime;
-    sub_msg->data_size = rbuf->data_size;
-    sub_msg->data = (uint8_t*)malloc(sub_msg->data_size);
-    memcpy(sub_msg->data, rbuf->data, sub_msg->data_size);
-    encoded_size = lcm_tunnel_sub_msg_t_encoded_size(sub_msg);
+    memcpy(data, rbuf->data, data_size);
+  }
+  // A message with room for data_capacity bytes of data, which the caller
+  // fills in before calling setDataSize()
+  TunnelLcmMessage(const char* chan, int64_t recv_utime_, int32_t data_capacity,
+                   bool compressed_)
+      : ref_count(1) {
+    init(chan, data_capacity, compressed_);
+    recv_utime = recv_utime_;
+  }
+
+  void setDataSize(int32_t size) {
+    int header_size = data - encoded;
+    data_size = size;
+    encoded_size = header_size + data_size;
+    // data_size is the last field before the data
+    __int32_t_encode_array(encoded, header_size - 4, 4, &data_size, 1);
+  }
+
+  void ref() { g_atomic_int_inc(&ref_count); }
+  void unref() {
+    if (g_atomic_int_dec_and_test(&ref_count)) {
+      delete this;
+    }
   }
-  ~TunnelLcmMessage() { lcm_tunnel_sub_msg_t_destroy(sub_msg); }
 
-  lcm_tunnel_sub_msg_t* sub_msg;
+  const char* channel;
+  uint8_t* data;
+  int32_t data_size;
   int64_t recv_utime;
+
+  uint8_t* encoded;
   int encoded_size;
+  bool compressed;
+
+ private:
+  ~TunnelLcmMessage() { free(encoded); }
+
+  void init(const char* chan, int32_t data_capacity, bool compressed_) {
+    // the two message types only differ in their fingerprint, so both are
+    // encoded by encoding the header without data and filling in data_size
+    int header_size;
+    if (compressed_) {
+      lcm_tunnel_compressed_msg_t header;
+      header.channel = (char*)chan;
+      header.data_size = 0;
+      header.data = NULL;
+      header_size = lcm_tunnel_compressed_msg_t_encoded_size(&header);
+      encoded = (uint8_t*)malloc(header_size + data_capacity);
+      lcm_tunnel_compressed_msg_t_encode(encoded, 0, header_size, &header);
+    } else {
+      lcm_tunnel_sub_msg_t header;
+      header.channel = (char*)chan;
+      header.data_size = 0;
+      header.data = NULL;
+      header_size = lcm_tunnel_sub_msg_t_encoded_size(&header);
+      encoded = (uint8_t*)malloc(header_size + data_capacity);
+      lcm_tunnel_sub_msg_t_encode(encoded, 0, header_size, &header);
+    }
+    compressed = compressed_;
+    // the channel is encoded with its terminating NUL just before data_size
+    channel = (const char*)encoded + header_size - 4 - strlen(chan) - 1;
+    data = encoded + header_size;
+    setDataSize(data_capacity);
+  }
+
+  volatile gint ref_count;
 };
 
+// The messages waiting to be sent in one QoS class, and the state of its rate
+// limit.  See lcm_tunnel_qos_class_t.
+class TunnelQosQueue {
+ public:
+  TunnelQosQueue(const lcm_tunnel_qos_class_t* qos, int64_t now);
+  ~TunnelQosQueue();
+
+  bool matches(const char* channel);
+  // adds the tokens earned since the last call
+  void refill(int64_t now);
+  // whether the rate limit lets a message through, and if not, when it will
+  bool canSend() { return rate_limit <= 0 || tokens > 0; }
+  int64_t nextSendableTime(int64_t now);
+  // returns the size of the message dropped
+  uint32_t dropOldest();
+  // takes the waiting message on channel out of the queue and returns it, or
+  // NULL if there is none
+  TunnelLcmMessage* remove(const char* channel);
+
+  GRegex* regex;  // NULL for the class of unmatched channels
+  int priority;
+  double rate_limit;  // bytes per second
+  double burst_size;
+  int64_t max_latency_us;
+  bool conflate;
+
+  double tokens;
+  int64_t last_refill;
+
+  std::deque<TunnelLcmMessage*> queue;
+  uint32_t bytes;
+  uint64_t dropped;
+};
+
+// What the send queue keeps for each channel it has seen.
+typedef struct {
+  TunnelQosQueue* queue;
+  uint64_t conflated;  // messages replaced by a newer one before being sent
+} tunnel_channel_t;
+
+// How well the messages on a channel have been compressing, kept by the send
+// thread.
+typedef struct {
+  double ratio;  // running average of uncompressed / compressed size
+  int skip;      // messages to send uncompressed before trying again
+  int backoff;   // what skip was last set to, doubled each time
+  uint64_t bytes_in;
+  uint64_t bytes_out;       // what bytes_in was sent as
+  uint64_t compress_bytes;  // the part of bytes_in given to zlib
+  int64_t compress_usec;    // and the time it took
+} tunnel_compress_stats_t;
+
 class LcmTunnel {
  public:
   LcmTunnel(bool verbose,
@@ -100,6 +221,7 @@ class LcmTunnel {
 
   void send_to_remote(const void* data, uint32_t len, const char* lcm_channel);
   void send_to_remote(const lcm_recv_buf_t* rbuf, const char* lcm_channel);
+  void send_to_remote(TunnelLcmMessage* msg);
   bool match_regex(const char* channel);
   void init_regex(const char* channel);
 
@@ -114,9 +236,14 @@ class LcmTunnel {
                          uint32_t bytesInQueue);
   static int on_tcp_data(GIOChannel* source, GIOCondition cond,
                          void* user_data);
+  static int on_tcp_field(LcmTunnel* self, char* field, int field_size);
   static int on_udp_data(GIOChannel* source, GIOCondition cond,
                          void* user_data);
+  static int on_udp_datagram(LcmTunnel* self, uint8_t* datagram,
+                             int datagram_size);
   void publishLcmMessagesInBuf(int numBytes);
+  void publishLcmMessage(const char* lcm_channel, const uint8_t* data,
+                         int data_size, bool compressed);
 
   bool verbose;
 
@@ -149,17 +276,43 @@ class LcmTunnel {
   tunnel_state_t tunnel_state;
 
   int bytes_to_read;
-  int bytes_read;
+  bool recv_compressed;  // whether the TCP message being read is compressed
+  int bytes_read;  // bytes of TCP data in buf
+  int buf_offset;  // start of the field being read in buf
 
   // threaded sending stuff:
   bool stopSendThread;
   uint32_t bytesInQueue;
   uint32_t minBytesToSendImmediately;
   GThread* sendThread;
-  std::deque<TunnelLcmMessage*> sendQueue;
   GMutex* sendQueueLock;
   GCond* sendQueueCond;  // thread waits on this
-  bool flushImmediately;
+
+  // the send queue, split up by QoS class.  Protected by sendQueueLock
+  void initQos();
+  void clearQos();
+  tunnel_channel_t* qosChannel(const char* channel);
+  int64_t nextSendTime(int64_t flushTime, int64_t now);
+  uint32_t takeMessagesToSend(std::deque<TunnelLcmMessage*>& msgQueue,
+                              int64_t now);
+  std::vector<TunnelQosQueue*> qosQueues;  // in the order they are matched
+  std::vector<TunnelQosQueue*> qosOrder;   // in the order they are sent
+  GHashTable* qosChannels;  // channel name -> tunnel_channel_t
+
+  // compression, done by the send thread
+  // NOLINTNEXTLINE(runtime/references)
+  uint32_t compressMessages(std::deque<TunnelLcmMessage*>& msgQueue);
+  TunnelLcmMessage* compressMessage(TunnelLcmMessage* msg,
+                                    tunnel_compress_stats_t* stats);
+  void printCompressStats();
+  z_stream* deflate_stream;  // NULL until first used
+  GHashTable* compressStats;  // channel name -> tunnel_compress_stats_t
+
+  // decompression of received messages into inflate_buf
+  int inflateData(const uint8_t* data, int data_size);
+  z_stream* inflate_stream;  // NULL until first used
+  uint8_t* inflate_buf;
+  int inflate_buf_sz;
 
   // buffers to store incoming messages
   char* channel;
@@ -172,6 +325,7 @@ class LcmTunnel {
   GIOChannel* udp_ioc;
   guint udp_sid;
   uint32_t udp_send_seqno;
+  udp_recv_batch_t* udp_recv_batch;  // allocated on the first wakeup
 
   // stuff to keep track of received fragments
   char* recFlags;
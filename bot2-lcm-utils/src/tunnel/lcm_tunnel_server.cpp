@@ -58,6 +58,8 @@ void LcmTunnelServer::check_and_send_to_tunnels(const char* channel,
                                                 const void* data,
                                                 unsigned int len,
                                                 LcmTunnel* to_skip) {
+  // every tunnel that forwards the message shares one copy of it
+  TunnelLcmMessage* msg = NULL;
   for (std::list<LcmTunnel*>::iterator iter =
            LcmTunnelServer::clients_list.begin();
        iter != clients_list.end(); iter++) {
@@ -65,9 +67,20 @@ void LcmTunnelServer::check_and_send_to_tunnels(const char* channel,
       continue;
     }
     if ((*iter)->match_regex(channel)) {
-      (*iter)->send_to_remote(data, len, channel);
+      if (msg == NULL) {
+        lcm_recv_buf_t rbuf;
+        rbuf.data = (void*)data;
+        rbuf.data_size = len;
+        rbuf.recv_utime = g_get_real_time();
+        rbuf.lcm = lcm;
+        msg = new TunnelLcmMessage(&rbuf, channel);
+      }
+      (*iter)->send_to_remote(msg);
     }
   }
+  if (msg != NULL) {
+    msg->unref();
+  }
 }
 
 int LcmTunnelServer::initializeServer(tunnel_server_params_t* params_) {
@@ -68,6 +68,13 @@ BotParam* bot_param_new_from_server(lcm_t* lcm, int keep_updated);
  * BOT_PARAM_SERVER_NAME. If no parameters are received within 5seconds, returns
  * with an error.
  *
+ * If the param-server keeps a snapshot file on this host for this user, the
+ * params are first loaded from it. With keep_updated, they are returned
+ * without waiting, even if the param-server is not running any more, and the
+ * next update from the server confirms or replaces them. Without keep_updated,
+ * the server has to confirm them or send newer ones within the same time as
+ * above, or NULL is returned.
+ *
  * WARNING: This calls lcm_handle internally, so make sure that you create the
  * param_client BEFORE you subscribe with handlers that may use it!
  *
@@ -103,6 +110,39 @@ void bot_param_add_update_subscriber(BotParam* param,
                                      bot_param_update_handler_t* callback_func,
                                      void* user);
 
+/**
+ * bot_param_watch_handler_t
+ *
+ * Handler function template for a bot_param_watch() callback
+ *
+ * param: The BotParam structure, already holding the new values
+ * keys: The sorted keys under the watched prefix whose values were changed,
+ *       added or removed.  Only valid during the call.
+ * num_keys: The number of keys, at least one
+ * user: user data that was passed to bot_param_watch()
+ */
+typedef void(bot_param_watch_handler_t)(BotParam* param,
+                                        const char* const* keys, int num_keys,
+                                        int64_t utime, void* user);
+
+/**
+ * bot_param_watch
+ *
+ * add a callback handler to get called with the keys starting with prefix
+ * (e.g. "planner.") whose values were changed by an update from the
+ * param-server.  The changed keys are found once per update, by comparing
+ * the old and the new params, and the handler is not called for updates
+ * that leave all of its keys alone.  Changes made with the set functions of
+ * this BotParam are not reported.
+ *
+ * param: the BotParam structure that should have updates
+ * prefix: the start of the keys to watch, or NULL or "" for all keys
+ * callback_func: function to call with the changed keys
+ * user: user data to be passed to the function
+ */
+void bot_param_watch(BotParam* param, const char* prefix,
+                     bot_param_watch_handler_t* callback_func, void* user);
+
 /**
  * bot_param_new_from_file:
  * @param filename The name of the file.
@@ -160,6 +200,38 @@ BotParam* bot_param_new(void);
  */
 void bot_param_destroy(BotParam* param);
 
+/**
+ * bot_param_enable_snapshot_reads:
+ * @param param The configuration.
+ *
+ * Makes the getters of param read from an immutable copy of the params
+ * instead of taking the lock that they otherwise share with each other and
+ * with the handling of updates, so that threads reading params do not wait
+ * for one another.  A change to param, by an update from the server or a
+ * set function, marks the copy out of date, and the next read publishes a
+ * new copy, so that a burst of changes is copied only once.  A replaced copy
+ * is freed as soon as no getter and no handle from bot_param_get_snapshot()
+ * uses it any more.
+ *
+ * This makes the first read after a change slower, since it copies the
+ * params.  Snapshot reads stay enabled until param is destroyed.
+ */
+void bot_param_enable_snapshot_reads(BotParam* param);
+
+/**
+ * bot_param_get_snapshot:
+ * @param param The configuration.
+ *
+ * Returns a read-only handle to the params as they are now, which later
+ * updates leave untouched.  Useful to read several keys that have to be
+ * consistent with each other.  The getters can be used on it from any thread
+ * without locking, the set functions fail on it.  With snapshot reads enabled
+ * this takes a reference to the current copy instead of copying the params.
+ *
+ * @return A handle that must be released with bot_param_destroy().
+ */
+BotParam* bot_param_get_snapshot(BotParam* param);
+
 /**
  * bot_param_write:
  * @param param The configuration to write.
@@ -29,18 +29,25 @@
 
 #include <assert.h>
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <glib.h>
 #include <lcm/lcm.h>
+#include <zlib.h>
 
 #include <bot_core/lcm_util.h>
 
+#include "lcmtypes/bot_param_delta_t.h"
+#include "lcmtypes/bot_param_packed_update_t.h"
 #include "lcmtypes/bot_param_request_t.h"
 #include "lcmtypes/bot_param_update_t.h"
 #include "misc_utils.h"
@@ -53,35 +60,53 @@
 
 #define MAX_REFERENCES ((1LL << 60))
 
-typedef enum { ParserTypeFile, ParserTypeString } ParserType;
+// Minimum time between two snapshot requests triggered by missed deltas.
+#define SNAPSHOT_REQUEST_INTERVAL_USEC 250000
 
-typedef struct _Parser Parser;
-typedef int (*GetChFunc)(Parser*);
+#define SNAPSHOT_FILE_MAGIC "BOTPRMS1"
 
-struct _Parser {
-  ParserType type;
-  GetChFunc get_ch;
-  int extra_ch;
+// Layout of the start of a snapshot file.  It is followed by params_len bytes
+// of params, as written by bot_param_write_to_string(), and a terminating nul.
+typedef struct {
+  char magic[8];
+  int64_t server_id;
+  int64_t sequence_number;
+  int64_t params_len;
+} SnapshotFileHeader;
+
+// Size of the blocks that parsed elements and strings are allocated from.
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// Containers with at least this many children get a hash table to find
+// children by name while they are parsed.
+#define PARSE_HASH_MIN_CHILDREN 8
+
+// Memory for the elements and strings of a parsed tree.  Allocations are
+// never freed individually, the whole arena goes away with the tree.
+typedef struct _ParamArena ParamArena;
+struct _ParamArena {
+  ParamArena* next;
+  size_t used;
+  size_t size;
+  char data[];
 };
 
-typedef struct _ParserFile {
-  Parser p;
-  const char* filename;
-  FILE* file;
-  int row;
-  int col;
-  int in_comment;
-} ParserFile;
-
-typedef struct _ParserString {
-  Parser p;
+// Tokenizes a config held in memory, either a mapped file or a string.
+typedef struct _Parser {
+  const char* filename;  // NULL when parsing a string
   const char* string;
-  int length;
-  int ind;
+  size_t length;
+  size_t ind;
   int row;
   int col;
   int in_comment;
-} ParserString;
+  int extra_ch;
+
+  // Where the parsed elements and strings are allocated.
+  ParamArena** arena;
+  // The values of the assignment being parsed.
+  GPtrArray* values;
+} Parser;
 
 typedef enum {
   TokInvalid,
@@ -107,6 +132,10 @@ typedef enum {
   BotParamDataDouble
 } BotParamDataType;
 
+// Parts of an element that were allocated from the arena of its tree.
+#define ARENA_ELEMENT 1  // the element itself and its name
+#define ARENA_VALUES 2   // the values array and the values
+
 typedef struct _BotParamElement BotParamElement;
 struct _BotParamElement {
   BotParamType type;
@@ -117,15 +146,65 @@ struct _BotParamElement {
   BotParamElement* children;
   int num_values;
   char** values;
+
+  // The values cast by the typed getters.  Filled in on the first typed read
+  // of the element and dropped whenever its values change.  A type that some
+  // value does not cast to is flagged in cast_failed instead.
+  int* int_values;
+  int* boolean_values;
+  double* double_values;
+  unsigned cast_failed;
+
+  unsigned arena_flags;
 };
 
 struct _BotParam {
   BotParamElement* root;
+  // Memory of the parsed part of the tree under root.
+  ParamArena* arena;
   GMutex* lock;
   int64_t server_id;
   int64_t sequence_number;
+  // Set while the params are the ones loaded from a snapshot file and the
+  // param-server has not confirmed that they are current yet.
+  int from_snapshot;
 
   GList* update_callbacks;
+  GList* watches;
+
+  // Every element by its full dotted key, and the results of lookups that
+  // had to fall back to inheritance (including misses).  Built on the first
+  // lookup after the tree was parsed or swapped in.
+  GHashTable* index;
+  GHashTable* inherited;
+
+  // Used to ask the param-server for a full snapshot when a delta is missed.
+  lcm_t* lcm;
+  gchar* request_channel;
+  gchar* packed_request_channel;
+  int64_t last_request_utime;
+  // Id of the last param-server that answered a request for packed params.
+  // Until it is server_id, the text params are requested as well.
+  int64_t packed_server_id;
+
+  // With snapshot reads enabled, a frozen copy of the tree that the getters
+  // read without taking the lock.  Changes only mark it stale, and the next
+  // read publishes a new copy, so that a burst of changes is copied once.  A
+  // replaced copy is released once the readers that may still see it are
+  // done, and freed when no handle from bot_param_get_snapshot() refers to
+  // it either.
+  BotParam* published;
+  int published_stale;
+  // Readers of published count themselves in readers[read_epoch] while they
+  // read.  Publishing flips read_epoch and waits for the readers that came
+  // before.
+  int read_epoch;
+  int readers[2];
+
+  // Set on the copies made by new_snapshot(), which are never modified and
+  // are freed when ref_count drops to zero.
+  int frozen;
+  int ref_count;
 };
 
 typedef struct {
@@ -133,45 +212,79 @@ typedef struct {
   void* user;
 } update_handler_t;
 
+typedef struct {
+  gchar* prefix;
+  bot_param_watch_handler_t* callback_func;
+  void* user;
+} watch_handler_t;
+
 static BotParamElement* find_key(BotParamElement* el, const char* key,
                                  int inherit);
+static BotParamElement* lookup_key(BotParam* param, const char* key,
+                                   int inherit);
+static int set_element_value(BotParam* param, const char* key,
+                             const char* val);
+static void index_children(GHashTable* index, BotParamElement* el,
+                           const char* prefix);
+static void build_index(BotParam* param);
+
+static void* arena_alloc(ParamArena** arena, size_t size) {
+  size = (size + 7) & ~(size_t)7;
+  ParamArena* block = *arena;
+  if (block == NULL || block->used + size > block->size) {
+    size_t block_size = MAX(size, ARENA_BLOCK_SIZE);
+    block = malloc(sizeof(ParamArena) + block_size);
+    block->used = 0;
+    block->size = block_size;
+    block->next = *arena;
+    *arena = block;
+  }
+  void* ptr = block->data + block->used;
+  block->used += size;
+  return ptr;
+}
+
+static char* arena_strdup(ParamArena** arena, const char* str) {
+  size_t len = strlen(str) + 1;
+  char* copy = arena_alloc(arena, len);
+  memcpy(copy, str, len);
+  return copy;
+}
+
+static void arena_free(ParamArena* arena) {
+  while (arena) {
+    ParamArena* next = arena->next;
+    free(arena);
+    arena = next;
+  }
+}
 
 // Prints an error message, preceeded by useful context information from the
 // parser (i.e. line number).
 static int print_msg(Parser* p, char* format, ...) {
   va_list args;
-  if (p->type == ParserTypeFile) {
-    ParserFile* pf = (ParserFile*)p;
-    const char* fname = strrchr(pf->filename, '/');
+  const char* fname = "STRING_BUFFER";
+  if (p->filename) {
+    fname = strrchr(p->filename, '/');
     if (fname) {
       fname++;
     } else {
-      fname = pf->filename;
+      fname = p->filename;
     }
-    fprintf(stderr, "%s:%d ", fname, pf->row + 1);
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    return 0;
-  }
-  if (p->type == ParserTypeFile) {
-    ParserString* ps = (ParserString*)p;
-    fprintf(stderr, "%s:%d ", "STRING_BUFFER", ps->row + 1);
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    return 0;
   }
-  return -1;
+  fprintf(stderr, "%s:%d ", fname, p->row + 1);
+  va_start(args, format);
+  vfprintf(stderr, format, args);
+  va_end(args);
+  return 0;
 }
 
-// Get the next character from a file, while converting all forms of
+// Get the next character from the buffer, while converting all forms of
 // whitespace into plain spaces and stripping comments.
 //
 // Returns the next printable character on success, 0 on EOF, -1 on
 // error.
-static int get_ch_file(Parser* p) {
-  ParserFile* pf = (ParserFile*)p;
+static inline int get_ch(Parser* p) {
   int ch;
 
   // If a character has been put back with unget_ch, get it.
@@ -181,65 +294,27 @@ static int get_ch_file(Parser* p) {
     return ch;
   }
 
-  while ((ch = getc(pf->file)) != EOF) {
-    if (ch == '\n') {
-      pf->row++;
-      pf->col = 0;
-      pf->in_comment = 0;
-      return ' ';
-    }
-    if (ch == '#') {
-      pf->in_comment = 1;
-    }
-    if (pf->in_comment) {
+  while (p->ind < p->length) {
+    if (p->in_comment) {
+      const char* eol =
+          memchr(p->string + p->ind, '\n', p->length - p->ind);
+      p->ind = eol ? (size_t)(eol - p->string) : p->length;
+      p->in_comment = 0;
       continue;
     }
 
-    pf->col++;
-    if (isspace(ch)) {
-      return ' ';
-    }
-    if (!isprint(ch)) {
-      print_msg(p, "Error: Non-printable character 0x%02x\n", ch);
-      return -1;
-    }
-    return ch;
-  }
-  return 0;
-}
-
-// Get the next character from the string buffer, while converting all forms of
-// whitespace into plain spaces and stripping comments.
-//
-// Returns the next printable character on success, 0 on EOF, -1 on
-// error.
-static int get_ch_string(Parser* p) {
-  ParserString* ps = (ParserString*)p;
-  int ch;
-
-  // If a character has been put back with unget_ch, get it.
-  if (p->extra_ch) {
-    ch = p->extra_ch;
-    p->extra_ch = 0;
-    return ch;
-  }
-
-  while (ps->ind < ps->length) {
-    ch = ps->string[ps->ind++];
+    ch = (unsigned char)p->string[p->ind++];
     if (ch == '\n') {
-      ps->row++;
-      ps->col = 0;
-      ps->in_comment = 0;
+      p->row++;
+      p->col = 0;
       return ' ';
     }
     if (ch == '#') {
-      ps->in_comment = 1;
-    }
-    if (ps->in_comment) {
+      p->in_comment = 1;
       continue;
     }
 
-    ps->col++;
+    p->col++;
     if (isspace(ch)) {
       return ' ';
     }
@@ -273,7 +348,7 @@ static int get_token(Parser* p, BotParamToken* tok, char* str, int len) {
   *tok = TokInvalid;
 
   // Skip whitespace (all whitespace converted to ' ' already)
-  while ((ch = p->get_ch(p)) == ' ') {
+  while ((ch = get_ch(p)) == ' ') {
     continue;
   }
 
@@ -350,10 +425,26 @@ static int get_token(Parser* p, BotParamToken* tok, char* str, int len) {
     return -1;
   }
 
-  // Read the remaining text of a string, cast, or identifier
+  // Read the remaining text of a string, cast, or identifier.  Characters
+  // that get_ch() would return unchanged are copied straight from the buffer,
+  // everything else (and the end of the token) goes through get_ch().
   int prev_ch = 0;
+  while (!p->extra_ch && p->ind < p->length && c < len - 1) {
+    ch = (unsigned char)p->string[p->ind];
+    if (*tok == TokIdentifier) {
+      if (!isalnum(ch) && ch != '_' && ch != '-' && ch != '.' && ch != '+') {
+        break;
+      }
+    } else if (ch == end_ch || ch == '#' || !isprint(ch)) {
+      break;
+    }
+    p->ind++;
+    p->col++;
+    prev_ch = ch;
+    str[c++] = ch;
+  }
   while (1) {
-    ch = p->get_ch(p);
+    ch = get_ch(p);
     // An identifier is terminated as soon as we see a character which
     // itself cannot be part of an identifier.
     if (*tok == TokIdentifier && !isalnum(ch) && ch != '_' && ch != '-' &&
@@ -398,24 +489,95 @@ static BotParamElement* new_element(const char* name) {
   return el;
 }
 
+static void clear_casts(BotParamElement* el) {
+  free(el->int_values);
+  free(el->boolean_values);
+  free(el->double_values);
+  el->int_values = NULL;
+  el->boolean_values = NULL;
+  el->double_values = NULL;
+  el->cast_failed = 0;
+}
+
+static BotParamElement* arena_new_element(ParamArena** arena,
+                                          const char* name) {
+  BotParamElement* el = arena_alloc(arena, sizeof(BotParamElement));
+  memset(el, 0, sizeof(BotParamElement));
+  if (name) {
+    el->name = arena_strdup(arena, name);
+  }
+  el->data_type = BotParamDataString;
+  el->arena_flags = ARENA_ELEMENT;
+  return el;
+}
+
+// Frees everything of el and its children that was not allocated from the
+// arena of the tree.
 static void free_element(BotParamElement* el) {
-  free(el->name);
+  clear_casts(el);
   BotParamElement* child;
   BotParamElement* next;
   for (child = el->children; child; child = next) {
     next = child->next;
     free_element(child);
   }
+  if (!(el->arena_flags & ARENA_VALUES)) {
+    int i;
+    for (i = 0; i < el->num_values; i++) {
+      free(el->values[i]);
+    }
+    free(el->values);
+  }
+  if (!(el->arena_flags & ARENA_ELEMENT)) {
+    free(el->name);
+    free(el);
+  }
+}
+
+// Moves el's values out of the arena so that they can be changed.
+static void own_values(BotParamElement* el) {
+  if (!(el->arena_flags & ARENA_VALUES)) {
+    return;
+  }
+  char** values = malloc((el->num_values ?: 1) * sizeof(char*));
   int i;
   for (i = 0; i < el->num_values; i++) {
-    free(el->values[i]);
+    values[i] = strdup(el->values[i]);
+  }
+  el->values = values;
+  el->arena_flags &= ~ARENA_VALUES;
+}
+
+// Returns a deep copy of el and all of its children, allocated from arena.
+static BotParamElement* copy_element(const BotParamElement* el,
+                                     BotParamElement* parent,
+                                     ParamArena** arena) {
+  BotParamElement* copy = arena_new_element(arena, el->name);
+  copy->type = el->type;
+  copy->data_type = el->data_type;
+  copy->parent = parent;
+
+  BotParamElement** nptr = &copy->children;
+  const BotParamElement* child;
+  for (child = el->children; child; child = child->next) {
+    *nptr = copy_element(child, copy, arena);
+    nptr = &((*nptr)->next);
+  }
+
+  if (el->num_values > 0) {
+    copy->values = arena_alloc(arena, el->num_values * sizeof(char*));
+    int i;
+    for (i = 0; i < el->num_values; i++) {
+      copy->values[i] = arena_strdup(arena, el->values[i]);
+    }
+    copy->arena_flags |= ARENA_VALUES;
   }
-  free(el->values);
-  free(el);
+  copy->num_values = el->num_values;
+  return copy;
 }
 
 // Appends child to the list of el's children.
-static int add_child(Parser* p, BotParamElement* el, BotParamElement* child) {
+static int add_child(BotParamElement* el, BotParamElement* child) {
   BotParamElement** nptr;
   for (nptr = &el->children; *nptr != NULL; nptr = &((*nptr)->next)) {
     continue;
@@ -427,7 +589,9 @@ static int add_child(Parser* p, BotParamElement* el, BotParamElement* child) {
 }
 
 // Appends str to the list of el's values.
-static int add_value(Parser* p, BotParamElement* el, const char* str) {
+static int add_value(BotParamElement* el, const char* str) {
+  clear_casts(el);
+  own_values(el);
   int n = el->num_values;
   el->values = realloc(el->values, (n + 1) * sizeof(char*));
   el->values[n] = strdup(str);
@@ -435,8 +599,32 @@ static int add_value(Parser* p, BotParamElement* el, const char* str) {
   return 0;
 }
 
+// Appends the values collected by the parser to the list of el's values.
+static void add_parsed_values(Parser* p, BotParamElement* el) {
+  clear_casts(el);
+  int n = el->num_values + p->values->len;
+  char** values = arena_alloc(p->arena, n * sizeof(char*));
+  int i;
+  for (i = 0; i < el->num_values; i++) {
+    if (el->arena_flags & ARENA_VALUES) {
+      values[i] = el->values[i];
+    } else {
+      values[i] = arena_strdup(p->arena, el->values[i]);
+      free(el->values[i]);
+    }
+  }
+  if (!(el->arena_flags & ARENA_VALUES)) {
+    free(el->values);
+  }
+  memcpy(values + el->num_values, p->values->pdata,
+         p->values->len * sizeof(char*));
+  el->values = values;
+  el->num_values = n;
+  el->arena_flags |= ARENA_VALUES;
+}
+
 // Parses the interior portion of an array (the part after the leading "["),
-// adding any values to the array's list of values.  Terminates when the
+// adding any values to the parser's list of values.  Terminates when the
 // trailing "]" is found.
 static int parse_array(Parser* p, BotParamElement* el) {
   BotParamToken tok;
@@ -448,7 +636,7 @@ static int parse_array(Parser* p, BotParamElement* el) {
     }
 
     if (tok == TokIdentifier || tok == TokString) {
-      add_value(p, el, str);
+      g_ptr_array_add(p->values, arena_strdup(p->arena, str));
     } else if (tok == TokCloseArray) {
       return 0;
     } else {
@@ -487,6 +675,8 @@ static int parse_right_side(Parser* p, BotParamElement* el) {
   BotParamToken tok;
   char str[256];
 
+  g_ptr_array_set_size(p->values, 0);
+
   if (get_token(p, &tok, str, sizeof(str)) != 0) {
     goto fail;
   }
@@ -500,7 +690,7 @@ static int parse_right_side(Parser* p, BotParamElement* el) {
   }
 
   if (tok == TokIdentifier || tok == TokString) {
-    add_value(p, el, str);
+    g_ptr_array_add(p->values, arena_strdup(p->arena, str));
   } else if (tok == TokOpenArray) {
     if (parse_array(p, el) < 0) {
       goto fail;
@@ -522,6 +712,7 @@ static int parse_right_side(Parser* p, BotParamElement* el) {
     goto fail;
   }
 
+  add_parsed_values(p, el);
   return 0;
 
 fail:
@@ -539,35 +730,71 @@ static int parse_container(Parser* p, BotParamElement* cont,
   BotParamElement* child = NULL;
   int child_exists = 0;
 
+  // The last child, and the children by name once there are enough of them,
+  // so that neither appending nor finding a child has to walk the list.
+  BotParamElement* last = NULL;
+  GHashTable* by_name = NULL;
+  int num_children = 0;
+  for (last = cont->children; last && last->next; last = last->next) {
+    num_children++;
+  }
+  if (last) {
+    num_children++;
+  }
+
   while (get_token(p, &tok, str, sizeof(str)) == 0) {
+    if (!by_name && num_children >= PARSE_HASH_MIN_CHILDREN) {
+      by_name = g_hash_table_new(g_str_hash, g_str_equal);
+      BotParamElement* el;
+      for (el = cont->children; el; el = el->next) {
+        g_hash_table_insert(by_name, el->name, el);
+      }
+    }
+
     if (!child && tok == TokIdentifier) {
-      BotParamElement* existing_el = find_key(cont, str, 0);
+      BotParamElement* existing_el;
+      if (by_name && !strchr(str, '.')) {
+        existing_el = g_hash_table_lookup(by_name, str);
+      } else {
+        existing_el = find_key(cont, str, 0);
+      }
       if (NULL == existing_el) {
-        child = new_element(str);
+        child = arena_new_element(p->arena, str);
         child_exists = 0;
       } else {
         child = existing_el;
         child_exists = 1;
       }
-    } else if (child && tok == TokAssign) {
-      child->type = BotParamArray;
-      if (parse_right_side(p, child) < 0) {
-        goto fail;
-      }
-      if (!child_exists) {
-        add_child(p, cont, child);
-      }
-      child = NULL;
-    } else if (child && tok == TokOpenStruct) {
-      child->type = BotParamContainer;
-      if (parse_container(p, child, TokCloseStruct) < 0) {
-        goto fail;
+    } else if (child && (tok == TokAssign || tok == TokOpenStruct)) {
+      if (tok == TokAssign) {
+        child->type = BotParamArray;
+        if (parse_right_side(p, child) < 0) {
+          goto fail;
+        }
+      } else {
+        child->type = BotParamContainer;
+        if (parse_container(p, child, TokCloseStruct) < 0) {
+          goto fail;
+        }
       }
       if (!child_exists) {
-        add_child(p, cont, child);
+        child->parent = cont;
+        if (last) {
+          last->next = child;
+        } else {
+          cont->children = child;
+        }
+        last = child;
+        num_children++;
+        if (by_name) {
+          g_hash_table_insert(by_name, child->name, child);
+        }
       }
       child = NULL;
     } else if (!child && tok == end_token) {
+      if (by_name) {
+        g_hash_table_destroy(by_name);
+      }
       return 0;
     } else {
       print_msg(p, "Error: unexpected token \"%s\"\n", str);
@@ -576,9 +803,12 @@ static int parse_container(Parser* p, BotParamElement* cont,
   }
 
 fail:
-  if (child) {
+  if (child && !child_exists) {
     free_element(child);
   }
+  if (by_name) {
+    g_hash_table_destroy(by_name);
+  }
   return -1;
 }
 
@@ -711,19 +941,185 @@ static void _update_handler_t_destroy(void* data, void* user) {
   g_slice_free(update_handler_t, data);
 }
 
+static void _watch_handler_t_destroy(void* data, void* user) {
+  watch_handler_t* wh = (watch_handler_t*)data;
+  g_free(wh->prefix);
+  g_slice_free(watch_handler_t, wh);
+}
+
+static void invalidate_index(BotParam* param) {
+  if (param->index != NULL) {
+    g_hash_table_destroy(param->index);
+    if (param->inherited != NULL) {
+      g_hash_table_destroy(param->inherited);
+    }
+    param->index = NULL;
+    param->inherited = NULL;
+  }
+}
+
+// Exchanges the parse trees (with their arenas and indices) of param and
+// new_params.  Must be called with param->lock held.
+static void swap_root(BotParam* param, BotParam* new_params) {
+  BotParamElement* root = new_params->root;
+  new_params->root = param->root;
+  param->root = root;
+
+  ParamArena* arena = new_params->arena;
+  new_params->arena = param->arena;
+  param->arena = arena;
+
+  GHashTable* index = new_params->index;
+  GHashTable* inherited = new_params->inherited;
+  new_params->index = param->index;
+  new_params->inherited = param->inherited;
+  param->index = index;
+  param->inherited = inherited;
+}
+
 void bot_param_destroy(BotParam* param) {
+  if (param->frozen && !g_atomic_int_dec_and_test(&param->ref_count)) {
+    return;
+  }
+  if (param->published != NULL) {
+    bot_param_destroy(param->published);
+  }
   free_element(param->root);
+  arena_free(param->arena);
+  invalidate_index(param);
   g_mutex_clear(param->lock);
   g_free(param->lock);
+  g_free(param->request_channel);
+  g_free(param->packed_request_channel);
 
   if (param->update_callbacks != NULL) {
     g_list_foreach(param->update_callbacks, _update_handler_t_destroy, NULL);
     g_list_free(param->update_callbacks);
   }
+  if (param->watches != NULL) {
+    g_list_foreach(param->watches, _watch_handler_t_destroy, NULL);
+    g_list_free(param->watches);
+  }
 
   free(param);
 }
 
+// Returns a frozen copy of the tree of param, with one reference for the
+// caller.  Must be called with param->lock held.
+static BotParam* new_snapshot(BotParam* param) {
+  BotParam* snapshot = _bot_param_new();
+  free_element(snapshot->root);
+  snapshot->root = copy_element(param->root, NULL, &snapshot->arena);
+  snapshot->server_id = param->server_id;
+  snapshot->sequence_number = param->sequence_number;
+  snapshot->index =
+      g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+  index_children(snapshot->index, snapshot->root, NULL);
+  snapshot->frozen = 1;
+  snapshot->ref_count = 1;
+  return snapshot;
+}
+
+// Replaces the snapshot that the getters read with a copy of the current tree
+// of param.  Must be called with param->lock held, with snapshot reads
+// enabled.
+static void publish(BotParam* param) {
+  BotParam* old = param->published;
+  g_atomic_pointer_set(&param->published, new_snapshot(param));
+  g_atomic_int_set(&param->published_stale, 0);
+
+  // Readers that counted themselves before the flip may still be reading the
+  // old snapshot.  The ones after it see the new one.
+  int epoch = param->read_epoch;
+  g_atomic_int_set(&param->read_epoch, !epoch);
+  while (g_atomic_int_get(&param->readers[epoch]) > 0) {
+    g_thread_yield();
+  }
+  bot_param_destroy(old);
+}
+
+// Marks the snapshot that the getters read as out of date, if snapshot reads
+// are enabled.  Must be called with param->lock held after every change to
+// the tree.
+static void invalidate_published(BotParam* param) {
+  if (param->published != NULL) {
+    g_atomic_int_set(&param->published_stale, 1);
+  }
+}
+
+#define READ_LOCKED -1
+#define READ_FROZEN -2
+
+// Starts a read of the tree of param, and returns the params to read it from:
+// param itself with its lock held, or the snapshot published for it.  Pass
+// the slot to end_read() when done.
+static BotParam* begin_read(BotParam* param, int* slot) {
+  if (param->frozen) {
+    *slot = READ_FROZEN;
+    return param;
+  }
+  if (g_atomic_pointer_get(&param->published) == NULL) {
+    g_mutex_lock(param->lock);
+    *slot = READ_LOCKED;
+    return param;
+  }
+  if (g_atomic_int_get(&param->published_stale)) {
+    g_mutex_lock(param->lock);
+    if (param->published_stale) {
+      publish(param);
+    }
+    g_mutex_unlock(param->lock);
+  }
+  for (;;) {
+    int epoch = g_atomic_int_get(&param->read_epoch);
+    g_atomic_int_inc(&param->readers[epoch]);
+    if (g_atomic_int_get(&param->read_epoch) == epoch) {
+      *slot = epoch;
+      return g_atomic_pointer_get(&param->published);
+    }
+    // raced with publish(), which may not wait for us
+    g_atomic_int_add(&param->readers[epoch], -1);
+  }
+}
+
+static void end_read(BotParam* param, int slot) {
+  if (slot == READ_LOCKED) {
+    g_mutex_unlock(param->lock);
+  } else if (slot != READ_FROZEN) {
+    g_atomic_int_add(&param->readers[slot], -1);
+  }
+}
+
+void bot_param_enable_snapshot_reads(BotParam* param) {
+  if (param->frozen) {
+    return;
+  }
+  g_mutex_lock(param->lock);
+  if (param->published == NULL) {
+    g_atomic_pointer_set(&param->published, new_snapshot(param));
+  }
+  g_mutex_unlock(param->lock);
+}
+
+BotParam* bot_param_get_snapshot(BotParam* param) {
+  BotParam* snapshot;
+  if (param->frozen) {
+    snapshot = param;
+    g_atomic_int_inc(&snapshot->ref_count);
+    return snapshot;
+  }
+  int slot;
+  BotParam* params = begin_read(param, &slot);
+  if (slot == READ_LOCKED) {
+    snapshot = new_snapshot(params);
+  } else {
+    snapshot = params;
+    g_atomic_int_inc(&snapshot->ref_count);
+  }
+  end_read(param, slot);
+  return snapshot;
+}
+
 void bot_param_add_update_subscriber(BotParam* param,
                                      bot_param_update_handler_t* callback_func,
                                      void* user) {
@@ -744,129 +1140,463 @@ static void _dispatch_update_callbacks(BotParam* old_param, BotParam* new_param,
   }
 }
 
-static void _on_param_update(const lcm_recv_buf_t* rbuf, const char* channel,
-                             const bot_param_update_t* msg, void* user) {
-  BotParam* param = (BotParam*)user;
-  if (param->server_id <= 0) {
-    param->server_id = msg->server_id;
-    param->sequence_number = msg->sequence_number - 1;
+void bot_param_watch(BotParam* param, const char* prefix,
+                     bot_param_watch_handler_t* callback_func, void* user) {
+  watch_handler_t* wh = g_slice_new0(watch_handler_t);
+  wh->prefix = g_strdup(prefix ? prefix : "");
+  wh->callback_func = callback_func;
+  wh->user = user;
+  g_mutex_lock(param->lock);
+  param->watches = g_list_append(param->watches, wh);
+  g_mutex_unlock(param->lock);
+}
+
+static int values_equal(const BotParamElement* a, const BotParamElement* b) {
+  if (a->num_values != b->num_values) {
+    return 0;
   }
-  if (msg->server_id == param->server_id) {
-    if (msg->sequence_number <= param->sequence_number) {
-      return;
+  int i;
+  for (i = 0; i < a->num_values; i++) {
+    if (strcmp(a->values[i], b->values[i])) {
+      return 0;
     }
-  } else {
-    fprintf(stderr,
-            "WARNING: Got params from a different server! Ignoring them\n");
-    return;
-  }
-
-  BotParam* new_params =
-      bot_param_new_from_string(msg->params, strlen(msg->params));
-  if (new_params == NULL) {
-    fprintf(stderr, "WARNING: Could not parse params from the server!\n");
-    return;
   }
-
-  _dispatch_update_callbacks(param, new_params, rbuf->recv_utime);
-
-  // swap the root;
-  g_mutex_lock(param->lock);
-  param->sequence_number = msg->sequence_number;
-  BotParamElement* root = new_params->root;
-  new_params->root = param->root;
-  param->root = root;
-  bot_param_destroy(new_params);
-  g_mutex_unlock(param->lock);
+  return 1;
 }
 
-BotParam* bot_param_new_from_server(lcm_t* lcm, int keep_updated) {
-  BotParam* param = bot_param_new_from_named_server(lcm, NULL, keep_updated);
-  return param;
+static int compare_keys(const void* a, const void* b) {
+  return strcmp(*(char* const*)a, *(char* const*)b);
 }
 
-BotParam* bot_param_new_from_named_server(lcm_t* lcm, const char* server_name,
-                                          int keep_updated) {
-  BotParam* param = _bot_param_new();
+// Returns the sorted keys of the values that were changed, added or removed
+// between old_params and new_params.  Must be called with old_params->lock
+// held.
+static GPtrArray* diff_keys(BotParam* old_params, BotParam* new_params) {
+  build_index(old_params);
+  build_index(new_params);
+  GPtrArray* changed = g_ptr_array_new_with_free_func(g_free);
 
-  const char* param_prefix = server_name;
-  if (!param_prefix) {
-    param_prefix = getenv("BOT_PARAM_SERVER_NAME");
+  GHashTableIter iter;
+  gpointer key;
+  gpointer value;
+  g_hash_table_iter_init(&iter, old_params->index);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    BotParamElement* el = (BotParamElement*)value;
+    if (el->type != BotParamArray) {
+      continue;
+    }
+    BotParamElement* new_el = g_hash_table_lookup(new_params->index, key);
+    if (new_el == NULL || new_el->type != BotParamArray ||
+        !values_equal(el, new_el)) {
+      g_ptr_array_add(changed, g_strdup(key));
+    }
   }
-  gchar* update_channel = update_channel =
-      g_strconcat(param_prefix ?: "", BOT_PARAM_UPDATE_CHANNEL, NULL);
-  gchar* request_channel = request_channel =
-      g_strconcat(param_prefix ?: "", BOT_PARAM_REQUEST_CHANNEL, NULL);
-
-  bot_param_update_t_subscription_t* sub = bot_param_update_t_subscribe(
-      lcm, update_channel, _on_param_update, (void*)param);
-
-  // TODO(ashuang): is there a way to be sure nothing else is subscribed???
-  int64_t utime_start = _timestamp_now();
-  int64_t last_print_utime = -1;
-  while ((_timestamp_now() - utime_start) < 3e6) {
-    bot_param_request_t req;
-    req.utime = _timestamp_now();
-    bot_param_request_t_publish(lcm, request_channel, &req);
 
-    lcm_sleep(lcm, .25);
-    if (param->root->children != NULL) {
-      break;
+  g_hash_table_iter_init(&iter, new_params->index);
+  while (g_hash_table_iter_next(&iter, &key, &value)) {
+    BotParamElement* el = (BotParamElement*)value;
+    if (el->type != BotParamArray) {
+      continue;
     }
-    int64_t now = _timestamp_now();
-    if (now - utime_start > 5e5) {
-      if (last_print_utime < 0) {
-        fprintf(stderr,
-                "bot_param waiting to get parameters from param-server...");
-        last_print_utime = now;
-      } else if (now - last_print_utime > 5e5) {
-        fprintf(stderr, ".");
-        last_print_utime = now;
-      }
+    BotParamElement* old_el = g_hash_table_lookup(old_params->index, key);
+    if (old_el == NULL || old_el->type != BotParamArray) {
+      g_ptr_array_add(changed, g_strdup(key));
     }
   }
-  g_free(update_channel);
-  g_free(request_channel);
 
-  if (last_print_utime > 0) {
-    fprintf(stderr, "\n");
-  }
-  if (param->root->children == NULL) {
-    fprintf(stderr,
-            "WARNING: bot_param could not get parameters from the "
-            "param-server!\n Did you forget to start one?\n");
-    return NULL;
+  g_ptr_array_sort(changed, compare_keys);
+  return changed;
+}
+
+// Returns the sorted keys of the entries of msg that change a value of param
+// when applied.  Must be called with param->lock held.
+static GPtrArray* delta_keys(BotParam* param, const bot_param_delta_t* msg) {
+  GPtrArray* changed = g_ptr_array_new_with_free_func(g_free);
+  int i;
+  for (i = 0; i < msg->numEntries; i++) {
+    const char* key = msg->entries[i].key;
+    const char* val = msg->entries[i].value;
+    BotParamElement* el = lookup_key(param, key, 0);
+    if (el != NULL && (el->type != BotParamArray ||
+                       (el->num_values > 0 && !strcmp(el->values[0], val)))) {
+      continue;
+    }
+    g_ptr_array_add(changed, g_strdup(key));
   }
 
-  if (!keep_updated) {
-    bot_param_update_t_unsubscribe(lcm, sub);
-    param->server_id = -1;
+  g_ptr_array_sort(changed, compare_keys);
+  // a key may be set more than once by one delta
+  for (i = (int)changed->len - 1; i > 0; i--) {
+    if (!strcmp(changed->pdata[i], changed->pdata[i - 1])) {
+      g_ptr_array_remove_index(changed, i);
+    }
   }
-  return param;
+  return changed;
 }
 
-static BotParam* _new_from_file(const char* filename) {
-  ParserFile pf;
-  FILE* f = fopen(filename, "r");
-  if (f == NULL) {
-    err("could not open param file: %s\n", filename);
-    return NULL;
+// Calls every watch with the changed keys under its prefix, if there are any.
+// Frees changed.
+static void _dispatch_watches(BotParam* param, GPtrArray* changed,
+                              int64_t utime) {
+  const char** keys = g_new(const char*, changed->len + 1);
+  GList* p = param->watches;
+  for (; p != NULL; p = g_list_next(p)) {
+    watch_handler_t* wh = (watch_handler_t*)p->data;
+    int num_keys = 0;
+    guint i;
+    for (i = 0; i < changed->len; i++) {
+      if (g_str_has_prefix(changed->pdata[i], wh->prefix)) {
+        keys[num_keys++] = changed->pdata[i];
+      }
+    }
+    if (num_keys > 0) {
+      wh->callback_func(param, keys, num_keys, utime, wh->user);
+    }
   }
+  g_free(keys);
+  g_ptr_array_free(changed, TRUE);
+}
 
-  memset(&pf, 0, sizeof(ParserFile));
-  pf.p.get_ch = get_ch_file;
-  pf.p.type = ParserTypeFile;
-  pf.file = f;
-  pf.filename = filename;
+// Returns whether version sequence_number of the params published by
+// server_id should replace the current ones.
+static int _accept_update(BotParam* param, int64_t server_id,
+                          int32_t sequence_number) {
+  if (param->server_id <= 0 ||
+      (param->from_snapshot && server_id != param->server_id)) {
+    param->server_id = server_id;
+    param->sequence_number = sequence_number - 1;
+  }
+  param->from_snapshot = 0;
+  if (server_id == param->server_id) {
+    if (sequence_number <= param->sequence_number) {
+      return 0;
+    }
+  } else {
+    fprintf(stderr,
+            "WARNING: Got params from a different server! Ignoring them\n");
+    return 0;
+  }
+  return 1;
+}
+
+// Makes new_params version sequence_number of the params, and tells the
+// update callbacks and the watches.  Frees new_params.
+static void _apply_update(BotParam* param, BotParam* new_params,
+                          int32_t sequence_number, int64_t utime) {
+  _dispatch_update_callbacks(param, new_params, utime);
+
+  // swap the root;
+  GPtrArray* changed = NULL;
+  g_mutex_lock(param->lock);
+  if (param->watches != NULL) {
+    changed = diff_keys(param, new_params);
+  }
+  param->sequence_number = sequence_number;
+  swap_root(param, new_params);
+  bot_param_destroy(new_params);
+  invalidate_published(param);
+  g_mutex_unlock(param->lock);
+
+  if (changed != NULL) {
+    _dispatch_watches(param, changed, utime);
+  }
+}
+
+static void _on_param_update(const lcm_recv_buf_t* rbuf, const char* channel,
+                             const bot_param_update_t* msg, void* user) {
+  BotParam* param = (BotParam*)user;
+  if (!_accept_update(param, msg->server_id, msg->sequence_number)) {
+    return;
+  }
+
+  BotParam* new_params =
+      bot_param_new_from_string(msg->params, strlen(msg->params));
+  if (new_params == NULL) {
+    fprintf(stderr, "WARNING: Could not parse params from the server!\n");
+    return;
+  }
+  _apply_update(param, new_params, msg->sequence_number, rbuf->recv_utime);
+}
+
+static void _on_param_packed_update(const lcm_recv_buf_t* rbuf,
+                                    const char* channel,
+                                    const bot_param_packed_update_t* msg,
+                                    void* user) {
+  BotParam* param = (BotParam*)user;
+  int accept = _accept_update(param, msg->server_id, msg->sequence_number);
+  if (msg->server_id == param->server_id) {
+    param->packed_server_id = msg->server_id;
+  }
+  if (!accept) {
+    return;
+  }
+
+  BotParam* new_params = bot_param_new_from_packed(
+      msg->data, msg->length, msg->size,
+      msg->encoding & BOT_PARAM_PACKED_UPDATE_T_ENCODING_ZLIB);
+  if (new_params == NULL) {
+    fprintf(stderr, "WARNING: Could not decode params from the server!\n");
+    return;
+  }
+  _apply_update(param, new_params, msg->sequence_number, rbuf->recv_utime);
+}
+
+// Asks for the full params, answered by the param-server server_id.
+static void _request_snapshot(BotParam* param, int64_t server_id) {
+  int64_t now = _timestamp_now();
+  if (param->lcm == NULL ||
+      now - param->last_request_utime < SNAPSHOT_REQUEST_INTERVAL_USEC) {
+    return;
+  }
+  param->last_request_utime = now;
+
+  // Until that param-server is known to send packed params, ask for the text
+  // ones as well.
+  bot_param_request_t req;
+  req.utime = now;
+  bot_param_request_t_publish(param->lcm, param->packed_request_channel, &req);
+  if (param->packed_server_id != server_id) {
+    bot_param_request_t_publish(param->lcm, param->request_channel, &req);
+  }
+}
+
+static void _on_param_delta(const lcm_recv_buf_t* rbuf, const char* channel,
+                            const bot_param_delta_t* msg, void* user) {
+  BotParam* param = (BotParam*)user;
+  if (param->server_id <= 0) {
+    // no snapshot to apply the delta to yet
+    return;
+  }
+  if (msg->server_id != param->server_id) {
+    if (param->from_snapshot) {
+      // the snapshot file was left behind by an earlier param-server
+      _request_snapshot(param, msg->server_id);
+    } else {
+      fprintf(stderr,
+              "WARNING: Got params from a different server! Ignoring them\n");
+    }
+    return;
+  }
+  if (msg->sequence_number <= param->sequence_number) {
+    param->from_snapshot = 0;
+    return;
+  }
+  if (msg->base_sequence_number != param->sequence_number) {
+    // missed at least one delta, the next full snapshot will catch us up
+    _request_snapshot(param, msg->server_id);
+    return;
+  }
+  param->from_snapshot = 0;
+
+  int i;
+  GPtrArray* changed = NULL;
+  if (param->update_callbacks == NULL) {
+    g_mutex_lock(param->lock);
+    if (param->watches != NULL) {
+      changed = delta_keys(param, msg);
+    }
+    for (i = 0; i < msg->numEntries; i++) {
+      set_element_value(param, msg->entries[i].key, msg->entries[i].value);
+    }
+    param->sequence_number = msg->sequence_number;
+    invalidate_published(param);
+    g_mutex_unlock(param->lock);
+
+    if (changed != NULL) {
+      _dispatch_watches(param, changed, rbuf->recv_utime);
+    }
+    return;
+  }
+
+  // The update callbacks get to compare the old and the new params, so patch
+  // a copy and swap it in afterwards.
+  BotParam* new_params = _bot_param_new();
+  free_element(new_params->root);
+  g_mutex_lock(param->lock);
+  if (param->watches != NULL) {
+    changed = delta_keys(param, msg);
+  }
+  new_params->root = copy_element(param->root, NULL, &new_params->arena);
+  g_mutex_unlock(param->lock);
+  for (i = 0; i < msg->numEntries; i++) {
+    set_element_value(new_params, msg->entries[i].key, msg->entries[i].value);
+  }
+
+  _dispatch_update_callbacks(param, new_params, rbuf->recv_utime);
+
+  // swap the root;
+  g_mutex_lock(param->lock);
+  param->sequence_number = msg->sequence_number;
+  swap_root(param, new_params);
+  bot_param_destroy(new_params);
+  invalidate_published(param);
+  g_mutex_unlock(param->lock);
+
+  if (changed != NULL) {
+    _dispatch_watches(param, changed, rbuf->recv_utime);
+  }
+}
+
+BotParam* bot_param_new_from_server(lcm_t* lcm, int keep_updated) {
+  BotParam* param = bot_param_new_from_named_server(lcm, NULL, keep_updated);
+  return param;
+}
+
+BotParam* bot_param_new_from_named_server(lcm_t* lcm, const char* server_name,
+                                          int keep_updated) {
+  BotParam* param = _bot_param_new();
+
+  const char* param_prefix = server_name;
+  if (!param_prefix) {
+    param_prefix = getenv("BOT_PARAM_SERVER_NAME");
+  }
+  gchar* update_channel = update_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_UPDATE_CHANNEL, NULL);
+  gchar* request_channel = request_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_REQUEST_CHANNEL, NULL);
+  gchar* delta_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_DELTA_CHANNEL, NULL);
+  gchar* packed_update_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_UPDATE_PACKED_CHANNEL, NULL);
+  gchar* packed_request_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_REQUEST_PACKED_CHANNEL, NULL);
+
+  bot_param_update_t_subscription_t* sub = bot_param_update_t_subscribe(
+      lcm, update_channel, _on_param_update, (void*)param);
+  bot_param_packed_update_t_subscription_t* packed_sub =
+      bot_param_packed_update_t_subscribe(lcm, packed_update_channel,
+                                          _on_param_packed_update,
+                                          (void*)param);
+  bot_param_delta_t_subscription_t* delta_sub = bot_param_delta_t_subscribe(
+      lcm, delta_channel, _on_param_delta, (void*)param);
+
+  // Start from the snapshot file kept by the param-server if there is one.
+  // Its contents get confirmed or replaced by the next update from the
+  // server.  A client that keeps updated can use them until then, the others
+  // wait for it like without a snapshot, since nothing would correct them.
+  char* snapshot_filename = bot_param_get_snapshot_filename(server_name);
+  BotParam* snapshot = NULL;
+  if (snapshot_filename != NULL) {
+    snapshot = bot_param_new_from_snapshot_file(snapshot_filename);
+    g_free(snapshot_filename);
+  }
+  if (snapshot != NULL && snapshot->root->children != NULL) {
+    swap_root(param, snapshot);
+    param->server_id = snapshot->server_id;
+    param->sequence_number = snapshot->sequence_number;
+    param->from_snapshot = 1;
+  }
+  int wait = !param->from_snapshot || !keep_updated;
+  if (snapshot != NULL) {
+    bot_param_destroy(snapshot);
+  }
+  if (!wait) {
+    // the server that wrote the snapshot may be gone, and the one running now
+    // may be older and only answer text requests
+    bot_param_request_t req;
+    req.utime = _timestamp_now();
+    bot_param_request_t_publish(lcm, packed_request_channel, &req);
+    bot_param_request_t_publish(lcm, request_channel, &req);
+  }
+
+  // TODO(ashuang): is there a way to be sure nothing else is subscribed???
+  int64_t utime_start = _timestamp_now();
+  int64_t last_print_utime = -1;
+  int num_requests = 0;
+  while (wait && (_timestamp_now() - utime_start) < 3e6) {
+    // Ask for the packed params, and from the second try on also for the
+    // text ones, which are all that a param-server older than this client
+    // sends.
+    bot_param_request_t req;
+    req.utime = _timestamp_now();
+    bot_param_request_t_publish(lcm, packed_request_channel, &req);
+    if (num_requests++ > 0) {
+      bot_param_request_t_publish(lcm, request_channel, &req);
+    }
+
+    lcm_sleep(lcm, .25);
+    if (param->root->children != NULL && !param->from_snapshot) {
+      break;
+    }
+    int64_t now = _timestamp_now();
+    if (now - utime_start > 5e5) {
+      if (last_print_utime < 0) {
+        fprintf(stderr,
+                "bot_param waiting to get parameters from param-server...");
+        last_print_utime = now;
+      } else if (now - last_print_utime > 5e5) {
+        fprintf(stderr, ".");
+        last_print_utime = now;
+      }
+    }
+  }
+  g_free(update_channel);
+  g_free(delta_channel);
+  g_free(packed_update_channel);
+
+  if (last_print_utime > 0) {
+    fprintf(stderr, "\n");
+  }
+  if (param->root->children == NULL || (wait && param->from_snapshot)) {
+    fprintf(stderr,
+            "WARNING: bot_param could not get parameters from the "
+            "param-server!\n Did you forget to start one?\n");
+    g_free(request_channel);
+    g_free(packed_request_channel);
+    return NULL;
+  }
+
+  if (!keep_updated) {
+    bot_param_update_t_unsubscribe(lcm, sub);
+    bot_param_packed_update_t_unsubscribe(lcm, packed_sub);
+    bot_param_delta_t_unsubscribe(lcm, delta_sub);
+    param->server_id = -1;
+    g_free(request_channel);
+    g_free(packed_request_channel);
+  } else {
+    param->lcm = lcm;
+    param->request_channel = request_channel;
+    param->packed_request_channel = packed_request_channel;
+  }
+  return param;
+}
+
+// Parses length bytes of string.  filename is only used for error messages,
+// and is NULL if the string was not read from a file.
+static BotParam* _new_from_buffer(const char* string, size_t length,
+                                  const char* filename) {
+  Parser p;
+  memset(&p, 0, sizeof(Parser));
+  p.filename = filename;
+  p.string = string;
+  p.length = length;
+  p.values = g_ptr_array_new();
 
   BotParam* param = _bot_param_new();
-  if (parse_container(&pf.p, param->root, TokEOF) < 0) {
+  p.arena = &param->arena;
+  int ret = parse_container(&p, param->root, TokEOF);
+  g_ptr_array_free(p.values, TRUE);
+  if (ret < 0) {
     bot_param_destroy(param);
     return NULL;
   }
   return param;
 }
 
+static BotParam* _new_from_file(const char* filename) {
+  GMappedFile* mapped = g_mapped_file_new(filename, FALSE, NULL);
+  if (mapped == NULL) {
+    err("could not open param file: %s\n", filename);
+    return NULL;
+  }
+
+  BotParam* param =
+      _new_from_buffer(g_mapped_file_get_contents(mapped),
+                       g_mapped_file_get_length(mapped), filename);
+  g_mapped_file_unref(mapped);
+  return param;
+}
+
 BotParam* bot_param_new_from_file(const char* filename) {
   BotParam* param_parent = _new_from_file(filename);
   if (!param_parent) {
@@ -935,16 +1665,601 @@ BotParam* bot_param_new_from_file(const char* filename) {
 }
 
 BotParam* bot_param_new_from_string(const char* string, int length) {
-  ParserString ps;
+  return _new_from_buffer(string, length > 0 ? length : 0, NULL);
+}
+
+char* bot_param_get_snapshot_filename(const char* server_name) {
+  const char* filename = getenv(BOT_PARAM_SNAPSHOT_FILE_ENV);
+  if (filename != NULL) {
+    return *filename ? g_strdup(filename) : NULL;
+  }
+
+  const char* param_prefix = server_name;
+  if (!param_prefix) {
+    param_prefix = getenv("BOT_PARAM_SERVER_NAME");
+  }
+  char* basename = g_strconcat("bot-param-", param_prefix ?: "", "snapshot",
+                               NULL);
+  char* result = g_build_filename(g_get_user_runtime_dir(), basename, NULL);
+  g_free(basename);
+  return result;
+}
+
+int bot_param_write_snapshot_file(const char* filename, int64_t server_id,
+                                  int64_t sequence_number, const char* params) {
+  SnapshotFileHeader header;
+  memcpy(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic));
+  header.server_id = server_id;
+  header.sequence_number = sequence_number;
+  header.params_len = strlen(params);
+
+  gsize size = sizeof(header) + header.params_len + 1;
+  char* contents = g_malloc(size);
+  memcpy(contents, &header, sizeof(header));
+  memcpy(contents + sizeof(header), params, header.params_len + 1);
+
+  // Write a temporary file that only we can read and write, and rename it, so
+  // clients never see a partially written snapshot.
+  char* tmp_filename = g_strconcat(filename, ".XXXXXX", NULL);
+  int ret = -1;
+  int fd = g_mkstemp_full(tmp_filename, O_WRONLY, S_IRUSR | S_IWUSR);
+  if (fd >= 0) {
+    gsize written = 0;
+    while (written < size) {
+      ssize_t n = write(fd, contents + written, size - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      written += n;
+    }
+    if (close(fd) == 0 && written == size &&
+        rename(tmp_filename, filename) == 0) {
+      ret = 0;
+    }
+  }
+  if (ret < 0) {
+    fprintf(stderr, "WARNING: could not write param snapshot %s: %s\n",
+            filename, g_strerror(errno));
+    if (fd >= 0) {
+      unlink(tmp_filename);
+    }
+  }
+  g_free(tmp_filename);
+  g_free(contents);
+  return ret;
+}
+
+BotParam* bot_param_new_from_snapshot_file(const char* filename) {
+  int fd = open(filename, O_RDONLY | O_NOFOLLOW);
+  if (fd < 0) {
+    return NULL;
+  }
+  // Anyone who can write the file decides the params of every client that
+  // starts from it, so only trust the ones that this user wrote.
+  struct stat st;
+  if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || st.st_uid != geteuid() ||
+      (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    fprintf(stderr,
+            "WARNING: ignoring param snapshot %s, it must be a file that only "
+            "its owner can write\n",
+            filename);
+    close(fd);
+    return NULL;
+  }
+  GMappedFile* mapped = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+  close(fd);
+  if (mapped == NULL) {
+    return NULL;
+  }
+
+  const char* contents = g_mapped_file_get_contents(mapped);
+  gsize length = g_mapped_file_get_length(mapped);
+  BotParam* param = NULL;
+  SnapshotFileHeader header;
+  if (length >= sizeof(header)) {
+    memcpy(&header, contents, sizeof(header));
+  }
+  if (length >= sizeof(header) &&
+      !memcmp(header.magic, SNAPSHOT_FILE_MAGIC, sizeof(header.magic)) &&
+      header.params_len >= 0 &&
+      (guint64)header.params_len < length - sizeof(header)) {
+    param = bot_param_new_from_string(contents + sizeof(header),
+                                      header.params_len);
+  }
+  if (param != NULL) {
+    param->server_id = header.server_id;
+    param->sequence_number = header.sequence_number;
+  }
+
+  g_mapped_file_unref(mapped);
+  return param;
+}
+
+// The binary encoding of the params sent in bot_param_packed_update_t starts
+// with a table of the distinct names and values: a varint count, then each
+// string as a varint length and its bytes.  The children of the root follow.
+//
+// The children of a container are a varint count and, for each child, the
+// varint index of its name in the table and a PACKED_CONTAINER or
+// PACKED_ARRAY byte.  A container goes on with its own children, an array
+// with a varint count of values, each a tag byte followed by:
+//
+//   PACKED_STRING   the varint index of the value in the table
+//   PACKED_INT      the zigzag varint of an integer without leading zeros
+//   PACKED_DECIMAL  the varint number of digits before the decimal point,
+//                   the number after it if there is a point, all digits as
+//                   one varint and, with an exponent, the varint number of
+//                   its digits and the varint of its magnitude
+//
+// The upper bits of the tag of a decimal hold the PACKED_DECIMAL_* flags.
+// Numbers are kept as decimal digits rather than as doubles, so that every
+// value decodes to exactly the text it was encoded from without formatting
+// floating point numbers on either side.
+#define PACKED_CONTAINER 0
+#define PACKED_ARRAY 1
+
+#define PACKED_STRING 0
+#define PACKED_INT 1
+#define PACKED_DECIMAL 2
+#define PACKED_TAG_BITS 2
+
+#define PACKED_DECIMAL_NEGATIVE 0x01
+#define PACKED_DECIMAL_POINT 0x02
+#define PACKED_DECIMAL_EXP 0x04
+#define PACKED_DECIMAL_EXP_UPPER 0x08
+#define PACKED_DECIMAL_EXP_PLUS 0x10
+#define PACKED_DECIMAL_EXP_MINUS 0x20
+
+// All digits of a decimal fit in a guint64, and the magnitude of an exponent
+// in a gint32.
+#define PACKED_MAX_DIGITS 19
+#define PACKED_MAX_EXP_DIGITS 9
+
+// Large enough for a decimal with the most digits there can be.
+#define PACKED_NUMBER_BUF_SIZE 48
+
+// Containers nested deeper than this are rejected by the decoder.
+#define PACKED_MAX_DEPTH 1000
+
+typedef struct {
+  GByteArray* tree;
+  // Index + 1 of each string in table.
+  GHashTable* indices;
+  GPtrArray* table;
+} Packer;
+
+static void put_varint(GByteArray* out, guint64 val) {
+  guint8 buf[10];
+  int n = 0;
+  while (val >= 0x80) {
+    buf[n++] = (guint8)(val | 0x80);
+    val >>= 7;
+  }
+  buf[n++] = (guint8)val;
+  g_byte_array_append(out, buf, n);
+}
+
+static void put_byte(GByteArray* out, int val) {
+  guint8 byte = (guint8)val;
+  g_byte_array_append(out, &byte, 1);
+}
+
+static void put_string(Packer* pk, const char* str) {
+  guint index = GPOINTER_TO_UINT(g_hash_table_lookup(pk->indices, str));
+  if (index == 0) {
+    g_ptr_array_add(pk->table, (gpointer)str);
+    index = pk->table->len;
+    g_hash_table_insert(pk->indices, (gpointer)str, GUINT_TO_POINTER(index));
+  }
+  put_varint(pk->tree, index - 1);
+}
+
+// Returns the number of digits at the start of str, and their value in val
+// if there are no more than PACKED_MAX_DIGITS.
+static int scan_digits(const char* str, guint64* val) {
+  int n = 0;
+  *val = 0;
+  while (str[n] >= '0' && str[n] <= '9') {
+    if (n < PACKED_MAX_DIGITS) {
+      *val = *val * 10 + (str[n] - '0');
+    }
+    n++;
+  }
+  return n;
+}
+
+// Writes val as exactly num_digits digits, with leading zeros.
+static void print_digits(char* out, guint64 val, int num_digits) {
+  int i;
+  for (i = num_digits - 1; i >= 0; i--) {
+    out[i] = '0' + (char)(val % 10);
+    val /= 10;
+  }
+}
+
+static int count_digits(guint64 val) {
+  int n = 1;
+  while (val >= 10) {
+    val /= 10;
+    n++;
+  }
+  return n;
+}
+
+// Packs str as a PACKED_INT or PACKED_DECIMAL if it has that form, and returns
+// whether it did.
+static int pack_number(GByteArray* out, const char* str) {
+  const char* p = str;
+  int flags = 0;
+  if (*p == '-') {
+    flags |= PACKED_DECIMAL_NEGATIVE;
+    p++;
+  }
+  guint64 mantissa;
+  int int_digits = scan_digits(p, &mantissa);
+  int leading_zero = int_digits > 1 && p[0] == '0';
+  p += int_digits;
+
+  // "-0" and leading zeros would not survive as an integer
+  if (*p == '\0' && int_digits > 0 && int_digits < PACKED_MAX_DIGITS &&
+      !leading_zero && !(mantissa == 0 && (flags & PACKED_DECIMAL_NEGATIVE))) {
+    gint64 val = (flags & PACKED_DECIMAL_NEGATIVE) ? -(gint64)mantissa
+                                                   : (gint64)mantissa;
+    put_byte(out, PACKED_INT);
+    put_varint(out, ((guint64)val << 1) ^ (guint64)(val >> 63));
+    return 1;
+  }
+
+  int frac_digits = 0;
+  guint64 frac = 0;
+  if (*p == '.') {
+    flags |= PACKED_DECIMAL_POINT;
+    frac_digits = scan_digits(p + 1, &frac);
+    p += 1 + frac_digits;
+  }
+  int num_digits = int_digits + frac_digits;
+  if (num_digits == 0 || num_digits > PACKED_MAX_DIGITS) {
+    return 0;
+  }
+  int i;
+  for (i = 0; i < frac_digits; i++) {
+    mantissa *= 10;
+  }
+  mantissa += frac;
+
+  int exp_digits = 0;
+  guint64 exp = 0;
+  if (*p == 'e' || *p == 'E') {
+    flags |= PACKED_DECIMAL_EXP | (*p == 'E' ? PACKED_DECIMAL_EXP_UPPER : 0);
+    p++;
+    if (*p == '+') {
+      flags |= PACKED_DECIMAL_EXP_PLUS;
+      p++;
+    } else if (*p == '-') {
+      flags |= PACKED_DECIMAL_EXP_MINUS;
+      p++;
+    }
+    exp_digits = scan_digits(p, &exp);
+    p += exp_digits;
+    if (exp_digits == 0 || exp_digits > PACKED_MAX_EXP_DIGITS) {
+      return 0;
+    }
+  }
+  if (*p != '\0') {
+    return 0;
+  }
+
+  put_byte(out, PACKED_DECIMAL | flags << PACKED_TAG_BITS);
+  put_varint(out, int_digits);
+  if (flags & PACKED_DECIMAL_POINT) {
+    put_varint(out, frac_digits);
+  }
+  put_varint(out, mantissa);
+  if (flags & PACKED_DECIMAL_EXP) {
+    put_varint(out, exp_digits);
+    put_varint(out, exp);
+  }
+  return 1;
+}
+
+static void pack_value(Packer* pk, const char* str) {
+  if (!pack_number(pk->tree, str)) {
+    put_byte(pk->tree, PACKED_STRING);
+    put_string(pk, str);
+  }
+}
+
+static void pack_children(Packer* pk, const BotParamElement* el) {
+  int count = 0;
+  const BotParamElement* child;
+  for (child = el->children; child; child = child->next) {
+    count++;
+  }
+  put_varint(pk->tree, count);
+
+  for (child = el->children; child; child = child->next) {
+    put_string(pk, child->name);
+    if (child->type == BotParamContainer) {
+      put_byte(pk->tree, PACKED_CONTAINER);
+      pack_children(pk, child);
+    } else {
+      put_byte(pk->tree, PACKED_ARRAY);
+      put_varint(pk->tree, child->num_values);
+      int i;
+      for (i = 0; i < child->num_values; i++) {
+        pack_value(pk, child->values[i]);
+      }
+    }
+  }
+}
+
+uint8_t* bot_param_pack(BotParam* param, int compress, int* length,
+                        int* size) {
+  Packer pk;
+  pk.tree = g_byte_array_new();
+  pk.indices = g_hash_table_new(g_str_hash, g_str_equal);
+  pk.table = g_ptr_array_new();
+
+  GByteArray* out = g_byte_array_new();
+  g_mutex_lock(param->lock);
+  pack_children(&pk, param->root);
+  put_varint(out, pk.table->len);
+  guint i;
+  for (i = 0; i < pk.table->len; i++) {
+    const char* str = g_ptr_array_index(pk.table, i);
+    size_t len = strlen(str);
+    put_varint(out, len);
+    g_byte_array_append(out, (const guint8*)str, len);
+  }
+  g_mutex_unlock(param->lock);
+  g_byte_array_append(out, pk.tree->data, pk.tree->len);
+
+  g_byte_array_free(pk.tree, TRUE);
+  g_hash_table_destroy(pk.indices);
+  g_ptr_array_free(pk.table, TRUE);
+
+  *size = out->len;
+  if (!compress) {
+    *length = out->len;
+    return g_byte_array_free(out, FALSE);
+  }
+
+  uLongf compressed_len = compressBound(out->len);
+  uint8_t* compressed = g_malloc(compressed_len);
+  int ret = compress2(compressed, &compressed_len, out->data, out->len,
+                      Z_BEST_SPEED);
+  g_byte_array_free(out, TRUE);
+  if (ret != Z_OK) {
+    fprintf(stderr, "ERROR: could not compress params (%d)\n", ret);
+    g_free(compressed);
+    return NULL;
+  }
+  *length = compressed_len;
+  return compressed;
+}
+
+typedef struct {
+  const uint8_t* pos;
+  const uint8_t* end;
+  int error;
+  char** table;
+  guint64 table_len;
+  ParamArena** arena;
+} Unpacker;
+
+static guint64 get_varint(Unpacker* up) {
+  guint64 val = 0;
+  int shift;
+  for (shift = 0; shift < 64 && up->pos < up->end; shift += 7) {
+    guint8 byte = *up->pos++;
+    val |= (guint64)(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return val;
+    }
+  }
+  up->error = 1;
+  return 0;
+}
+
+static int get_byte(Unpacker* up) {
+  if (up->pos >= up->end) {
+    up->error = 1;
+    return -1;
+  }
+  return *up->pos++;
+}
+
+static char* get_string(Unpacker* up) {
+  guint64 index = get_varint(up);
+  if (index >= up->table_len) {
+    up->error = 1;
+    return NULL;
+  }
+  return up->table[index];
+}
+
+// Decodes the digits of a PACKED_DECIMAL into buf and returns their length,
+// or -1.
+static int unpack_decimal(Unpacker* up, int flags, char* buf) {
+  guint64 int_digits = get_varint(up);
+  guint64 frac_digits = (flags & PACKED_DECIMAL_POINT) ? get_varint(up) : 0;
+  guint64 mantissa = get_varint(up);
+  guint64 exp_digits = 0;
+  guint64 exp = 0;
+  if (flags & PACKED_DECIMAL_EXP) {
+    exp_digits = get_varint(up);
+    exp = get_varint(up);
+  }
+  guint64 num_digits = int_digits + frac_digits;
+  if (up->error || num_digits == 0 || int_digits > PACKED_MAX_DIGITS ||
+      num_digits > PACKED_MAX_DIGITS ||
+      count_digits(mantissa) > (int)num_digits ||
+      ((flags & PACKED_DECIMAL_EXP) &&
+       (exp_digits == 0 || exp_digits > PACKED_MAX_EXP_DIGITS ||
+        count_digits(exp) > (int)exp_digits))) {
+    return -1;
+  }
+
+  int n = 0;
+  if (flags & PACKED_DECIMAL_NEGATIVE) {
+    buf[n++] = '-';
+  }
+  char digits[PACKED_MAX_DIGITS];
+  print_digits(digits, mantissa, num_digits);
+  memcpy(buf + n, digits, int_digits);
+  n += int_digits;
+  if (flags & PACKED_DECIMAL_POINT) {
+    buf[n++] = '.';
+    memcpy(buf + n, digits + int_digits, frac_digits);
+    n += frac_digits;
+  }
+  if (flags & PACKED_DECIMAL_EXP) {
+    buf[n++] = (flags & PACKED_DECIMAL_EXP_UPPER) ? 'E' : 'e';
+    if (flags & PACKED_DECIMAL_EXP_PLUS) {
+      buf[n++] = '+';
+    } else if (flags & PACKED_DECIMAL_EXP_MINUS) {
+      buf[n++] = '-';
+    }
+    print_digits(buf + n, exp, exp_digits);
+    n += exp_digits;
+  }
+  buf[n] = '\0';
+  return n;
+}
+
+static char* unpack_value(Unpacker* up) {
+  int tag = get_byte(up);
+  char buf[PACKED_NUMBER_BUF_SIZE];
+  int n = -1;
+  if (tag == PACKED_STRING) {
+    return get_string(up);
+  } else if (tag == PACKED_INT) {
+    guint64 zigzag = get_varint(up);
+    gint64 val = (gint64)(zigzag >> 1) ^ -(gint64)(zigzag & 1);
+    guint64 magnitude = val < 0 ? -(guint64)val : (guint64)val;
+    n = 0;
+    if (val < 0) {
+      buf[n++] = '-';
+    }
+    int num_digits = count_digits(magnitude);
+    print_digits(buf + n, magnitude, num_digits);
+    n += num_digits;
+    buf[n] = '\0';
+  } else if (tag >= 0 &&
+             (tag & ((1 << PACKED_TAG_BITS) - 1)) == PACKED_DECIMAL &&
+             !((tag >> PACKED_TAG_BITS) & PACKED_DECIMAL_EXP_PLUS &&
+               (tag >> PACKED_TAG_BITS) & PACKED_DECIMAL_EXP_MINUS)) {
+    n = unpack_decimal(up, tag >> PACKED_TAG_BITS, buf);
+  }
+  if (up->error || n < 0) {
+    up->error = 1;
+    return NULL;
+  }
+  return arena_strdup(up->arena, buf);
+}
 
-  memset(&ps, 0, sizeof(ParserString));
-  ps.p.get_ch = get_ch_string;
-  ps.p.type = ParserTypeString;
-  ps.string = string;
-  ps.length = length;
+static void unpack_children(Unpacker* up, BotParamElement* parent,
+                            int depth) {
+  // every child takes at least two bytes
+  guint64 count = get_varint(up);
+  if (count > (guint64)(up->end - up->pos) / 2 || depth > PACKED_MAX_DEPTH) {
+    up->error = 1;
+    return;
+  }
+
+  BotParamElement** nptr = &parent->children;
+  guint64 i;
+  for (i = 0; i < count && !up->error; i++) {
+    BotParamElement* el = arena_alloc(up->arena, sizeof(BotParamElement));
+    memset(el, 0, sizeof(BotParamElement));
+    el->name = get_string(up);
+    el->data_type = BotParamDataString;
+    el->arena_flags = ARENA_ELEMENT | ARENA_VALUES;
+    el->parent = parent;
+    *nptr = el;
+    nptr = &el->next;
+
+    int kind = get_byte(up);
+    if (kind == PACKED_CONTAINER) {
+      el->type = BotParamContainer;
+      unpack_children(up, el, depth + 1);
+    } else if (kind == PACKED_ARRAY) {
+      el->type = BotParamArray;
+      guint64 num_values = get_varint(up);
+      if (num_values > (guint64)(up->end - up->pos) / 2) {
+        up->error = 1;
+        return;
+      }
+      el->values = arena_alloc(up->arena, (num_values ?: 1) * sizeof(char*));
+      guint64 j;
+      for (j = 0; j < num_values && !up->error; j++) {
+        el->values[j] = unpack_value(up);
+      }
+      el->num_values = j;
+    } else {
+      up->error = 1;
+    }
+  }
+}
+
+BotParam* bot_param_new_from_packed(const uint8_t* data, int length, int size,
+                                    int compressed) {
+  uint8_t* uncompressed = NULL;
+  if (compressed) {
+    // zlib does not compress by more than about 1032:1
+    if (size < 0 || length < 0 || size / 1032 > length) {
+      return NULL;
+    }
+    uncompressed = malloc(size ?: 1);
+    uLongf uncompressed_len = size;
+    if (uncompress(uncompressed, &uncompressed_len, data, length) != Z_OK ||
+        uncompressed_len != (uLongf)size) {
+      free(uncompressed);
+      return NULL;
+    }
+    data = uncompressed;
+    length = size;
+  }
 
   BotParam* param = _bot_param_new();
-  if (parse_container(&ps.p, param->root, TokEOF) < 0) {
+  Unpacker up;
+  memset(&up, 0, sizeof(up));
+  up.pos = data;
+  up.end = data + MAX(length, 0);
+  up.arena = &param->arena;
+
+  // every string takes at least one byte
+  up.table_len = get_varint(&up);
+  if (up.table_len > (guint64)(up.end - up.pos)) {
+    up.error = 1;
+    up.table_len = 0;
+  }
+  up.table = malloc((up.table_len ?: 1) * sizeof(char*));
+  guint64 i;
+  for (i = 0; i < up.table_len && !up.error; i++) {
+    guint64 len = get_varint(&up);
+    if (len > (guint64)(up.end - up.pos)) {
+      up.error = 1;
+      break;
+    }
+    up.table[i] = arena_alloc(up.arena, len + 1);
+    memcpy(up.table[i], up.pos, len);
+    up.table[i][len] = '\0';
+    up.pos += len;
+  }
+  if (!up.error) {
+    unpack_children(&up, param->root, 0);
+  }
+  if (up.pos != up.end) {
+    up.error = 1;
+  }
+
+  free(up.table);
+  free(uncompressed);
+  if (up.error) {
     bot_param_destroy(param);
     return NULL;
   }
@@ -978,10 +2293,104 @@ static BotParamElement* find_key(BotParamElement* el, const char* key,
   return NULL;
 }
 
-static int cast_to_int(const char* key, const char* val, int* out) {
+static void index_children(GHashTable* index, BotParamElement* el,
+                           const char* prefix) {
+  BotParamElement* child;
+  for (child = el->children; child; child = child->next) {
+    char* key = prefix ? g_strconcat(prefix, ".", child->name, NULL)
+                       : g_strdup(child->name);
+    g_hash_table_insert(index, key, child);
+    index_children(index, child, key);
+  }
+}
+
+// Builds the index of param if it does not have one yet.  Must be called with
+// param->lock held.
+static void build_index(BotParam* param) {
+  if (param->index == NULL) {
+    param->index = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    param->inherited =
+        g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    index_children(param->index, param->root, NULL);
+  }
+}
+
+// Same as find_key(param->root, key, inherit), but resolved through the hash
+// index.  Must be called with param->lock held, unless param is frozen: the
+// index of a frozen tree is built before it is shared, and lookups in it that
+// fall back to inheritance are not cached.
+static BotParamElement* lookup_key(BotParam* param, const char* key,
+                                   int inherit) {
+  build_index(param);
+
+  BotParamElement* el = g_hash_table_lookup(param->index, key);
+  if (el != NULL || !inherit) {
+    return el;
+  }
+
+  gpointer cached;
+  if (param->inherited != NULL &&
+      g_hash_table_lookup_extended(param->inherited, key, NULL, &cached)) {
+    return cached;
+  }
+
+  // Only the last component of a key is inherited: find the container named
+  // by the rest of the key, then look for the last component in it and each
+  // of its ancestors.
+  const char* name = strrchr(key, '.');
+  if (name != NULL) {
+    char* path = g_strndup(key, name - key);
+    name++;
+    if (g_hash_table_lookup(param->index, path) != NULL) {
+      char* parent_end = strrchr(path, '.');
+      while (el == NULL) {
+        if (parent_end != NULL) {
+          *parent_end = '\0';
+          char* candidate = g_strconcat(path, ".", name, NULL);
+          el = g_hash_table_lookup(param->index, candidate);
+          g_free(candidate);
+          parent_end = strrchr(path, '.');
+        } else {
+          el = g_hash_table_lookup(param->index, name);
+          break;
+        }
+      }
+    }
+    g_free(path);
+  }
+  if (param->inherited != NULL) {
+    g_hash_table_insert(param->inherited, g_strdup(key), el);
+  }
+  return el;
+}
+
+static int parse_int(const char* val, int* out) {
   char* end;
   *out = strtol(val, &end, 0);
-  if (end == val || *end != '\0') {
+  return (end == val || *end != '\0') ? -1 : 0;
+}
+
+static int parse_boolean(const char* val, int* out) {
+  if (!strcasecmp(val, "y") || !strcasecmp(val, "yes") ||
+      !strcasecmp(val, "true") || !strcmp(val, "1")) {
+    *out = 1;
+  } else if (!strcasecmp(val, "n") || !strcasecmp(val, "no") ||
+             !strcasecmp(val, "false") || !strcmp(val, "0")) {
+    *out = 0;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+static int parse_double(const char* val, double* out) {
+  char* end;
+  *out = strtod(val, &end);
+  return (end == val || *end != '\0') ? -1 : 0;
+}
+
+static int cast_to_int(const char* key, const char* val, int* out) {
+  if (parse_int(val, out) < 0) {
     fprintf(stderr,
             "Error: key \"%s\" (\"%s\") did not cast "
             "properly to int\n",
@@ -992,13 +2401,7 @@ static int cast_to_int(const char* key, const char* val, int* out) {
 }
 
 static int cast_to_boolean(const char* key, const char* val, int* out) {
-  if (!strcasecmp(val, "y") || !strcasecmp(val, "yes") ||
-      !strcasecmp(val, "true") || !strcmp(val, "1")) {
-    *out = 1;
-  } else if (!strcasecmp(val, "n") || !strcasecmp(val, "no") ||
-             !strcasecmp(val, "false") || !strcmp(val, "0")) {
-    *out = 0;
-  } else {
+  if (parse_boolean(val, out) < 0) {
     fprintf(stderr,
             "Error: key \"%s\" (\"%s\") did not cast "
             "properly to boolean\n",
@@ -1009,9 +2412,7 @@ static int cast_to_boolean(const char* key, const char* val, int* out) {
 }
 
 static double cast_to_double(const char* key, const char* val, double* out) {
-  char* end;
-  *out = strtod(val, &end);
-  if (end == val || *end != '\0') {
+  if (parse_double(val, out) < 0) {
     fprintf(stderr,
             "Error: key \"%s\" (\"%s\") did not cast "
             "properly to double\n",
@@ -1021,25 +2422,98 @@ static double cast_to_double(const char* key, const char* val, double* out) {
   return 0;
 }
 
+// Return all of el's values cast to the requested type, casting them on the
+// first call.  Return NULL if some value does not cast, in which case the
+// getters cast value by value to report the error.  Readers of a frozen tree
+// may get here concurrently, so the casts are published atomically and the
+// one that loses the race is dropped.
+static const int* get_int_values(BotParamElement* el) {
+  int* vals = g_atomic_pointer_get(&el->int_values);
+  if (vals != NULL ||
+      (g_atomic_int_get(&el->cast_failed) & (1 << BotParamDataInt))) {
+    return vals;
+  }
+  vals = malloc((el->num_values ?: 1) * sizeof(int));
+  int i;
+  for (i = 0; i < el->num_values; i++) {
+    if (parse_int(el->values[i], vals + i) < 0) {
+      free(vals);
+      g_atomic_int_or(&el->cast_failed, 1 << BotParamDataInt);
+      return NULL;
+    }
+  }
+  if (!g_atomic_pointer_compare_and_exchange(&el->int_values, NULL, vals)) {
+    free(vals);
+    vals = g_atomic_pointer_get(&el->int_values);
+  }
+  return vals;
+}
+
+static const int* get_boolean_values(BotParamElement* el) {
+  int* vals = g_atomic_pointer_get(&el->boolean_values);
+  if (vals != NULL ||
+      (g_atomic_int_get(&el->cast_failed) & (1 << BotParamDataBool))) {
+    return vals;
+  }
+  vals = malloc((el->num_values ?: 1) * sizeof(int));
+  int i;
+  for (i = 0; i < el->num_values; i++) {
+    if (parse_boolean(el->values[i], vals + i) < 0) {
+      free(vals);
+      g_atomic_int_or(&el->cast_failed, 1 << BotParamDataBool);
+      return NULL;
+    }
+  }
+  if (!g_atomic_pointer_compare_and_exchange(&el->boolean_values, NULL, vals)) {
+    free(vals);
+    vals = g_atomic_pointer_get(&el->boolean_values);
+  }
+  return vals;
+}
+
+static const double* get_double_values(BotParamElement* el) {
+  double* vals = g_atomic_pointer_get(&el->double_values);
+  if (vals != NULL ||
+      (g_atomic_int_get(&el->cast_failed) & (1 << BotParamDataDouble))) {
+    return vals;
+  }
+  vals = malloc((el->num_values ?: 1) * sizeof(double));
+  int i;
+  for (i = 0; i < el->num_values; i++) {
+    if (parse_double(el->values[i], vals + i) < 0) {
+      free(vals);
+      g_atomic_int_or(&el->cast_failed, 1 << BotParamDataDouble);
+      return NULL;
+    }
+  }
+  if (!g_atomic_pointer_compare_and_exchange(&el->double_values, NULL, vals)) {
+    free(vals);
+    vals = g_atomic_pointer_get(&el->double_values);
+  }
+  return vals;
+}
+
 #define PRINT_KEY_NOT_FOUND(key) \
   err("WARNING: BotParam: could not find key %s!\n", (key));
 
 int bot_param_has_key(BotParam* param, const char* key) {
-  g_mutex_lock(param->lock);
-  int ret = (find_key(param->root, key, 1) != NULL);
-  g_mutex_unlock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
+  int ret = (lookup_key(params, key, 1) != NULL);
+  end_read(param, slot);
   return ret;
 }
 
 int bot_param_get_num_subkeys(BotParam* param, const char* containerKey) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = param->root;
+  BotParamElement* el = params->root;
   if ((NULL != containerKey) && (0 < strlen(containerKey))) {
-    el = find_key(param->root, containerKey, 1);
+    el = lookup_key(params, containerKey, 1);
   }
   if (NULL == el) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
 
@@ -1049,20 +2523,21 @@ int bot_param_get_num_subkeys(BotParam* param, const char* containerKey) {
     ++count;
   }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
 
   return count;
 }
 
 char** bot_param_get_subkeys(BotParam* param, const char* containerKey) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = param->root;
+  BotParamElement* el = params->root;
   if ((NULL != containerKey) && (0 < strlen(containerKey))) {
-    el = find_key(param->root, containerKey, 1);
+    el = lookup_key(params, containerKey, 1);
   }
   if (NULL == el) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return NULL;
   }
 
@@ -1079,61 +2554,83 @@ char** bot_param_get_subkeys(BotParam* param, const char* containerKey) {
     result[i] = strdup(child->name);
     i++;
   }
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return result;
 }
 
 int bot_param_get_int(BotParam* param, const char* key, int* val) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray || el->num_values < 1) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
-  int ret = cast_to_int(key, el->values[0], val);
+  const int* cast = get_int_values(el);
+  int ret = 0;
+  if (cast) {
+    *val = cast[0];
+  } else {
+    ret = cast_to_int(key, el->values[0], val);
+  }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return ret;
 }
 
 int bot_param_get_boolean(BotParam* param, const char* key, int* val) {
-  g_mutex_lock(param->lock);
-  BotParamElement* el = find_key(param->root, key, 1);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray || el->num_values < 1) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
 
-  int ret = cast_to_boolean(key, el->values[0], val);
-  g_mutex_unlock(param->lock);
+  const int* cast = get_boolean_values(el);
+  int ret = 0;
+  if (cast) {
+    *val = cast[0];
+  } else {
+    ret = cast_to_boolean(key, el->values[0], val);
+  }
+  end_read(param, slot);
   return ret;
 }
 
 int bot_param_get_double(BotParam* param, const char* key, double* val) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray || el->num_values < 1) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
-  double ret = cast_to_double(key, el->values[0], val);
+  const double* cast = get_double_values(el);
+  double ret = 0;
+  if (cast) {
+    *val = cast[0];
+  } else {
+    ret = cast_to_double(key, el->values[0], val);
+  }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return ret;
 }
 
 int bot_param_get_str(BotParam* param, const char* key, char** val) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray || el->num_values < 1) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
   *val = strdup(el->values[0]);
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return 0;
 }
 
@@ -1175,21 +2672,25 @@ char* bot_param_get_str_or_fail(BotParam* param, const char* key) {
 
 int bot_param_get_int_array(BotParam* param, const char* key, int* vals,
                             int len) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
   int i;
+  const int* cast = get_int_values(el);
   for (i = 0; i < el->num_values; i++) {
     if (len != -1 && i == len) {
       break;
     }
-    if (cast_to_int(key, el->values[i], vals + i) < 0) {
+    if (cast) {
+      vals[i] = cast[i];
+    } else if (cast_to_int(key, el->values[i], vals + i) < 0) {
       err("WARNING: BotParam: cast error parsing int array %s\n", key);
-      g_mutex_unlock(param->lock);
+      end_read(param, slot);
       return -1;
     }
   }
@@ -1199,7 +2700,7 @@ int bot_param_get_int_array(BotParam* param, const char* key, int* vals,
         i, len, key);
   }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
 
   return i;
 }
@@ -1217,21 +2718,25 @@ void bot_param_get_int_array_or_fail(BotParam* param, const char* key,
 
 int bot_param_get_boolean_array(BotParam* param, const char* key, int* vals,
                                 int len) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
   int i;
+  const int* cast = get_boolean_values(el);
   for (i = 0; i < el->num_values; i++) {
     if (len != -1 && i == len) {
       break;
     }
-    if (cast_to_boolean(key, el->values[i], vals + i) < 0) {
+    if (cast) {
+      vals[i] = cast[i];
+    } else if (cast_to_boolean(key, el->values[i], vals + i) < 0) {
       err("WARNING: BotParam: cast error parsing boolean array %s\n", key);
-      g_mutex_unlock(param->lock);
+      end_read(param, slot);
       return -1;
     }
   }
@@ -1241,7 +2746,7 @@ int bot_param_get_boolean_array(BotParam* param, const char* key, int* vals,
         i, len, key);
   }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
 
   return i;
 }
@@ -1259,21 +2764,25 @@ void bot_param_get_boolean_array_or_fail(BotParam* param, const char* key,
 
 int bot_param_get_double_array(BotParam* param, const char* key, double* vals,
                                int len) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
   int i;
+  const double* cast = get_double_values(el);
   for (i = 0; i < el->num_values; i++) {
     if (len != -1 && i == len) {
       break;
     }
-    if (cast_to_double(key, el->values[i], vals + i) < 0) {
+    if (cast) {
+      vals[i] = cast[i];
+    } else if (cast_to_double(key, el->values[i], vals + i) < 0) {
       err("WARNING: BotParam: cast error parsing double array %s\n", key);
-      g_mutex_unlock(param->lock);
+      end_read(param, slot);
       return -1;
     }
   }
@@ -1283,7 +2792,7 @@ int bot_param_get_double_array(BotParam* param, const char* key, double* vals,
         i, len, key);
   }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return i;
 }
 
@@ -1299,24 +2808,26 @@ void bot_param_get_double_array_or_fail(BotParam* param, const char* key,
 }
 
 int bot_param_get_array_len(BotParam* param, const char* key) {
-  g_mutex_lock(param->lock);
-  BotParamElement* el = find_key(param->root, key, 1);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return -1;
   }
   int ret = el->num_values;
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
   return ret;
 }
 
 char** bot_param_get_str_array_alloc(BotParam* param, const char* key) {
-  g_mutex_lock(param->lock);
+  int slot;
+  BotParam* params = begin_read(param, &slot);
 
-  BotParamElement* el = find_key(param->root, key, 1);
+  BotParamElement* el = lookup_key(params, key, 1);
   if (!el || el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
+    end_read(param, slot);
     return NULL;
   }
 
@@ -1328,7 +2839,7 @@ char** bot_param_get_str_array_alloc(BotParam* param, const char* key) {
     data[i] = strdup(el->values[i]);
   }
 
-  g_mutex_unlock(param->lock);
+  end_read(param, slot);
 
   return data;
 }
@@ -1364,7 +2875,7 @@ static BotParamElement* create_key(BotParamElement* el, const char* key) {
   }
 
   child = new_element(str);
-  add_child(NULL, el, child);
+  add_child(el, child);
   if (remainder) {
     child->type = BotParamContainer;
     return create_key(child, remainder);
@@ -1375,26 +2886,56 @@ static BotParamElement* create_key(BotParamElement* el, const char* key) {
 
 // Functions for setting key/value pairs
 
-static int set_value(BotParam* param, const char* key, const char* val) {
-  g_mutex_lock(param->lock);
-
-  BotParamElement* el = find_key(param->root, key, 0);
+// Must be called with param->lock held.
+static int set_element_value(BotParam* param, const char* key,
+                             const char* val) {
+  BotParamElement* el = lookup_key(param, key, 0);
   if (el == NULL) {
     el = create_key(param->root, key);
+
+    // Add the new element and any containers created for it to the index.
+    // New keys may shadow inherited ones, so those have to be resolved again.
+    size_t len = strlen(key);
+    size_t i;
+    for (i = 0; i <= len; i++) {
+      if (key[i] != '.' && key[i] != '\0') {
+        continue;
+      }
+      char* prefix = g_strndup(key, i);
+      if (g_hash_table_lookup(param->index, prefix) == NULL) {
+        g_hash_table_insert(param->index, prefix,
+                            find_key(param->root, prefix, 0));
+      } else {
+        g_free(prefix);
+      }
+    }
+    g_hash_table_remove_all(param->inherited);
   } else if (el->type != BotParamArray) {
-    g_mutex_unlock(param->lock);
     return -1;
   }
 
   if (el->num_values < 1) {
-    add_value(NULL, el, val);
+    add_value(el, val);
   } else {
+    clear_casts(el);
+    own_values(el);
     free(el->values[0]);
     el->values[0] = strdup(val);
   }
+  return 1;
+}
 
+static int set_value(BotParam* param, const char* key, const char* val) {
+  if (param->frozen) {
+    return -1;
+  }
+  g_mutex_lock(param->lock);
+  int ret = set_element_value(param, key, val);
+  if (ret > 0) {
+    invalidate_published(param);
+  }
   g_mutex_unlock(param->lock);
-  return 1;
+  return ret;
 }
 
 int bot_param_set_int(BotParam* param, const char* key, int val) {
@@ -1417,6 +2958,41 @@ int bot_param_set_str(BotParam* param, const char* key, const char* val) {
   return set_value(param, key, val);
 }
 
+int bot_param_set_str_multiple(BotParam* param, const char** keys,
+                               const char** vals, int num) {
+  if (param->frozen) {
+    return -1;
+  }
+  g_mutex_lock(param->lock);
+
+  // Check every key before setting any, so that a failure leaves the params
+  // untouched.
+  int i;
+  int j;
+  for (i = 0; i < num; i++) {
+    BotParamElement* el = lookup_key(param, keys[i], 0);
+    if (el != NULL && el->type != BotParamArray) {
+      g_mutex_unlock(param->lock);
+      return -1;
+    }
+    size_t len = strlen(keys[i]);
+    for (j = 0; j < num; j++) {
+      if (j != i && !strncmp(keys[i], keys[j], len) && keys[j][len] == '.') {
+        g_mutex_unlock(param->lock);
+        return -1;
+      }
+    }
+  }
+
+  for (i = 0; i < num; i++) {
+    set_element_value(param, keys[i], vals[i]);
+  }
+  invalidate_published(param);
+
+  g_mutex_unlock(param->lock);
+  return num;
+}
+
 // Functions for setting array of values
 
 int bot_param_set_int_array(BotParam* param, const char* key, int* vals,
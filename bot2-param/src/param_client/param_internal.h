@@ -21,12 +21,18 @@
 #ifndef BOT2_PARAM_BOT_PARAM_PARAM_INTERNAL_H_
 #define BOT2_PARAM_BOT_PARAM_PARAM_INTERNAL_H_
 
+#include <stdint.h>
+
 #include "param_client.h"
 
 #define BOT_PARAM_UPDATE_CHANNEL "PARAM_UPDATE"
 #define BOT_PARAM_REQUEST_CHANNEL "PARAM_REQUEST"
 #define BOT_PARAM_SET_CHANNEL "PARAM_SET"
+#define BOT_PARAM_DELTA_CHANNEL "PARAM_DELTA"
+#define BOT_PARAM_UPDATE_PACKED_CHANNEL "PARAM_UPDATE_PACKED"
+#define BOT_PARAM_REQUEST_PACKED_CHANNEL "PARAM_REQUEST_PACKED"
 #define BOT_PARAM_INCLUDE_KEYWORD "INCLUDE"
+#define BOT_PARAM_SNAPSHOT_FILE_ENV "BOT_PARAM_SNAPSHOT_FILE"
 
 #ifdef __cplusplus
 extern "C" {
@@ -84,6 +90,22 @@ int bot_param_set_double(BotParam* param, const char* key, double val);
  */
 int bot_param_set_str(BotParam* param, const char* key, const char* val);
 
+/**
+ * bot_param_set_str_multiple:
+ * @param: The configuration.
+ * @keys: The keys to look for (or create).
+ * @vals: The values to set them to.
+ * @num: Number of members in @keys and @vals.
+ *
+ * Sets several keys as one transaction: either all of them are set, or none
+ * is (when one of the keys names a container, or is a prefix of another key
+ * in @keys).  Readers of @param never see only some of the new values.
+ *
+ * Returns: @num on success, -1 on failure.
+ */
+int bot_param_set_str_multiple(BotParam* param, const char** keys,
+                               const char** vals, int num);
+
 /**
  * bot_param_set_int_array:
  * @param: The configuration.
@@ -144,6 +166,77 @@ int bot_param_set_double_array(BotParam* param, const char* key, double* vals,
 int bot_param_set_str_array(BotParam* param, const char* key, const char** vals,
                             int len);
 
+/**
+ * bot_param_get_snapshot_filename:
+ * @server_name: Name of the param-server, or %NULL to use the
+ * BOT_PARAM_SERVER_NAME environment variable.
+ *
+ * The param-server keeps a snapshot of its params in this file, in the
+ * runtime directory of the user, so that the clients of that user on the same
+ * host can start without waiting for it.  The path can be overridden with the
+ * BOT_PARAM_SNAPSHOT_FILE environment variable.
+ *
+ * Returns: the path of the snapshot file (free with g_free()), or %NULL if
+ * BOT_PARAM_SNAPSHOT_FILE is set to the empty string.
+ */
+char* bot_param_get_snapshot_filename(const char* server_name);
+
+/**
+ * bot_param_write_snapshot_file:
+ * @filename: The snapshot file to write.
+ * @server_id: Id of the param-server that published @params.
+ * @sequence_number: Version number of @params.
+ * @params: All params, as written by bot_param_write_to_string().
+ *
+ * Atomically replaces @filename with a snapshot of @params, readable and
+ * writable by the current user only.
+ *
+ * Returns: 0 on success, -1 on failure.
+ */
+int bot_param_write_snapshot_file(const char* filename, int64_t server_id,
+                                  int64_t sequence_number, const char* params);
+
+/**
+ * bot_param_new_from_snapshot_file:
+ * @filename: A snapshot file written by bot_param_write_snapshot_file().
+ *
+ * Parses the params stored in a snapshot file.  The server id and sequence
+ * number of the result are those stored in the file.
+ *
+ * Returns: a newly allocated %BotParam, or %NULL if the file is missing,
+ * invalid, not owned by the current user or writable by anyone else.
+ */
+BotParam* bot_param_new_from_snapshot_file(const char* filename);
+
+/**
+ * bot_param_pack:
+ * @param: The configuration.
+ * @compress: Whether to compress the encoded params with zlib.
+ * @length: Returns the number of bytes in the result.
+ * @size: Returns the number of bytes of the encoded params before compression.
+ *
+ * Encodes all params in the binary form of bot_param_packed_update_t: a table
+ * of the distinct names and values, followed by the element tree with numeric
+ * values stored as their decimal digits.
+ *
+ * Returns: a newly allocated buffer (free with g_free()), or %NULL on error.
+ */
+uint8_t* bot_param_pack(BotParam* param, int compress, int* length, int* size);
+
+/**
+ * bot_param_new_from_packed:
+ * @data: Params encoded by bot_param_pack().
+ * @length: The number of bytes in @data.
+ * @size: The size of the encoded params before compression.
+ * @compressed: Whether @data is compressed with zlib.
+ *
+ * Decodes params encoded by bot_param_pack(), without parsing them.
+ *
+ * Returns: a newly allocated %BotParam, or %NULL if @data is invalid.
+ */
+BotParam* bot_param_new_from_packed(const uint8_t* data, int length, int size,
+                                    int compressed);
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
@@ -28,7 +28,9 @@
 
 #include "bot_param/param_client.h"
 #include "lcm_util.h"
+#include "lcmtypes/bot_param_delta_t.h"
 #include "lcmtypes/bot_param_entry_t.h"
+#include "lcmtypes/bot_param_packed_update_t.h"
 #include "lcmtypes/bot_param_request_t.h"
 #include "lcmtypes/bot_param_set_t.h"
 #include "lcmtypes/bot_param_update_t.h"
@@ -37,41 +39,174 @@
 #include "../param_client/param_internal.h"
 // clang-format on
 
+// A request is answered right away.  The requests that arrive within this
+// long after a reply are answered together, with a single full snapshot, when
+// that window ends.
+#define REQUEST_COALESCE_MSEC 50
+
+// Heartbeat deltas are published every HEARTBEAT_MSEC, and every
+// FULL_UPDATE_HEARTBEATS heartbeats the full text params are published too.
+// Clients older than deltas only ever see sets through those full updates.
+#define HEARTBEAT_MSEC 5000
+#define FULL_UPDATE_HEARTBEATS 3
+
 typedef struct {
   BotParam* params;
   lcm_t* lcm;
   int64_t id;
   int32_t seqNo;
 
+  // Serialized params as of snapshot_seqNo.  Full snapshots are only sent on
+  // request, so the string is kept around until a set changes the params.
+  char* snapshot;
+  int32_t snapshot_seqNo;
+  // Copy of the snapshot that clients on this host start from, or NULL.
+  char* snapshot_filename;
+  // Compressed packed params as of packed_seqNo, or NULL.
+  uint8_t* packed;
+  int packed_length;
+  int packed_size;
+  int32_t packed_seqNo;
+
   gchar* update_channel;
   gchar* request_channel;
   gchar* set_channel;
-} param_server_t;
+  gchar* delta_channel;
+  gchar* packed_update_channel;
+  gchar* packed_request_channel;
 
-void publish_params(param_server_t* self) {
-  bot_param_update_t* update_msg =
-      (bot_param_update_t*)calloc(1, sizeof(bot_param_update_t));
+  // Window after a reply in which requests are coalesced, or 0, and which
+  // encodings the requests in it asked for.
+  guint request_timer_id;
+  int text_requested;
+  int packed_requested;
+
+  int num_heartbeats;
+} param_server_t;
 
-  int ret = bot_param_write_to_string(self->params, &update_msg->params);
+static void update_snapshot(param_server_t* self) {
+  if (self->snapshot != NULL && self->snapshot_seqNo == self->seqNo) {
+    return;
+  }
+  free(self->snapshot);
+  self->snapshot = NULL;
+  int ret = bot_param_write_to_string(self->params, &self->snapshot);
   if (ret) {
     fprintf(stderr, "ERROR: could not write message to string");
     exit(1);
   }
+  self->snapshot_seqNo = self->seqNo;
 
-  update_msg->utime = _timestamp_now();
-  update_msg->server_id = self->id;
-  update_msg->sequence_number = self->seqNo;
+  if (self->snapshot_filename != NULL) {
+    bot_param_write_snapshot_file(self->snapshot_filename, self->id,
+                                  self->seqNo, self->snapshot);
+  }
+}
 
-  bot_param_update_t_publish(self->lcm, self->update_channel, update_msg);
-  bot_param_update_t_destroy(update_msg);
+void publish_params(param_server_t* self) {
+  update_snapshot(self);
+
+  bot_param_update_t update_msg;
+  update_msg.utime = _timestamp_now();
+  update_msg.server_id = self->id;
+  update_msg.sequence_number = self->seqNo;
+  update_msg.params = self->snapshot;
+
+  bot_param_update_t_publish(self->lcm, self->update_channel, &update_msg);
 
   fprintf(stderr, ".");
 }
 
+static void publish_packed_params(param_server_t* self) {
+  if (self->packed == NULL || self->packed_seqNo != self->seqNo) {
+    g_free(self->packed);
+    self->packed = bot_param_pack(self->params, 1, &self->packed_length,
+                                  &self->packed_size);
+    if (self->packed == NULL) {
+      fprintf(stderr, "ERROR: could not pack params");
+      exit(1);
+    }
+    self->packed_seqNo = self->seqNo;
+  }
+
+  bot_param_packed_update_t update_msg;
+  update_msg.utime = _timestamp_now();
+  update_msg.server_id = self->id;
+  update_msg.sequence_number = self->seqNo;
+  update_msg.encoding = BOT_PARAM_PACKED_UPDATE_T_ENCODING_ZLIB;
+  update_msg.size = self->packed_size;
+  update_msg.length = self->packed_length;
+  update_msg.data = self->packed;
+
+  bot_param_packed_update_t_publish(self->lcm, self->packed_update_channel,
+                                    &update_msg);
+
+  fprintf(stderr, ".");
+}
+
+// Publishes the entries that turned version base_seqNo of the params into the
+// current one.  With no entries and base_seqNo == seqNo this is a heartbeat
+// that lets clients notice that they missed a delta.
+static void publish_delta(param_server_t* self, int32_t base_seqNo,
+                          bot_param_entry_t* entries, int num_entries) {
+  bot_param_delta_t delta_msg;
+  delta_msg.utime = _timestamp_now();
+  delta_msg.server_id = self->id;
+  delta_msg.base_sequence_number = base_seqNo;
+  delta_msg.sequence_number = self->seqNo;
+  delta_msg.numEntries = num_entries;
+  delta_msg.entries = entries;
+
+  bot_param_delta_t_publish(self->lcm, self->delta_channel, &delta_msg);
+}
+
+static void send_reply(param_server_t* self) {
+  if (self->text_requested) {
+    publish_params(self);
+  }
+  if (self->packed_requested) {
+    publish_packed_params(self);
+  }
+  self->text_requested = 0;
+  self->packed_requested = 0;
+}
+
+// Answers the requests of the window that just ended, and keeps coalescing
+// for another window if there were any.
+static gboolean on_request_timer(gpointer user) {
+  param_server_t* self = (param_server_t*)user;
+  if (!self->text_requested && !self->packed_requested) {
+    self->request_timer_id = 0;
+    return FALSE;
+  }
+  send_reply(self);
+  return TRUE;
+}
+
+static void schedule_reply(param_server_t* self) {
+  if (self->request_timer_id != 0) {
+    return;
+  }
+  send_reply(self);
+  self->request_timer_id =
+      g_timeout_add_full(G_PRIORITY_HIGH, REQUEST_COALESCE_MSEC,
+                         on_request_timer, (gpointer)self, NULL);
+}
+
 void on_param_request(const lcm_recv_buf_t* rbuf, const char* channel,
                       const bot_param_request_t* msg, void* user) {
   param_server_t* self = (param_server_t*)user;
-  publish_params(self);
+  self->text_requested = 1;
+  schedule_reply(self);
+}
+
+// Clients that understand the packed encoding request on their own channel,
+// so that the large text update is only sent when an older client asks.
+void on_param_packed_request(const lcm_recv_buf_t* rbuf, const char* channel,
+                             const bot_param_request_t* msg, void* user) {
+  param_server_t* self = (param_server_t*)user;
+  self->packed_requested = 1;
+  schedule_reply(self);
 }
 
 void on_param_update(const lcm_recv_buf_t* rbuf, const char* channel,
@@ -83,28 +218,52 @@ void on_param_update(const lcm_recv_buf_t* rbuf, const char* channel,
   }
 }
 
+void on_param_delta(const lcm_recv_buf_t* rbuf, const char* channel,
+                    const bot_param_delta_t* msg, void* user) {
+  param_server_t* self = (param_server_t*)user;
+  if (msg->server_id != self->id) {
+    fprintf(stderr, "WARNING: Multiple param servers detected!\n");
+  }
+}
+
 void on_param_set(const lcm_recv_buf_t* rbuf, const char* channel,
                   const bot_param_set_t* msg, void* user) {
   param_server_t* self = (param_server_t*)user;
 
   fprintf(stderr, "\ngot param set message whith the following keys:\n");
+  if (msg->numEntries <= 0) {
+    return;
+  }
+  const char** keys = calloc(msg->numEntries, sizeof(char*));
+  const char** vals = calloc(msg->numEntries, sizeof(char*));
   for (int i = 0; i < msg->numEntries; i++) {
     fprintf(stderr, "%s = %s\n", msg->entries[i].key, msg->entries[i].value);
+    keys[i] = msg->entries[i].key;
+    vals[i] = msg->entries[i].value;
+  }
 
-    if (bot_param_set_str(self->params, msg->entries[i].key,
-                          msg->entries[i].value) > 0) {
-      self->seqNo++;
-      publish_params(self);
-    } else {
-      fprintf(stderr, "error: could not set param (%s,%s)!\n",
-              msg->entries[i].key, msg->entries[i].value);
-    }
+  // The whole message is applied as one transaction, with one version number
+  // and one delta.
+  int ret =
+      bot_param_set_str_multiple(self->params, keys, vals, msg->numEntries);
+  if (ret > 0) {
+    int32_t base_seqNo = self->seqNo;
+    self->seqNo++;
+    publish_delta(self, base_seqNo, msg->entries, msg->numEntries);
+    update_snapshot(self);
+  } else {
+    fprintf(stderr, "error: could not set params, none were changed!\n");
   }
+  free(keys);
+  free(vals);
 }
 
 static gboolean on_timer(gpointer user) {
   param_server_t* self = (param_server_t*)user;
-  publish_params(self);
+  publish_delta(self, self->seqNo, NULL, 0);
+  if (++self->num_heartbeats % FULL_UPDATE_HEARTBEATS == 0) {
+    publish_params(self);
+  }
   return TRUE;
 }
 
@@ -118,6 +277,9 @@ static void usage(int argc, char** argv) {
           "   -h, --help          print this help and exit\n"
           "   -s, --server-name   publishes params from named server\n"
           "   -l, --lcm-url       Use this specified LCM URL\n"
+          "   -f, --snapshot-file Keep a snapshot of the params in this file\n"
+          "                       for clients of this user on this host to\n"
+          "                       start from\n"
           "\n",
           argv[0]);
 }
@@ -135,14 +297,16 @@ int main(int argc, char** argv) {
     exit(1);
   }
 
-  char* optstring = "hs:l:";
+  char* optstring = "hs:l:f:";
   struct option long_opts[] = {{"help", no_argument, NULL, 'h'},
                                {"server-name", required_argument, NULL, 's'},
                                {"lcm-url", required_argument, NULL, 'l'},
+                               {"snapshot-file", required_argument, NULL, 'f'},
                                {0, 0, 0, 0}};
   int c = -1;
   char* param_prefix = NULL;
   char* lcm_url = NULL;
+  char* snapshot_filename = NULL;
   while ((c = getopt_long(argc, argv, optstring, long_opts, 0)) >= 0) {
     switch (c) {
       case 's':
@@ -151,6 +315,9 @@ int main(int argc, char** argv) {
       case 'l':
         lcm_url = optarg;
         break;
+      case 'f':
+        snapshot_filename = optarg;
+        break;
       case 'h':
       default:
         usage(argc, argv);
@@ -181,17 +348,36 @@ int main(int argc, char** argv) {
       g_strconcat(param_prefix ?: "", BOT_PARAM_REQUEST_CHANNEL, NULL);
   self->set_channel =
       g_strconcat(param_prefix ?: "", BOT_PARAM_SET_CHANNEL, NULL);
+  self->delta_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_DELTA_CHANNEL, NULL);
+  self->packed_update_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_UPDATE_PACKED_CHANNEL, NULL);
+  self->packed_request_channel =
+      g_strconcat(param_prefix ?: "", BOT_PARAM_REQUEST_PACKED_CHANNEL, NULL);
+
+  if (snapshot_filename) {
+    self->snapshot_filename = g_strdup(snapshot_filename);
+  } else {
+    self->snapshot_filename = bot_param_get_snapshot_filename(param_prefix);
+  }
+  update_snapshot(self);
 
   bot_param_update_t_subscribe(self->lcm, self->update_channel, on_param_update,
                                (void*)self);
   bot_param_request_t_subscribe(self->lcm, self->request_channel,
                                 on_param_request, (void*)self);
+  bot_param_request_t_subscribe(self->lcm, self->packed_request_channel,
+                                on_param_packed_request, (void*)self);
   bot_param_set_t_subscribe(self->lcm, self->set_channel, on_param_set,
                             (void*)self);
+  bot_param_delta_t_subscribe(self->lcm, self->delta_channel, on_param_delta,
+                              (void*)self);
 
-  // timer to always publish params every 5sec
-  g_timeout_add_full(G_PRIORITY_HIGH, (guint)5.0 * 1000, on_timer,
-                     (gpointer)self, NULL);
+  // timer to publish a heartbeat delta, so that clients that missed a delta
+  // can detect the gap and request a full snapshot, and now and then the full
+  // params for clients that don't know about deltas
+  g_timeout_add_full(G_PRIORITY_HIGH, HEARTBEAT_MSEC, on_timer, (gpointer)self,
+                     NULL);
 
   g_main_loop_run(mainloop);
 
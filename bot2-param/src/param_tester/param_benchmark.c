@@ -0,0 +1,313 @@
+// -*- mode: c -*-
+// vim: set filetype=c :
+
+/*
+ * This file is part of bot2-param.
+ *
+ * bot2-param is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by the
+ * Free Software Foundation, either version 3 of the License, or (at your
+ * option) any later version.
+ *
+ * bot2-param is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE. See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with bot2-param. If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Measures the cost of bot_param_get_double() as a function of the number of
+// keys in a container.  The config holds NUM_CONTAINERS containers with
+// num_keys values and one nested container each.  Lookups pick a random
+// container and key, and are done for keys that exist, for keys that are
+// resolved by inheriting from an enclosing container, and for missing keys.
+//
+// It then measures parse throughput of bot_param_new_from_string() and
+// bot_param_new_from_file() over synthetic calibration-style configs of
+// increasing size: many sensor blocks, each with scalars, strings, matrices
+// stored as arrays and a nested container, plus comments.
+//
+// Last, it measures lookups from several threads at once, with the getters
+// taking the lock of the BotParam and with snapshot reads enabled.
+//
+// Finally, it compares the size and cost of sending the calibration configs
+// as text with the packed encoding, with and without compression.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "bot_param/param_client.h"
+// clang-format off
+#include "../param_client/param_internal.h"
+// clang-format on
+
+#define NUM_CONTAINERS 16
+#define NUM_QUERIES 200000
+
+static double time_queries(BotParam* param, char** keys) {
+  double checksum = 0;
+  int64_t start = g_get_monotonic_time();
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    double val = 0;
+    if (bot_param_get_double(param, keys[i], &val) == 0) {
+      checksum += val;
+    }
+  }
+  int64_t elapsed = g_get_monotonic_time() - start;
+  if (checksum < 0) {
+    printf("%g\n", checksum);
+  }
+  return 1e3 * elapsed / NUM_QUERIES;
+}
+
+static void run_lookups(int num_keys) {
+  GString* config = g_string_new("");
+  for (int c = 0; c < NUM_CONTAINERS; c++) {
+    g_string_append_printf(config, "container%d {\n", c);
+    for (int k = 0; k < num_keys; k++) {
+      g_string_append_printf(config, "  key%d = %d.5;\n", k, k);
+    }
+    g_string_append(config, "  nested { local = 1; }\n}\n");
+  }
+
+  int64_t start = g_get_monotonic_time();
+  BotParam* param = bot_param_new_from_string(config->str, config->len);
+  double dummy;
+  bot_param_get_double(param, "container0.key0", &dummy);
+  int64_t load_usec = g_get_monotonic_time() - start;
+
+  char** existing = malloc(NUM_QUERIES * sizeof(char*));
+  char** inherited = malloc(NUM_QUERIES * sizeof(char*));
+  char** missing = malloc(NUM_QUERIES * sizeof(char*));
+  srand(num_keys);
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    int c = rand() % NUM_CONTAINERS;
+    int k = rand() % num_keys;
+    existing[i] = g_strdup_printf("container%d.key%d", c, k);
+    inherited[i] = g_strdup_printf("container%d.nested.key%d", c, k);
+    missing[i] = g_strdup_printf("container%d.nokey%d", c, k);
+  }
+
+  printf("%8d %10.1f %14.1f %14.1f %14.1f\n", num_keys, 1e-3 * load_usec,
+         time_queries(param, existing), time_queries(param, inherited),
+         time_queries(param, missing));
+
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    g_free(existing[i]);
+    g_free(inherited[i]);
+    g_free(missing[i]);
+  }
+  free(existing);
+  free(inherited);
+  free(missing);
+  bot_param_destroy(param);
+  g_string_free(config, TRUE);
+}
+
+static GString* make_calibration_config(int num_sensors) {
+  GString* config = g_string_new("# synthetic calibration config\n");
+  srand(num_sensors);
+  for (int s = 0; s < num_sensors; s++) {
+    g_string_append_printf(config, "sensor_%d {\n", s);
+    g_string_append_printf(config, "    name = \"camera_%d\";\n", s);
+    g_string_append_printf(config, "    frame = \"sensor_frame_%d\";  # id\n",
+                           s);
+    g_string_append_printf(config, "    rate = %d;\n", 10 + s % 90);
+    g_string_append(config, "    enabled = true;\n");
+    g_string_append(config, "    intrinsics = [");
+    for (int i = 0; i < 9; i++) {
+      g_string_append_printf(config, "%s%.9f", i ? ", " : "",
+                             rand() / (double)RAND_MAX);
+    }
+    g_string_append(config, "];\n    distortion = [");
+    for (int i = 0; i < 32; i++) {
+      g_string_append_printf(config, "%s%.12e", i ? ", " : "",
+                             rand() / (double)RAND_MAX - 0.5);
+    }
+    g_string_append(config, "];\n    extrinsics {\n");
+    g_string_append_printf(config, "        relative_to = \"body\";\n");
+    g_string_append_printf(config,
+                           "        position = [%.6f, %.6f, %.6f];\n"
+                           "        rpy = [%.6f, %.6f, %.6f];\n",
+                           rand() / (double)RAND_MAX,
+                           rand() / (double)RAND_MAX,
+                           rand() / (double)RAND_MAX,
+                           rand() / (double)RAND_MAX,
+                           rand() / (double)RAND_MAX,
+                           rand() / (double)RAND_MAX);
+    g_string_append(config, "    }\n}\n");
+  }
+  return config;
+}
+
+static void run_parse(int num_sensors) {
+  GString* config = make_calibration_config(num_sensors);
+  double mb = config->len / 1e6;
+
+  char* filename = NULL;
+  int fd = g_file_open_tmp("param-benchmark-XXXXXX", &filename, NULL);
+  if (fd < 0 || !g_file_set_contents(filename, config->str, config->len,
+                                     NULL)) {
+    fprintf(stderr, "Could not write temporary config file\n");
+    exit(1);
+  }
+  close(fd);
+
+  int64_t start = g_get_monotonic_time();
+  BotParam* param = bot_param_new_from_string(config->str, config->len);
+  int64_t string_usec = g_get_monotonic_time() - start;
+  bot_param_destroy(param);
+
+  start = g_get_monotonic_time();
+  param = bot_param_new_from_file(filename);
+  int64_t file_usec = g_get_monotonic_time() - start;
+
+  start = g_get_monotonic_time();
+  bot_param_destroy(param);
+  int64_t destroy_usec = g_get_monotonic_time() - start;
+
+  printf("%8d %8.2f %12.1f %12.1f %12.1f %12.1f\n", num_sensors, mb,
+         1e-3 * string_usec, mb / (1e-6 * string_usec), 1e-3 * file_usec,
+         1e-3 * destroy_usec);
+
+  remove(filename);
+  g_free(filename);
+  g_string_free(config, TRUE);
+}
+
+typedef struct {
+  BotParam* param;
+  char** keys;
+} ReaderArgs;
+
+static gpointer reader_thread(gpointer user) {
+  ReaderArgs* args = user;
+  time_queries(args->param, args->keys);
+  return NULL;
+}
+
+static void run_threads(int num_threads) {
+  GString* config = g_string_new("container {\n");
+  for (int k = 0; k < 1000; k++) {
+    g_string_append_printf(config, "  key%d = %d.5;\n", k, k);
+  }
+  g_string_append(config, "}\n");
+
+  char** keys = malloc(NUM_QUERIES * sizeof(char*));
+  srand(num_threads);
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    keys[i] = g_strdup_printf("container.key%d", rand() % 1000);
+  }
+
+  double nsec[2];
+  for (int snapshot_reads = 0; snapshot_reads < 2; snapshot_reads++) {
+    BotParam* param = bot_param_new_from_string(config->str, config->len);
+    if (snapshot_reads) {
+      bot_param_enable_snapshot_reads(param);
+    }
+    ReaderArgs args = {param, keys};
+    GThread* threads[num_threads];
+    int64_t start = g_get_monotonic_time();
+    for (int t = 0; t < num_threads; t++) {
+      threads[t] = g_thread_new("reader", reader_thread, &args);
+    }
+    for (int t = 0; t < num_threads; t++) {
+      g_thread_join(threads[t]);
+    }
+    int64_t elapsed = g_get_monotonic_time() - start;
+    nsec[snapshot_reads] = 1e3 * elapsed / ((double)NUM_QUERIES * num_threads);
+    bot_param_destroy(param);
+  }
+
+  printf("%8d %12.1f %12.1f\n", num_threads, nsec[0], nsec[1]);
+
+  for (int i = 0; i < NUM_QUERIES; i++) {
+    g_free(keys[i]);
+  }
+  free(keys);
+  g_string_free(config, TRUE);
+}
+
+static void run_pack(int num_sensors) {
+  GString* config = make_calibration_config(num_sensors);
+  BotParam* param = bot_param_new_from_string(config->str, config->len);
+
+  int64_t start = g_get_monotonic_time();
+  char* text = NULL;
+  bot_param_write_to_string(param, &text);
+  int64_t write_usec = g_get_monotonic_time() - start;
+  int text_length = strlen(text);
+
+  start = g_get_monotonic_time();
+  BotParam* parsed = bot_param_new_from_string(text, text_length);
+  int64_t parse_usec = g_get_monotonic_time() - start;
+  bot_param_destroy(parsed);
+
+  int length[2];
+  int size;
+  int64_t pack_usec[2];
+  int64_t unpack_usec[2];
+  // the timings that are printed are those with compression
+  for (int compress = 0; compress < 2; compress++) {
+    start = g_get_monotonic_time();
+    uint8_t* packed = bot_param_pack(param, compress, &length[compress], &size);
+    pack_usec[compress] = g_get_monotonic_time() - start;
+
+    start = g_get_monotonic_time();
+    BotParam* unpacked =
+        bot_param_new_from_packed(packed, length[compress], size, compress);
+    unpack_usec[compress] = g_get_monotonic_time() - start;
+    if (unpacked == NULL) {
+      fprintf(stderr, "Could not unpack params\n");
+      exit(1);
+    }
+    bot_param_destroy(unpacked);
+    g_free(packed);
+  }
+
+  printf("%8d %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+         num_sensors, 1e-3 * text_length, 1e-3 * length[0], 1e-3 * length[1],
+         1e-3 * write_usec, 1e-3 * parse_usec, 1e-3 * pack_usec[1],
+         1e-3 * unpack_usec[1]);
+
+  free(text);
+  bot_param_destroy(param);
+  g_string_free(config, TRUE);
+}
+
+int main(int argc, char** argv) {
+  printf("%8s %10s %14s %14s %14s\n", "keys", "load ms", "existing ns",
+         "inherited ns", "missing ns");
+  int num_keys[] = {10, 100, 1000, 5000};
+  for (size_t i = 0; i < sizeof(num_keys) / sizeof(num_keys[0]); i++) {
+    run_lookups(num_keys[i]);
+  }
+
+  printf("\n%8s %8s %12s %12s %12s %12s\n", "sensors", "MB", "string ms",
+         "string MB/s", "file ms", "destroy ms");
+  int num_sensors[] = {100, 1000, 5000, 10000};
+  for (size_t i = 0; i < sizeof(num_sensors) / sizeof(num_sensors[0]); i++) {
+    run_parse(num_sensors[i]);
+  }
+
+  printf("\n%8s %12s %12s\n", "threads", "locked ns", "snapshot ns");
+  int num_threads[] = {1, 2, 4, 8};
+  for (size_t i = 0; i < sizeof(num_threads) / sizeof(num_threads[0]); i++) {
+    run_threads(num_threads[i]);
+  }
+
+  printf("\n%8s %10s %10s %10s %10s %10s %10s %10s\n", "sensors", "text KB",
+         "packed KB", "zlib KB", "write ms", "parse ms", "pack ms",
+         "unpack ms");
+  for (size_t i = 0; i < sizeof(num_sensors) / sizeof(num_sensors[0]); i++) {
+    run_pack(num_sensors[i]);
+  }
+  return 0;
+}
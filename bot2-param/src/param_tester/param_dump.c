@@ -23,6 +23,7 @@
 
 #include <lcm/lcm.h>
 
+#include "lcmtypes/bot_param_request_t.h"
 #include "lcmtypes/bot_param_update_t.h"
 // clang-format off
 #include "../param_client/param_internal.h"
@@ -40,6 +41,11 @@ int main() {
   bot_param_update_t_subscribe(lcm, BOT_PARAM_UPDATE_CHANNEL, _on_param_update,
                                NULL);
 
+  // the param-server only publishes full snapshots on request
+  bot_param_request_t req;
+  req.utime = 0;
+  bot_param_request_t_publish(lcm, BOT_PARAM_REQUEST_CHANNEL, &req);
+
   while (1) {
     lcm_handle(lcm);
   }
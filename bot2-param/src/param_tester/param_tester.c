@@ -38,6 +38,14 @@ void param_update_handler(BotParam* old_param, BotParam* new_param,
   fprintf(stderr, "some parameters were updated %p!\n", user);
 }
 
+void param_watch_handler(BotParam* param, const char* const* keys,
+                         int num_keys, int64_t utime, void* user) {
+  int i;
+  for (i = 0; i < num_keys; i++) {
+    fprintf(stderr, "%s changed\n", keys[i]);
+  }
+}
+
 int main() {
   lcm_t* lcm = lcm_create(NULL);
 
@@ -48,6 +56,7 @@ int main() {
   }
 
   bot_param_add_update_subscriber(param, param_update_handler, lcm);
+  bot_param_watch(param, "coordinate_frames.", param_watch_handler, NULL);
 
   char* s;
   int ret = bot_param_write_to_string(param, &s);